@@ -0,0 +1,151 @@
+#include <lunar/core/io.h>
+#include <lunar/core/irq.h>
+#include <lunar/core/printk.h>
+#include <lunar/lib/format.h>
+#include <lunar/sched/idle.h>
+
+#include <uacpi/uacpi.h>
+#include <uacpi/types.h>
+#include <uacpi/namespace.h>
+#include <uacpi/utilities.h>
+
+#include "cstate.h"
+
+/* The Register field of a _CST entry is a Generic Register resource */
+#define CST_REGISTER_DESCRIPTOR 0x82
+#define CST_REGISTER_MIN_LENGTH 15
+
+#define CST_SPACE_SYSTEM_IO 0x01
+#define CST_SPACE_FFH 0x7F
+#define CST_FFH_CLASS_MWAIT 2 /* The bit offset of an FFH register, the address is the MWAIT hint */
+
+#define CST_TYPE_C1 1
+#define CST_TYPE_C2 2
+
+#define CST_RESIDENCY_FACTOR 2 /* Firmware only gives the latency, a state must last this much longer to be worth it */
+
+static struct idle_driver acpi_driver = { .name = "acpi" };
+
+struct cst_register {
+	u8 space;
+	u8 bit_offset;
+	u64 address;
+};
+
+/* Entering C2 through P_LVL2 is a read from the port, the CPU wakes up on interrupts even though they're masked */
+static void enter_io(struct idle_state* state) {
+	inb((u16)state->data);
+	local_irq_enable();
+}
+
+static bool parse_register(uacpi_object* obj, struct cst_register* reg) {
+	uacpi_data_view view;
+	if (uacpi_object_get_buffer(obj, &view) != UACPI_STATUS_OK || view.length < CST_REGISTER_MIN_LENGTH)
+		return false;
+
+	const u8* bytes = view.const_bytes;
+	if (bytes[0] != CST_REGISTER_DESCRIPTOR)
+		return false;
+
+	reg->space = bytes[3];
+	reg->bit_offset = bytes[5];
+	reg->address = 0;
+	for (int i = 7; i >= 0; i--)
+		reg->address = (reg->address << 8) | bytes[7 + i];
+
+	return true;
+}
+
+/* Fill in a state from one _CST entry, a package of { Register, Type, Latency, Power } */
+static bool parse_state(uacpi_object* entry, struct idle_state* state, bool mwait) {
+	uacpi_object_array fields;
+	if (uacpi_object_get_package(entry, &fields) != UACPI_STATUS_OK || fields.count < 4)
+		return false;
+
+	struct cst_register reg;
+	uacpi_u64 type, latency;
+	if (!parse_register(fields.objects[0], &reg) ||
+			uacpi_object_get_integer(fields.objects[1], &type) != UACPI_STATUS_OK ||
+			uacpi_object_get_integer(fields.objects[2], &latency) != UACPI_STATUS_OK)
+		return false;
+
+	state->flags = 0;
+	if (reg.space == CST_SPACE_FFH && reg.bit_offset == CST_FFH_CLASS_MWAIT) {
+		if (!mwait)
+			return false;
+		state->enter = idle_enter_mwait;
+		state->data = reg.address;
+		state->flags |= IDLE_STATE_POLLING;
+	} else if (type == CST_TYPE_C1) {
+		state->enter = idle_enter_halt; /* C1 is always HLT, whatever the register says */
+	} else if (reg.space == CST_SPACE_SYSTEM_IO && type == CST_TYPE_C2 && reg.address <= U16_MAX) {
+		state->enter = enter_io;
+		state->data = reg.address;
+	} else {
+		return false; /* C3 through I/O needs bus master arbitration, which isn't supported */
+	}
+
+	if (type >= CST_TYPE_C2)
+		state->flags |= IDLE_STATE_TIMER_STOP;
+	state->exit_latency_ns = latency * 1000;
+	state->target_residency_ns = state->exit_latency_ns * CST_RESIDENCY_FACTOR;
+	snprintf(state->name, sizeof(state->name), "C%lu (%s)", type,
+			state->enter == idle_enter_mwait ? "MWAIT" : state->enter == enter_io ? "IO" : "HLT");
+
+	return true;
+}
+
+static void parse_cst(uacpi_object* cst) {
+	uacpi_object_array entries;
+	if (uacpi_object_get_package(cst, &entries) != UACPI_STATUS_OK || entries.count < 1)
+		return;
+
+	/* The first element is the number of states, which the package length already says */
+	bool mwait = idle_mwait_usable();
+	unsigned int count = 0;
+	for (size_t i = 1; i < entries.count && count < IDLE_STATES_MAX; i++) {
+		struct idle_state* state = &acpi_driver.states[count];
+		if (!parse_state(entries.objects[i], state, mwait))
+			continue;
+
+		/* States have to get deeper, a shallower one after a deeper one is useless */
+		if (count && state->exit_latency_ns < acpi_driver.states[count - 1].exit_latency_ns)
+			continue;
+		count++;
+	}
+	acpi_driver.count = count;
+}
+
+static uacpi_iteration_decision find_cst(void* user, uacpi_namespace_node* node, uacpi_u32 depth) {
+	(void)depth;
+	uacpi_object** cst = user;
+
+	static const uacpi_char* const processor_ids[] = { "ACPI0007", UACPI_NULL };
+	uacpi_object_type type;
+	if (uacpi_namespace_node_type(node, &type) != UACPI_STATUS_OK)
+		return UACPI_ITERATION_DECISION_CONTINUE;
+	if (type == UACPI_OBJECT_DEVICE && !uacpi_device_matches_pnp_id(node, processor_ids))
+		return UACPI_ITERATION_DECISION_CONTINUE;
+
+	if (uacpi_eval_simple_package(node, "_CST", cst) != UACPI_STATUS_OK)
+		return UACPI_ITERATION_DECISION_CONTINUE;
+	return UACPI_ITERATION_DECISION_BREAK;
+}
+
+void acpi_cstate_init(void) {
+	uacpi_object* cst = UACPI_NULL;
+	uacpi_namespace_for_each_child(uacpi_namespace_root(), find_cst, UACPI_NULL,
+			UACPI_OBJECT_PROCESSOR_BIT | UACPI_OBJECT_DEVICE_BIT, UACPI_MAX_DEPTH_ANY, &cst);
+	if (!cst)
+		return;
+
+	/* Every CPU gets the states of the first one, firmware describes them all the same in practice */
+	parse_cst(cst);
+	uacpi_object_unref(cst);
+
+	/* Only worth it if there's something deeper than the C1 the idle loop starts out with */
+	if (acpi_driver.count < 2)
+		return;
+	if (idle_driver_register(&acpi_driver))
+		printk(PRINTK_WARN "acpi: No usable C-states in _CST\n");
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+/**
+ * @brief Register the C-states from the processors' _CST with the idle loop
+ */
+void acpi_cstate_init(void);
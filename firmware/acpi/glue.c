@@ -11,6 +11,7 @@
 #include <lunar/core/timekeeper.h>
 #include <lunar/sched/scheduler.h>
 #include <lunar/sched/kthread.h>
+#include <lunar/sched/workqueue.h>
 #include <lunar/lib/string.h>
 #include <lunar/mm/heap.h>
 #include <lunar/mm/vmm.h>
@@ -399,7 +400,7 @@ struct uacpi_work {
 	uacpi_work_type type;
 	uacpi_work_handler handler;
 	uacpi_handle ctx;
-	struct list_node link;
+	struct work work;
 };
 
 static atomic(size_t) gpe_work_counter = atomic_init(0);
@@ -424,6 +425,7 @@ uacpi_status uacpi_kernel_schedule_work(uacpi_work_type type, uacpi_work_handler
 	work->type = type;
 	work->handler = handler;
 	work->ctx = ctx;
+	work_init(&work->work, uacpi_work, work);
 
 	/* GPE's run on the BSP to account for buggy firmware */
 	struct cpu* target_cpu = NULL;
@@ -434,15 +436,11 @@ uacpi_status uacpi_kernel_schedule_work(uacpi_work_type type, uacpi_work_handler
 		atomic_add_fetch(&notify_work_counter, 1);
 	}
 
-	int err = target_cpu ? sched_workqueue_add_on(target_cpu, uacpi_work, work) : sched_workqueue_add(uacpi_work, work);
-	if (err) {
-		if (type == UACPI_WORK_GPE_EXECUTION)
-			atomic_sub_fetch(&gpe_work_counter, 1);
-		else
-			atomic_sub_fetch(&notify_work_counter, 1);
-		slab_cache_free(work_cache, work);
-		return UACPI_STATUS_INTERNAL_ERROR;
-	}
+	/* Queueing can't fail, and a freshly initialized item is never pending */
+	if (target_cpu)
+		queue_work_on(system_wq, target_cpu, &work->work);
+	else
+		queue_work(system_wq, &work->work);
 
 	return UACPI_STATUS_OK;
 }
@@ -9,6 +9,7 @@
 #include <uacpi/event.h>
 
 #include "events.h"
+#include "cstate.h"
 
 uacpi_status acpi_finish_init(void) {
 	uacpi_status status = uacpi_namespace_load();
@@ -23,6 +24,7 @@ uacpi_status acpi_finish_init(void) {
 		return status;
 
 	uacpi_install_fixed_event_handler(UACPI_FIXED_EVENT_POWER_BUTTON, acpi_pwrbtn_event, UACPI_NULL);
+	acpi_cstate_init();
 	return UACPI_STATUS_OK;
 }
 
@@ -12,13 +12,21 @@
 #define CPUID_LEAF_HIGHEST_FUNCTION 0x00
 #define CPUID_LEAF_PROC_INFO 0x01
 #define CPUID_LEAF_FEATURE_BITS 0x01
+#define CPUID_LEAF_CACHE_PARAMS 0x04
+#define CPUID_LEAF_MONITOR 0x05
+#define CPUID_LEAF_THERMAL_POWER 0x06
+#define CPUID_LEAF_EXT_FEATURE_BITS 0x07
+#define CPUID_LEAF_EXT_TOPOLOGY 0x0B
+#define CPUID_LEAF_XSTATE 0x0D
 #define CPUID_LEAF_TSC_FREQ 0x15
+#define CPUID_LEAF_V2_EXT_TOPOLOGY 0x1F
 
 #define CPUID_EXT_LEAF_HIGHEST_FUNCTION 0x80000000
 #define CPUID_EXT_LEAF_PROC_INFO 0x80000001
 #define CPUID_EXT_LEAF_FEATURE_BITS 0x80000001
 #define CPUID_EXT_LEAF_PM_FEATURES 0x80000007
 #define CPUID_EXT_LEAF_ADDRESS_SIZES 0x80000008
+#define CPUID_EXT_LEAF_CACHE_PARAMS 0x8000001D
 
 #ifndef __ASSEMBLER__
 
@@ -11,6 +11,9 @@
 #define CTL0_CD (1 << 30)
 #define CTL0_PG (1 << 31)
 
+#define CTL3_PCID_MASK 0xFFFul
+#define CTL3_NOFLUSH (1ul << 63)
+
 #define CTL4_VME (1 << 0)
 #define CTL4_PVI (1 << 1)
 #define CTL4_TSD (1 << 2)
@@ -103,4 +106,20 @@ static inline void ctl4_write(unsigned long flags) {
 	__asm__ volatile("mov %0, %%cr4" : : "r"(flags) : "memory");
 }
 
+/**
+ * @brief Write to an extended control register, needs CR4.OSXSAVE
+ * @param reg The register, 0 for XCR0
+ * @param val The new value of the register
+ */
+static inline void xctl_write(u32 reg, u64 val) {
+	__asm__ volatile("xsetbv" : : "c"(reg), "a"((u32)val), "d"((u32)(val >> 32)) : "memory");
+}
+
+/**
+ * @brief Clear CR0.TS, without a full read and write of CR0
+ */
+static inline void ctl0_clear_ts(void) {
+	__asm__ volatile("clts" : : : "memory");
+}
+
 #endif /* __ASSEMBLER__ */
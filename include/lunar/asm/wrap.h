@@ -2,3 +2,10 @@
 
 #define cpu_relax() __asm__ volatile("pause" : : : "memory")
 #define cpu_halt() __asm__ volatile("hlt" : : : "memory")
+
+/* Watch the cache line of addr, the next MWAIT wakes up when it's written to */
+#define cpu_monitor(addr) __asm__ volatile("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory")
+
+/* STI only takes effect after the next instruction, so an interrupt can't slip in before the wait */
+#define cpu_sti_mwait(hint) __asm__ volatile("sti; mwait" : : "a"(hint), "c"(0) : "memory")
+#define cpu_sti_halt() __asm__ volatile("sti; hlt" : : : "memory")
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <lunar/core/waitqueue.h>
+
+#define COMPLETION_ALL ULONG_MAX
+
+/*
+ * A one-shot event. Every signal lets one waiter through, signaling all lets every waiter
+ * through until the completion is reset.
+ */
+struct completion {
+	unsigned long done; /* Waiters that can still get through, COMPLETION_ALL once signaled for all */
+	struct wait_queue wait;
+};
+
+#define COMPLETION_INITIALIZER(n) { .done = 0, .wait = WAIT_QUEUE_INITIALIZER(n.wait) }
+#define COMPLETION_DEFINE(n) struct completion n = COMPLETION_INITIALIZER(n)
+static inline void completion_init(struct completion* comp) {
+	comp->done = 0;
+	wait_queue_init(&comp->wait);
+}
+
+/**
+ * @brief Wait for a completion
+ *
+ * @param comp The completion
+ * @param flags Sleep flags for the thread (SCHED_SLEEP_*)
+ *
+ * @retval -EINTR Interrupted by a signal
+ * @retval 0 Successful
+ */
+int completion_wait(struct completion* comp, int flags);
+
+/**
+ * @brief Wait for a completion with a timeout
+ *
+ * @param comp The completion
+ * @param timeout_ms The max number of milliseconds to wait for
+ * @param flags Sleep flags for the thread (SCHED_SLEEP_*)
+ *
+ * @retval -EINTR Interrupted by a signal
+ * @retval -ETIMEDOUT Wait timed out
+ * @retval 0 Successful
+ */
+int completion_wait_timed(struct completion* comp, time_t timeout_ms, int flags);
+
+/**
+ * @brief Let one waiter through, now or the next time one waits
+ * @param comp The completion
+ */
+void completion_signal(struct completion* comp);
+
+/**
+ * @brief Let every waiter through, including the ones that wait later
+ * @param comp The completion
+ */
+void completion_signal_all(struct completion* comp);
+
+/**
+ * @brief Check if a wait would go through without sleeping
+ * @param comp The completion
+ * @return true if the completion was signaled
+ */
+bool completion_done(struct completion* comp);
+
+/**
+ * @brief Reset a completion so it can be used again
+ * @param comp The completion to reset
+ * @retval -EBUSY Completion has waiters
+ * @retval 0 Successful
+ */
+int completion_reset(struct completion* comp);
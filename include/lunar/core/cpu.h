@@ -5,21 +5,33 @@
 #include <lunar/lib/list.h>
 #include <lunar/lib/ringbuffer.h>
 #include <lunar/core/timekeeper.h>
+#include <lunar/core/timer.h>
 #include <lunar/core/panic.h>
 #include <lunar/core/semaphore.h>
 #include <lunar/core/limine.h>
+#include <lunar/core/percpu.h>
+#include <lunar/core/topology.h>
+#include <lunar/mm/tlb.h>
+#include <lunar/mm/vmm.h>
 
 struct cpu {
-	struct cpu* self;
+	uintptr_t percpu_offset; /* From the per-CPU template to this CPU's area, also the CPU's GSBASE */
 	u32 processor_id, lapic_id, sched_processor_id;
+	struct cpu_topology topology;
 	struct mm* mm_struct;
+	struct tlb_queue tlb_queue;
+	struct tlb_asids tlb_asids;
+	struct kstack_cache kstack_cache;
 	struct runqueue runqueue;
-	struct list_head workqueue;
-	struct semaphore workqueue_sem;
-	spinlock_t workqueue_lock;
+	struct worker_pool* worker_pool; /* Runs work queued on bound workqueues */
 	bool need_resched;
+	atomic(unsigned int) idle_wake; /* IDLE_WAKE_*, lets the idle loop be woken without an IPI */
 	struct timekeeper_source* timekeeper;
+	u32 lapic_timer_ticks; /* LAPIC timer counts per scheduler tick */
+	u64 tsc_deadline_ticks; /* TSC counts per scheduler tick, zero if the TSC-deadline timer isn't used */
+	struct timer_base timer_base;
 	unsigned long softirqs_pending;
+	struct thread* softirqd; /* Runs softirqs that didn't fit in an interrupt exit */
 };
 
 struct smp_cpus {
@@ -27,6 +39,8 @@ struct smp_cpus {
 	struct cpu* cpus[];
 };
 
+DECLARE_PER_CPU(struct cpu*, cpu_struct);
+
 void cpu_structs_init(void);
 const struct smp_cpus* smp_cpus_get(void);
 void cpu_register(void);
@@ -36,9 +50,7 @@ void cpu_register(void);
  * @return The address of the CPU struct
  */
 static inline struct cpu* current_cpu(void) {
-	struct cpu* cpu;
-	__asm__("movq %%gs:0, %0" : "=r"(cpu));
-	return cpu;
+	return this_cpu_read(cpu_struct);
 }
 
 void cpu_init_finish(void);
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <lunar/types.h>
+
+#define CPUMASK_BITS_PER_WORD (sizeof(unsigned long) * 8)
+#define CPUMASK_WORDS ((CONFIG_MAX_CPUS + CPUMASK_BITS_PER_WORD - 1) / CPUMASK_BITS_PER_WORD)
+
+/* A set of CPU's, indexed by sched_processor_id */
+struct cpumask {
+	unsigned long bits[CPUMASK_WORDS];
+};
+
+static inline void cpumask_set(struct cpumask* mask, u32 cpu) {
+	if (cpu < CONFIG_MAX_CPUS)
+		mask->bits[cpu / CPUMASK_BITS_PER_WORD] |= 1ul << (cpu % CPUMASK_BITS_PER_WORD);
+}
+
+static inline void cpumask_clear(struct cpumask* mask, u32 cpu) {
+	if (cpu < CONFIG_MAX_CPUS)
+		mask->bits[cpu / CPUMASK_BITS_PER_WORD] &= ~(1ul << (cpu % CPUMASK_BITS_PER_WORD));
+}
+
+static inline bool cpumask_test(const struct cpumask* mask, u32 cpu) {
+	if (cpu >= CONFIG_MAX_CPUS)
+		return false;
+	return !!(mask->bits[cpu / CPUMASK_BITS_PER_WORD] & (1ul << (cpu % CPUMASK_BITS_PER_WORD)));
+}
+
+static inline void cpumask_zero(struct cpumask* mask) {
+	for (size_t i = 0; i < CPUMASK_WORDS; i++)
+		mask->bits[i] = 0;
+}
+
+static inline void cpumask_fill(struct cpumask* mask) {
+	for (size_t i = 0; i < CPUMASK_WORDS; i++)
+		mask->bits[i] = ULONG_MAX;
+}
+
+/**
+ * @brief Keep only the CPU's that are in both masks
+ *
+ * @param dest Where to store the result, may be the same as a or b
+ * @param a The first mask
+ * @param b The second mask
+ *
+ * @return true if the result isn't empty
+ */
+static inline bool cpumask_and(struct cpumask* dest, const struct cpumask* a, const struct cpumask* b) {
+	unsigned long any = 0;
+	for (size_t i = 0; i < CPUMASK_WORDS; i++) {
+		dest->bits[i] = a->bits[i] & b->bits[i];
+		any |= dest->bits[i];
+	}
+	return any != 0;
+}
+
+static inline bool cpumask_empty(const struct cpumask* mask) {
+	for (size_t i = 0; i < CPUMASK_WORDS; i++) {
+		if (mask->bits[i])
+			return false;
+	}
+	return true;
+}
+
+static inline bool cpumask_equal(const struct cpumask* a, const struct cpumask* b) {
+	for (size_t i = 0; i < CPUMASK_WORDS; i++) {
+		if (a->bits[i] != b->bits[i])
+			return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Count the CPU's in a mask
+ * @param mask The mask
+ */
+static inline u32 cpumask_weight(const struct cpumask* mask) {
+	u32 weight = 0;
+	for (size_t i = 0; i < CPUMASK_WORDS; i++)
+		weight += __builtin_popcountl(mask->bits[i]);
+	return weight;
+}
+
+/**
+ * @brief Find the next CPU in a mask
+ *
+ * @param mask The mask to search
+ * @param cpu The first CPU to check
+ *
+ * @return The CPU, CONFIG_MAX_CPUS if there's none left
+ */
+static inline u32 cpumask_next(const struct cpumask* mask, u32 cpu) {
+	while (cpu < CONFIG_MAX_CPUS) {
+		unsigned long word = mask->bits[cpu / CPUMASK_BITS_PER_WORD] >> (cpu % CPUMASK_BITS_PER_WORD);
+		if (word) {
+			cpu += __builtin_ctzl(word);
+			return cpu < CONFIG_MAX_CPUS ? cpu : CONFIG_MAX_CPUS; /* cpumask_fill sets bits past the end */
+		}
+		cpu = ROUND_DOWN(cpu, CPUMASK_BITS_PER_WORD) + CPUMASK_BITS_PER_WORD;
+	}
+	return CONFIG_MAX_CPUS;
+}
+
+#define cpumask_for_each(cpu, mask) \
+	for (cpu = cpumask_next(mask, 0); cpu < CONFIG_MAX_CPUS; cpu = cpumask_next(mask, cpu + 1))
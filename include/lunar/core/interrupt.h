@@ -2,6 +2,7 @@
 
 #include <lunar/asm/flags.h>
 #include <lunar/core/spinlock.h>
+#include <lunar/core/waitqueue.h>
 
 #define INTERRUPT_EXCEPTION_COUNT 32
 
@@ -60,6 +61,7 @@ struct isr {
 	void (*func)(struct isr*, struct context*); /* Called by the ISR entry */
 	atomic(long) inflight; /* How many CPU's are running this ISR */
 	spinlock_t lock; /* Lock for inflight, used when deciding whether the ISR can run */
+	struct wait_queue sync_wait; /* Woken up when the last running ISR exits after synchronizing */
 	void* private; /* For use by whoever registers the interrupt */
 };
 
@@ -116,7 +118,6 @@ int interrupt_register(struct isr* isr, void (*func)(struct isr*, struct context
  * @return -errno on failure
  * @retval -EWOULDBLOCK Scheduler not initialized yet
  * @retval -EINVAL ISR is software generated, an exception, bad pointer, or cannot be masked
- * @retval -ENOMEM Ran out of memory trying to unregister the IRQ
  */
 int interrupt_unregister(struct isr* isr);
 
@@ -124,7 +125,7 @@ int interrupt_unregister(struct isr* isr);
  * @brief Wait for ISR's to finish execution
  *
  * Not safe to call from an interrupt context. This function does NOT wait
- * for pending softirq's or work scheduled with sched_workqueue_add
+ * for pending softirq's or work queued with queue_work
  *
  * @param isr The ISR to wait for
  *
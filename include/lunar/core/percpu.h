@@ -0,0 +1,106 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/compiler.h>
+
+/*
+ * Per-CPU variables live in the .percpu section, which is only a template: every CPU gets its own copy
+ * of it, and GSBASE holds the distance from the template to the current CPU's copy. The address of a
+ * per-CPU variable is never dereferenced directly, only through the accessors below. These are single
+ * %gs relative instructions, so they're safe against preemption and interrupts without disabling either,
+ * though a thread that migrates between two accesses sees two different CPU's.
+ */
+#define DEFINE_PER_CPU(type, name) __attribute__((section(".percpu"))) __typeof__(type) name
+#define DECLARE_PER_CPU(type, name) extern __typeof__(type) name
+
+DECLARE_PER_CPU(uintptr_t, this_cpu_off); /* Same as GSBASE, so this_cpu_ptr() doesn't need to read the MSR */
+
+/* Only 1, 2, 4 and 8 byte scalars can be accessed with a single instruction */
+#define __percpu_check_size(var) static_assert(sizeof(var) == 1 || sizeof(var) == 2 || \
+		sizeof(var) == 4 || sizeof(var) == 8, "Bad per-CPU access size")
+
+#define __percpu_read(var, suffix, type, constraint) ({ \
+	type __val; \
+	__asm__ volatile("mov" suffix " %%gs:%1, %0" : constraint(__val) : "m"(var)); \
+	(unsigned long)__val; \
+})
+
+#define this_cpu_read(var) ({ \
+	__percpu_check_size(var); \
+	unsigned long __ret; \
+	switch (sizeof(var)) { \
+	case 1: __ret = __percpu_read(var, "b", u8, "=q"); break; \
+	case 2: __ret = __percpu_read(var, "w", u16, "=r"); break; \
+	case 4: __ret = __percpu_read(var, "l", u32, "=r"); break; \
+	case 8: __ret = __percpu_read(var, "q", u64, "=r"); break; \
+	default: __ret = 0; break; \
+	} \
+	(__typeof__(var))__ret; \
+})
+
+#define __percpu_to_op(op, var, val) do { \
+	__percpu_check_size(var); \
+	switch (sizeof(var)) { \
+	case 1: __asm__ volatile(op "b %1, %%gs:%0" : "+m"(var) : "qi"((u8)(unsigned long)(val))); break; \
+	case 2: __asm__ volatile(op "w %1, %%gs:%0" : "+m"(var) : "ri"((u16)(unsigned long)(val))); break; \
+	case 4: __asm__ volatile(op "l %1, %%gs:%0" : "+m"(var) : "ri"((u32)(unsigned long)(val))); break; \
+	case 8: __asm__ volatile(op "q %1, %%gs:%0" : "+m"(var) : "re"((u64)(unsigned long)(val))); break; \
+	default: break; \
+	} \
+} while (0)
+
+#define this_cpu_write(var, val) __percpu_to_op("mov", var, val)
+#define this_cpu_add(var, val) __percpu_to_op("add", var, val)
+#define this_cpu_sub(var, val) __percpu_to_op("sub", var, val)
+#define this_cpu_or(var, val) __percpu_to_op("or", var, val)
+#define this_cpu_and(var, val) __percpu_to_op("and", var, val)
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+#define this_cpu_dec(var) this_cpu_sub(var, 1)
+
+/**
+ * @brief Get the current CPU's copy of a per-CPU variable
+ *
+ * The pointer is only the current CPU's as long as the thread doesn't migrate.
+ *
+ * @param ptr The address of the per-CPU variable
+ */
+#define this_cpu_ptr(ptr) ((__typeof__(ptr))((uintptr_t)(ptr) + this_cpu_read(this_cpu_off)))
+
+/**
+ * @brief Get a specific CPU's copy of a per-CPU variable
+ * @param ptr The address of the per-CPU variable
+ * @param cpu The CPU struct
+ */
+#define per_cpu_ptr(ptr, cpu) ((__typeof__(ptr))((uintptr_t)(ptr) + (cpu)->percpu_offset))
+#define per_cpu(var, cpu) (*per_cpu_ptr(&(var), cpu))
+
+/**
+ * @brief Give the BSP its per-CPU area, before anything else uses per-CPU variables
+ * @return The offset from the template to the area
+ */
+uintptr_t percpu_bsp_init(void);
+
+/**
+ * @brief Allocate a per-CPU area for an AP and make it the current CPU's
+ * @return The offset from the template to the area
+ */
+uintptr_t percpu_ap_init(void);
+
+/**
+ * @brief Allocate a per-CPU variable at runtime
+ *
+ * Every CPU's copy starts out zeroed, including the copies of CPU's that come up later. Use the
+ * returned pointer like the address of a variable defined with DEFINE_PER_CPU().
+ *
+ * @param size The size of the variable
+ * @param align The alignment, a power of two up to 64
+ *
+ * @return NULL if the dynamic per-CPU area is full
+ */
+void* alloc_percpu(size_t size, size_t align);
+
+/**
+ * @brief Free a per-CPU variable allocated with alloc_percpu
+ * @param ptr The per-CPU variable, may be NULL
+ */
+void free_percpu(void* ptr);
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/lib/list.h>
+#include <lunar/core/spinlock.h>
+#include <lunar/core/time.h>
+
+#define TIMER_TICK_NS 1000000ll /* Resolution of the wheel */
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SIZE (1u << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_SHIFT 3 /* Every level is 8 times coarser than the one below it */
+#define TIMER_LEVELS 8
+
+struct timer_base;
+
+struct timer {
+	struct list_node link; /* Link in a bucket */
+	u64 expires; /* In wheel ticks */
+	void (*func)(void*);
+	void* arg;
+	struct timer_base* base; /* Where the timer is queued, NULL if not pending */
+	unsigned int bucket;
+};
+
+/*
+ * Per CPU timer wheel. Level N has 64 buckets that each cover 8^N ticks, so timers far in
+ * the future are stored coarsely and may fire up to 1/8th of their delay late. Inserting and
+ * cancelling never walk a list, and there's no cascading between levels.
+ */
+struct timer_base {
+	spinlock_t lock;
+	u64 clk; /* The next tick to process */
+	u64 next_expiry; /* The earliest non-empty bucket, U64_MAX if there's none */
+	atomic(struct timer*) running; /* The timer whose callback is running */
+	unsigned long pending[TIMER_LEVELS]; /* A bit for every non-empty bucket */
+	struct list_head buckets[TIMER_LEVELS * TIMER_LEVEL_SIZE];
+};
+
+#define TIMER_INITIALIZER(f, a) { .link = LIST_NODE_INITIALIZER, .expires = 0, .func = f, .arg = a, .base = NULL, .bucket = 0 }
+
+/**
+ * @brief Initialize a timer
+ *
+ * @param timer The timer to initialize
+ * @param func Called with IRQ's disabled from the timer softirq when the timer expires
+ * @param arg The argument to pass to func
+ */
+static inline void timer_init(struct timer* timer, void (*func)(void*), void* arg) {
+	list_node_init(&timer->link);
+	timer->expires = 0;
+	timer->func = func;
+	timer->arg = arg;
+	timer->base = NULL;
+	timer->bucket = 0;
+}
+
+/**
+ * @brief Start a timer on the current CPU
+ *
+ * If the timer is already pending, it's moved to the new expiry time.
+ * Safe to call from an atomic context.
+ *
+ * @param timer The timer to start
+ * @param expires When the timer should fire, in nanoseconds since boot (see timekeeper_time())
+ */
+void timer_arm(struct timer* timer, time_t expires);
+
+/**
+ * @brief Stop a timer
+ *
+ * Does not wait for the callback if it's already running on another CPU.
+ * Safe to call from an atomic context.
+ *
+ * @param timer The timer to stop
+ * @return true if the timer was pending
+ */
+bool timer_cancel(struct timer* timer);
+
+/**
+ * @brief Stop a timer and wait for its callback to finish
+ *
+ * Don't call this while holding anything the callback takes.
+ *
+ * @param timer The timer to stop
+ * @return true if the timer was pending
+ */
+bool timer_cancel_sync(struct timer* timer);
+
+/**
+ * @brief Check if a timer is waiting to fire
+ *
+ * Only stable if the caller serializes with timer_arm() and the callback.
+ *
+ * @param timer The timer to check
+ */
+static inline bool timer_pending(const struct timer* timer) {
+	return timer->base != NULL;
+}
+
+/**
+ * @brief Run every expired timer on the current CPU
+ *
+ * Called from the timer softirq with IRQ's disabled.
+ *
+ * @param now The current time in nanoseconds
+ */
+void timers_run(time_t now);
+
+/**
+ * @brief Get when the current CPU's next timer fires
+ * @return The time in nanoseconds, -1 if there are no timers
+ */
+time_t timers_next_expiry(void);
+
+void timer_cpu_init(void);
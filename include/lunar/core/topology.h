@@ -0,0 +1,29 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/core/cpumask.h>
+
+/*
+ * Where a CPU sits in the machine, decoded from its APIC ID. The ID's are only unique in the whole
+ * system, so two CPU's share a core, last level cache or package if the ID's are equal. The masks
+ * include the CPU itself, and are indexed by sched_processor_id like every cpumask.
+ */
+struct cpu_topology {
+	u32 apic_id; /* The full x2APIC ID if the CPU has one */
+	u32 core_id, llc_id, package_id;
+	struct cpumask smt_mask; /* Hardware threads of the same core */
+	struct cpumask llc_mask; /* CPU's sharing the last level cache */
+	struct cpumask package_mask;
+};
+
+/**
+ * @brief Decode the current CPU's place in the topology from CPUID
+ *
+ * Runs on every CPU, since only a CPU itself can read its x2APIC ID and cache parameters.
+ */
+void topology_cpu_init(void);
+
+/**
+ * @brief Build the sibling masks, once every CPU has registered
+ */
+void topology_init(void);
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <lunar/lib/list.h>
+#include <lunar/core/spinlock.h>
+#include <lunar/core/timekeeper.h>
+
+struct thread;
+
+/*
+ * Threads sleeping until a condition becomes true. The condition is checked with the queue
+ * locked, so whoever makes it true only has to wake the queue up afterwards for no wakeup to
+ * get lost. Every non-exclusive waiter is woken up, but only one exclusive waiter is,
+ * so an event only one thread can consume doesn't wake all of them.
+ */
+
+enum wait_flags {
+	WAIT_EXCLUSIVE = (1 << 8) /* Can be combined with SCHED_SLEEP_INTERRUPTIBLE */
+};
+
+struct wait_entry {
+	struct thread* thread;
+	bool exclusive;
+	struct list_node link;
+};
+
+struct wait_queue {
+	struct list_head waiters; /* Non-exclusive waiters are at the front, exclusive ones are in FIFO order behind them */
+	spinlock_t lock;
+};
+
+#define WAIT_QUEUE_INITIALIZER(n) { .waiters = LIST_HEAD_INITIALIZER(n.waiters), .lock = SPINLOCK_INITIALIZER }
+#define WAIT_QUEUE_DEFINE(n) struct wait_queue n = WAIT_QUEUE_INITIALIZER(n)
+static inline void wait_queue_init(struct wait_queue* wq) {
+	list_head_init(&wq->waiters);
+	spinlock_init(&wq->lock);
+}
+
+/**
+ * @brief Check if anything is waiting, without locking
+ *
+ * Only useful as a hint, unless the caller knows no thread can start waiting at the same time.
+ *
+ * @param wq The wait queue
+ * @return true if a thread is waiting
+ */
+static inline bool wait_queue_active(struct wait_queue* wq) {
+	return !list_empty(&wq->waiters);
+}
+
+/**
+ * @brief Sleep until a condition is true
+ *
+ * The condition is called with the queue locked and IRQ's disabled, so it must not sleep. It's
+ * checked before sleeping and after every wakeup.
+ *
+ * @param wq The wait queue
+ * @param cond The condition to wait for
+ * @param arg The argument to pass to the condition
+ * @param flags SCHED_SLEEP_INTERRUPTIBLE and WAIT_EXCLUSIVE
+ *
+ * @retval -EINTR Interrupted by a signal
+ * @retval 0 The condition is true
+ */
+int wait_event(struct wait_queue* wq, bool (*cond)(void*), void* arg, int flags);
+
+/**
+ * @brief Sleep until a condition is true, with a timeout
+ *
+ * @param wq The wait queue
+ * @param cond The condition to wait for
+ * @param arg The argument to pass to the condition
+ * @param timeout_ms The max number of milliseconds to wait for
+ * @param flags SCHED_SLEEP_INTERRUPTIBLE and WAIT_EXCLUSIVE
+ *
+ * @retval -EINTR Interrupted by a signal
+ * @retval -ETIMEDOUT The condition wasn't true in time
+ * @retval 0 The condition is true
+ */
+int wait_event_timed(struct wait_queue* wq, bool (*cond)(void*), void* arg, time_t timeout_ms, int flags);
+
+/**
+ * @brief Wake up every non-exclusive waiter and the first exclusive one
+ * @param wq The wait queue
+ */
+void wake_up(struct wait_queue* wq);
+
+/**
+ * @brief Wake up every waiter
+ * @param wq The wait queue
+ */
+void wake_up_all(struct wait_queue* wq);
+
+/**
+ * @brief Wake up waiters with the queue already locked
+ *
+ * For primitives built on a wait queue that change their state under its lock.
+ *
+ * @param wq The wait queue
+ * @param all Wake up every exclusive waiter too
+ */
+void wake_up_locked(struct wait_queue* wq, bool all);
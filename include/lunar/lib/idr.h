@@ -0,0 +1,94 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/core/mutex.h>
+
+#define IDR_SHIFT 6
+#define IDR_FANOUT (1 << IDR_SHIFT)
+
+typedef atomic(void*) idr_slot_t;
+
+struct idr_node {
+	u64 full; /* Leaves: IDs in use. Others: children with no free IDs left */
+	idr_slot_t slots[IDR_FANOUT]; /* Leaves: the objects. Others: the children */
+};
+
+/*
+ * Hands out integer IDs and maps them to objects. It's a radix tree with 64 slots per node,
+ * so finding a free ID only looks at one word per level. Nodes are allocated as IDs are used,
+ * so a mostly empty map only takes a few nodes. Nodes are only freed by idr_destroy(), so
+ * lookups don't need the lock.
+ */
+struct idr {
+	idr_slot_t root;
+	unsigned int levels;
+	long max; /* IDs are below this */
+	long next; /* Where the next search starts, so freed IDs aren't reused right away */
+	long count;
+	mutex_t lock;
+};
+
+/**
+ * @brief Initialize an empty ID map, no memory is allocated until the first ID is
+ *
+ * @param idr The map
+ * @param max IDs are allocated from 0 up to, but not including this
+ */
+void idr_init(struct idr* idr, long max);
+
+/**
+ * @brief Free every node in an ID map, the objects aren't touched
+ * @param idr The map
+ */
+void idr_destroy(struct idr* idr);
+
+/**
+ * @brief Allocate an ID
+ *
+ * The search starts after the last allocated ID and wraps around.
+ *
+ * @param idr The map
+ * @param ptr The object to map the ID to, can't be NULL
+ *
+ * @retval -EINVAL ptr is NULL
+ * @retval -ENOSPC Every ID is in use
+ * @retval -ENOMEM No memory for a node
+ * @return The ID on success
+ */
+long idr_alloc(struct idr* idr, void* ptr);
+
+/**
+ * @brief Free an ID
+ *
+ * @param idr The map
+ * @param id The ID to free
+ *
+ * @return The object the ID was mapped to, NULL if it wasn't allocated
+ */
+void* idr_remove(struct idr* idr, long id);
+
+/**
+ * @brief Find the object an ID is mapped to
+ *
+ * Doesn't take the lock, so it's safe from any context. Nothing keeps the object alive,
+ * so the caller needs another way to know it hasn't been freed.
+ *
+ * @param idr The map
+ * @param id The ID to look up
+ *
+ * @return The object, NULL if the ID isn't allocated
+ */
+void* idr_find(struct idr* idr, long id);
+
+/**
+ * @brief Change the object an ID is mapped to
+ *
+ * @param idr The map
+ * @param id The allocated ID
+ * @param ptr The new object, can't be NULL
+ *
+ * @retval -EINVAL ptr is NULL
+ * @retval -ENOENT The ID isn't allocated
+ * @retval 0 Success
+ */
+int idr_replace(struct idr* idr, long id, void* ptr);
@@ -74,6 +74,19 @@ static inline bool list_empty(const struct list_head* head) {
 	return head->node.next == &head->node;
 }
 
+/* Move every node of list to the front of head, list is left empty */
+static inline void list_splice_init(struct list_head* list, struct list_head* head) {
+	if (list_empty(list))
+		return;
+
+	struct list_node* first = list->node.next, *last = list->node.prev;
+	first->prev = &head->node;
+	last->next = head->node.next;
+	head->node.next->prev = last;
+	head->node.next = first;
+	list_head_init(list);
+}
+
 #define container_of(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
 #define list_for_each(pos, head) for (pos = (head)->node.next; pos != &(head)->node; pos = pos->next)
 #define list_for_each_safe(pos, n, head) for (pos = (head)->node.next, n = pos->next; pos != &(head)->node; pos = n, n = pos->next)
@@ -88,6 +101,10 @@ static inline bool list_empty(const struct list_head* head) {
 			&pos->member != &(head)->node; \
 			pos = n, \
 			n = list_entry(n->member.next, typeof(*pos), member))
+#define list_for_each_entry_reverse(pos, head, member) \
+	for (pos = list_entry((head)->node.prev, typeof(*pos), member); \
+			&pos->member != &(head)->node; \
+			pos = list_entry(pos->member.prev, typeof(*pos), member))
 #define list_for_each_cont(pos, head) for (; pos != &(head)->node; pos = pos->next)
 #define list_for_each_entry_cont(pos, head, member) \
 	for (; &pos->member != &(head)->node; pos = list_entry(pos->member.next, typeof(*pos), member))
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <lunar/common.h>
+#include <lunar/types.h>
+#include <lunar/lib/list.h>
+
+/*
+ * Lock-free singly linked list. Any number of CPU's can add to it at once, but only one
+ * may take entries off it, and only all of them at a time.
+ */
+
+struct llist_node {
+	struct llist_node* next;
+};
+
+struct llist_head {
+	atomic(struct llist_node*) first;
+};
+
+static inline void llist_head_init(struct llist_head* head) {
+	atomic_store(&head->first, NULL);
+}
+
+static inline bool llist_empty(struct llist_head* head) {
+	return atomic_load(&head->first) == NULL;
+}
+
+/**
+ * @brief Add a node to the front of the list
+ *
+ * @param head The list
+ * @param node The node to add, must not be on any list
+ *
+ * @return true if the list was empty before
+ */
+static inline bool llist_add(struct llist_head* head, struct llist_node* node) {
+	struct llist_node* first = atomic_load(&head->first);
+	do {
+		node->next = first;
+	} while (!atomic_compare_exchange_weak(&head->first, &first, node));
+
+	return first == NULL;
+}
+
+/**
+ * @brief Take every node off the list
+ *
+ * The nodes are returned newest first, use llist_reverse() to get them in the order they were added.
+ *
+ * @param head The list
+ *
+ * @return The first node, NULL if the list was empty
+ */
+static inline struct llist_node* llist_del_all(struct llist_head* head) {
+	return atomic_exchange(&head->first, NULL);
+}
+
+static inline struct llist_node* llist_reverse(struct llist_node* node) {
+	struct llist_node* prev = NULL;
+	while (node) {
+		struct llist_node* next = node->next;
+		node->next = prev;
+		prev = node;
+		node = next;
+	}
+
+	return prev;
+}
+
+#define llist_entry(node, type, member) container_of(node, type, member)
+
+/* The node can be reused (eg. added to another list) while iterating */
+#define llist_for_each_safe(pos, tmp, node) \
+	for (pos = (node); pos && ((tmp = pos->next), true); pos = tmp)
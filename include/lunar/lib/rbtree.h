@@ -0,0 +1,77 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/lib/list.h>
+
+struct rb_node {
+	struct rb_node* parent, *left, *right;
+	bool red;
+};
+
+struct rb_root {
+	struct rb_node* node;
+};
+
+#define RB_ROOT_INITIALIZER { .node = NULL }
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline void rb_root_init(struct rb_root* root) {
+	root->node = NULL;
+}
+
+static inline bool rb_empty(const struct rb_root* root) {
+	return root->node == NULL;
+}
+
+/**
+ * @brief Put a node where a search ended, call rb_insert_color() right after
+ *
+ * @param node The new node
+ * @param parent The last node visited by the search, NULL if the tree is empty
+ * @param link The child pointer of the parent (or the root) that was NULL
+ */
+static inline void rb_link_node(struct rb_node* node, struct rb_node* parent, struct rb_node** link) {
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	node->red = true;
+	*link = node;
+}
+
+/**
+ * @brief Rebalance the tree after rb_link_node()
+ * @param root The tree
+ * @param node The node that was just linked
+ */
+void rb_insert_color(struct rb_root* root, struct rb_node* node);
+
+/**
+ * @brief Remove a node from the tree
+ * @param root The tree
+ * @param node The node to remove
+ */
+void rb_erase(struct rb_root* root, struct rb_node* node);
+
+/**
+ * @brief Get the smallest node in a tree
+ * @return NULL if the tree is empty
+ */
+struct rb_node* rb_first(const struct rb_root* root);
+
+/**
+ * @brief Get the largest node in a tree
+ * @return NULL if the tree is empty
+ */
+struct rb_node* rb_last(const struct rb_root* root);
+
+/**
+ * @brief Get the next node in order
+ * @return NULL if node is the last one
+ */
+struct rb_node* rb_next(const struct rb_node* node);
+
+/**
+ * @brief Get the previous node in order
+ * @return NULL if node is the first one
+ */
+struct rb_node* rb_prev(const struct rb_node* node);
@@ -9,7 +9,10 @@ struct mm {
 	pte_t* pagetable;
 	struct list_head vma_list;
 	mutex_t vma_list_lock;
+	mutex_t pagetable_lock; /* Taken after vma_list_lock, covers walking and editing the page table */
 	void* mmap_start, *mmap_end;
+	u64 ctx_id; /* Unique for the lifetime of the system, used to find the PCID on each CPU */
+	atomic(u64) tlb_gen; /* Bumped whenever a range in the lower half gets invalidated */
 };
 
 static inline unsigned int get_order(size_t size) {
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <lunar/types.h>
+
+struct shrinker {
+	/* Give memory back, returns the number of pages freed */
+	unsigned long (*shrink)(struct shrinker* shrinker);
+	struct shrinker* next;
+};
+
+/**
+ * @brief Register a cache to be shrunk when memory runs low
+ *
+ * Shrinkers can't be unregistered, and can be called from any allocation that can sleep,
+ * including ones done with mm locks held. The callback has to check for that itself.
+ *
+ * @param shrinker The shrinker to register
+ */
+void shrinker_register(struct shrinker* shrinker);
+
+/**
+ * @brief Ask every registered cache to give memory back
+ *
+ * Does nothing if the shrinkers are already running, since they may allocate memory themselves.
+ *
+ * @return The number of pages freed
+ */
+unsigned long shrinkers_run(void);
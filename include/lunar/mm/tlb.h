@@ -0,0 +1,62 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/core/spinlock.h>
+
+#define TLB_QUEUE_RANGES 16
+#define TLB_ASID_COUNT 6
+
+struct tlb_range {
+	uintptr_t start, end;
+};
+
+/*
+ * Every CPU has one of these. Other CPU's push ranges into it, and the
+ * owning CPU drains it either from the shootdown IPI or when it wakes up from idle.
+ */
+struct tlb_queue {
+	struct tlb_range ranges[TLB_QUEUE_RANGES]; /* Coalesced ranges waiting to be flushed */
+	unsigned int count;
+	bool flush_all; /* Ran out of ranges, so the entire TLB gets flushed instead */
+	spinlock_t lock; /* Protects the ranges, count and flush_all */
+	atomic(u64) queued; /* Incremented every time something is queued */
+	atomic(u64) done; /* The value of queued at the time of the last drain */
+	atomic(bool) lazy; /* The CPU is idle, and will drain the queue before doing anything else */
+};
+
+struct tlb_asid {
+	u64 ctx_id; /* The mm using this slot, 0 if free */
+	u64 tlb_gen; /* The mm's tlb_gen when this slot was last flushed, 0 forces a flush */
+};
+
+/*
+ * The address spaces that recently ran on a CPU. Slot N uses PCID N + 1,
+ * slots get reused round robin, and the PCID is flushed when that happens.
+ */
+struct tlb_asids {
+	struct tlb_asid slots[TLB_ASID_COUNT];
+	unsigned int current; /* The slot that's loaded in CR3 */
+	unsigned int next; /* The next slot to reuse */
+};
+
+/**
+ * @brief Flush everything queued for the current CPU
+ *
+ * Safe to call from an atomic context.
+ */
+void tlb_flush_pending(void);
+
+/**
+ * @brief Let other CPU's skip the shootdown IPI for this CPU
+ *
+ * Only call this right before halting in the idle loop. Any flushes
+ * queued after this are done in tlb_lazy_exit().
+ */
+void tlb_lazy_enter(void);
+
+/**
+ * @brief Leave lazy mode and flush anything queued while idle
+ *
+ * Cheap if the CPU isn't lazy, so this can be called on every interrupt.
+ */
+void tlb_lazy_exit(void);
@@ -26,11 +26,19 @@ enum vmm_flags {
 	VMM_FIXED = (1 << 2),
 	VMM_NOREPLACE = (1 << 3),
 	VMM_IOMEM = (1 << 4),
-	VMM_HUGEPAGE_2M = (1 << 5)
+	VMM_HUGEPAGE_2M = (1 << 5),
+	VMM_LAZY = (1 << 6)
 };
 
 typedef unsigned long pte_t;
 
+/* Kernel stacks that are still mapped with their guard page, linked through the bottom of each stack */
+struct kstack_cache {
+	void* head;
+	unsigned long count;
+	spinlock_t lock;
+};
+
 /**
  * @brief Map some memory to the kernel address space
  *
@@ -74,6 +82,11 @@ int vprotect(void* virtual, size_t size, mmuflags_t mmu_flags, int flags);
 /**
  * @brief Unmap a block allocated with vmap
  *
+ * If VMM_LAZY is used, other CPU's aren't interrupted to flush their TLB's. Instead, the
+ * virtual range and the physical pages are held onto until enough lazy unmaps pile up (or
+ * vunmap_flush_lazy() is called), and then they are all released after a single IPI round.
+ * This is the only flag this function accepts.
+ *
  * @param virtual The virtual address, must be aligned
  * @param size The original size of the mapping
  * @param flags The vmm flags to use
@@ -82,6 +95,13 @@ int vprotect(void* virtual, size_t size, mmuflags_t mmu_flags, int flags);
  */
 int vunmap(void* virtual, size_t size, int flags);
 
+/**
+ * @brief Release everything unmapped with VMM_LAZY
+ *
+ * Does one TLB shootdown round for all pending lazy unmaps, no matter how many there are.
+ */
+void vunmap_flush_lazy(void);
+
 /**
  * @brief Map pages as IO memory
  *
@@ -108,7 +128,8 @@ int iounmap(void __iomem* virtual, size_t size);
 /**
  * @brief Create a stack that is KSTACK_SIZE in length
  *
- * Adds a 4K guard page at the end of the stack.
+ * Adds a 4K guard page at the end of the stack. Stacks are taken from the current CPU's
+ * cache first, those aren't zeroed.
  *
  * @return The address of the stack, the pointer returned points to the top of the stack.
  */
@@ -116,10 +137,19 @@ void* vmap_kstack(void);
 
 /**
  * @brief Unmap a kernel stack
+ *
+ * The stack is put in the current CPU's cache instead if it isn't full.
+ * The cache size can be set with the mm.kstack_cache cmdline option.
+ *
  * @param stack The stack to unmap
  */
 int vunmap_kstack(void* stack);
 
+/**
+ * @brief Read the kernel stack cache options, and register its shrinker
+ */
+void kstack_cache_init(void);
+
 void vmm_tlb_init(void);
 void vmm_cpu_init(void);
 void vmm_init(void);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/compiler.h>
+
+struct cpu;
+
+/*
+ * The bits of cpu->idle_wake. While the idle loop polls or waits with MWAIT, it sets IDLE_WAKE_POLLING,
+ * and a wakeup only has to set IDLE_WAKE_KICKED instead of sending an IPI. The write itself ends the
+ * MWAIT, since the idle loop monitors the variable.
+ */
+enum idle_wake_flags {
+	IDLE_WAKE_POLLING = (1 << 0),
+	IDLE_WAKE_KICKED = (1 << 1)
+};
+
+enum idle_state_flags {
+	IDLE_STATE_POLLING = (1 << 0), /* Wakes up on a write to cpu->idle_wake, so no IPI is needed */
+	IDLE_STATE_TIMER_STOP = (1 << 1) /* The LAPIC timer stops, only usable if it's always running */
+};
+
+#define IDLE_STATE_NAME_MAX 16
+#define IDLE_STATES_MAX 8
+
+struct idle_state {
+	char name[IDLE_STATE_NAME_MAX];
+	u64 exit_latency_ns; /* How long it takes to wake up */
+	u64 target_residency_ns; /* How long it must last to be worth entering */
+	int flags; /* IDLE_STATE_* */
+	void (*enter)(struct idle_state*); /* Called with IRQ's disabled, returns with them enabled */
+	u64 data; /* For the enter function, like the MWAIT hint or an I/O port */
+};
+
+/* The states go from shallow to deep, so the exit latency and target residency only increase */
+struct idle_driver {
+	const char* name;
+	struct idle_state states[IDLE_STATES_MAX];
+	unsigned int count;
+};
+
+/**
+ * @brief Make a driver the one the idle loop picks states from
+ *
+ * States that stop the LAPIC timer are dropped if the CPU doesn't keep it running in every C-state.
+ * The driver must stay valid forever.
+ *
+ * @param driver The driver
+ * @return -EINVAL if it has no usable states
+ */
+int idle_driver_register(struct idle_driver* driver);
+
+/**
+ * @brief Check if MONITOR/MWAIT can be used to idle
+ */
+bool idle_mwait_usable(void);
+
+/**
+ * @brief Enter a state with MWAIT, the hint is state->data
+ * @param state The idle state
+ */
+void idle_enter_mwait(struct idle_state* state);
+
+/**
+ * @brief Enter a state with HLT
+ * @param state The idle state
+ */
+void idle_enter_halt(struct idle_state* state);
+
+/**
+ * @brief Wake up a CPU's idle loop without an IPI, if it's polling
+ * @param cpu The CPU
+ * @return false if an IPI is still needed
+ */
+bool idle_kick_polling(struct cpu* cpu);
+
+/**
+ * @brief The body of every CPU's idle thread
+ */
+void idle_loop(void);
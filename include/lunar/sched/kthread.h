@@ -46,7 +46,7 @@ _Noreturn void kthread_exit(int code);
 /**
  * @brief Wait for a thread to finish execution
  *
- * If the thread has not finished executing, the current thread yields until
+ * If the thread has not finished executing, the current thread sleeps until
  * the thread exits. Doesn't decrease the refcount.
  *
  * @param id The thread ID
@@ -4,7 +4,12 @@
 #include <lunar/core/interrupt.h>
 #include <lunar/core/timekeeper.h>
 #include <lunar/core/semaphore.h>
+#include <lunar/core/completion.h>
+#include <lunar/core/timer.h>
+#include <lunar/core/cpumask.h>
 #include <lunar/lib/list.h>
+#include <lunar/lib/llist.h>
+#include <lunar/lib/idr.h>
 
 struct cpu;
 typedef int pid_t;
@@ -14,15 +19,24 @@ typedef int tid_t;
 #define SCHED_PRIO_MAX 99
 #define SCHED_PRIO_DEFAULT 45
 
+/* Real-time threads always run before normal ones, and only yield to real-time threads of a higher priority */
+enum sched_classes {
+	SCHED_CLASS_NORMAL, /* Scheduled by the policy chosen with the sched_policy option */
+	SCHED_CLASS_FIFO, /* Runs until it blocks, yields or is preempted */
+	SCHED_CLASS_RR /* Like FIFO, but takes turns with threads of the same priority */
+};
+
 enum thread_states {
 	THREAD_NEW,
 	THREAD_READY,
 	THREAD_RUNNING,
 	THREAD_BLOCKED,
 	THREAD_SLEEPING,
+	THREAD_WAKING, /* Woken up from another CPU, waiting on its runqueue's wake list to be queued */
 	THREAD_ZOMBIE
 };
 
+/* Threads created with a CPU flag are pinned to that CPU, and never migrated by the load balancer */
 enum sched_flags {
 	SCHED_THIS_CPU = (1 << 0),
 	SCHED_CPU0 = (1 << 1)
@@ -38,34 +52,62 @@ enum thread_rings {
 	THREAD_RING_USER
 };
 
-struct work {
-	void (*fn)(void*);
-	void* arg;
-	struct list_node link;
+struct sched_rt_thread {
+	struct list_node link; /* Link in the runqueue's priority list */
+	int prio; /* Real-time priority, higher runs first */
+	unsigned long slice_left; /* Ticks left in a SCHED_CLASS_RR thread's turn */
+	bool requeue_tail; /* Goes behind threads of the same priority next time, otherwise a preempted thread goes in front */
+};
+
+#define SCHED_RT_PRIO_COUNT (SCHED_PRIO_MAX + 1)
+
+struct sched_rt_runqueue {
+	struct list_head queues[SCHED_RT_PRIO_COUNT];
+	u64 bitmap[(SCHED_RT_PRIO_COUNT + 63) / 64]; /* A bit for every non-empty queue */
 };
 
 struct proc {
 	pid_t pid; /* Process ID */
 	struct mm* mm_struct; /* Memory manager context */
-	u8* tid_map; /* Thread ID bitmap */
+	struct idr tids; /* Thread IDs, mapped to their threads */
 	struct list_head threads; /* The list of threads for this process, linked with proc_link */
 	atomic(unsigned long) thread_count; /* The number of threads for this process, don't write without locking first */
 	spinlock_t thread_lock; /* For the thread linked list */
 };
 
+#define THREAD_NAME_LEN 40
+
+/* Times are in nanoseconds, and only changed with the thread's runqueue locked unless noted */
+struct sched_thread_stats {
+	u64 runtime; /* Time spent running, up to the last tick or switch */
+	u64 wait_time; /* Time spent runnable, waiting for a CPU */
+	u64 nr_voluntary; /* Switched out because it blocked, slept or exited */
+	u64 nr_involuntary; /* Switched out while it could still run */
+	u64 nr_migrations;
+	time_t exec_start; /* When the running thread's runtime was last counted */
+	time_t queued_at; /* When it became runnable, 0 while running or asleep. Set by whoever claimed its wakeup. */
+	bool woken; /* queued_at is a wakeup, so the delay is counted as wakeup latency too */
+};
+
+struct worker;
+
 struct thread {
 	tid_t id; /* Thread ID */
-	struct cpu* target_cpu; /* What queue this thread is in */
-	unsigned long cpu_mask;
+	char name[THREAD_NAME_LEN];
+	struct cpu* target_cpu; /* What queue this thread is in, only changed with both runqueues locked */
+	struct cpumask cpu_mask; /* CPU's this thread may run on, only changed with the runqueue locked */
 	bool attached; /* Attached to the policy? */
 	struct proc* proc; /* The process struct this thread is linked to */
 	int ring; /* Kernel mode or user mode thread */
 	int prio; /* Priority of the current thread */
+	int sched_class; /* SCHED_CLASS_*, only changed with the runqueue locked */
 	atomic(int) state; /* ready, blocked, running, etc.. */
-	time_t wakeup_time; /* When the thread should wake up in nanoseconds */
+	time_t wakeup_time; /* When the thread should wake up in nanoseconds, 0 if there's no timeout */
+	time_t last_ran; /* When this thread was last switched out in nanoseconds, comparable between CPU's */
 	atomic(int) wakeup_err; /* Wakeup error code (eg. -ETIMEDOUT, -EINTR)*/
 	atomic(bool) sleep_interruptable; /* Can be interrupted by signals */
 	long preempt_count; /* Task can be preempted when zero */
+	bool fpu_used; /* Used the FPU/SSE registers, so ctx.extended is saved and restored on every switch */
 	void* stack; /* Base address of the stack */
 	size_t stack_size;
 	struct {
@@ -74,32 +116,119 @@ struct thread {
 		void* extended; /* SSE, AVX, etc.. */
 	} ctx; /* For the task switcher, obviously */
 	struct list_node proc_link; /* Link for proc->threads */
-	struct list_node sleep_link; /* Link so the scheduler can wake up threads */
+	struct timer sleep_timer; /* Wakes the thread up when a timed sleep ends */
 	struct list_node block_link; /* Link for things like mutexes/semaphores */
 	struct list_node zombie_link; /* For reaper thread */
+	struct llist_node wake_node; /* Link in a runqueue's wake list, only while THREAD_WAKING */
 	void* policy_priv; /* For the scheduling algorithm */
-	atomic(unsigned long) refcount;
+	struct sched_rt_thread rt; /* For the real-time classes */
+	atomic(unsigned long) refcount; /* Also has THREAD_REF_PARKED set while a zombie waits for it to drop */
+	atomic(bool) joinable; /* A kthread that isn't detached yet, the kthread_* functions can find it by ID */
+	struct completion exited; /* Signaled for all waiters when a kthread exits */
+	struct worker* worker; /* Set for workqueue workers, their pool is told when they block */
+	struct sched_thread_stats stats;
 };
 
 struct sched_policy;
 
+enum sched_tick_modes {
+	SCHED_TICK_PERIODIC, /* Threads are waiting, so the timer fires every tick for time slices */
+	SCHED_TICK_DEFERRED, /* Only one runnable thread, the timer fires for kernel timers or rarely */
+	SCHED_TICK_STOPPED /* Idle, the timer only fires for kernel timers */
+};
+
+/* How wakeups were placed, counted on the CPU the thread was queued on with its runqueue locked */
+struct sched_wake_stats {
+	u64 affine; /* Pulled to the waker's CPU */
+	u64 idle; /* Moved to an idle CPU */
+	u64 migrations; /* Queued on a different CPU than the one they slept on */
+	u64 ipis_saved; /* Queued on the waker's CPU instead of a remote one that needed an IPI */
+	u64 remote; /* Passed through the wake list, without the waker taking the runqueue lock */
+};
+
+#define SCHED_LAT_BUCKETS 16
+
+/* Times are in nanoseconds, and only changed with the runqueue locked unless noted */
+struct sched_cpu_stats {
+	u64 nr_switches;
+	u64 idle_time; /* Time the idle thread ran, up to the last tick or switch */
+	u64 softirq_time; /* Time spent running softirqs, only changed by the CPU itself with IRQ's disabled */
+	u64 run_delay; /* Time threads switched in here waited after becoming runnable */
+	u64 nr_run_delay; /* Threads switched in after waiting */
+	u64 wake_latency_max;
+	u64 wake_latency[SCHED_LAT_BUCKETS]; /* Wakeup to running, bucket 0 is under 1us, n is from 2^(n-1) up to 2^n us, the last has the rest */
+	struct sched_wake_stats wake;
+};
+
+/* Reaped threads that kept their stack and extended context, for the next thread_create() on the CPU */
+struct thread_free_cache {
+	struct list_head threads; /* Linked with proc_link */
+	unsigned long count;
+	spinlock_t lock;
+};
+
+/* From the CPU's sharing the most with a CPU to the whole system, balancing tries the smaller ones first */
+enum sched_domain_levels {
+	SCHED_DOMAIN_SMT, /* Hardware threads of a core */
+	SCHED_DOMAIN_LLC, /* Cores sharing the last level cache */
+	SCHED_DOMAIN_PACKAGE,
+	SCHED_DOMAIN_SYSTEM,
+	SCHED_DOMAIN_LEVELS
+};
+
+/* Only used by the CPU that owns it, and never changed after sched_domains_init() */
+struct sched_domain {
+	int level; /* SCHED_DOMAIN_* */
+	struct cpumask span; /* Includes the CPU itself */
+	u64 balance_interval, next_balance; /* In ticks */
+};
+
 struct runqueue {
 	const struct sched_policy* policy;
 	struct thread* current, *idle;
-	struct list_head sleepers; /* Sleeping threads, may also contain blocked threads for timeouts */
+	struct thread* last; /* The thread switched away from most recently, its stack may still be in use */
+	struct thread* push; /* Switched away from because it can't run here anymore, moved by the resched IPI */
 	struct list_head zombies; /* For reaper thread */
 	atomic(unsigned long) thread_count;
+	atomic(unsigned long) nr_queued; /* Threads waiting in the policy's queues, kept up to date by the policy */
+	u64 ticks; /* Ticks that passed, the timer may skip some so this is counted from last_tick */
+	time_t last_tick; /* When the last whole tick was counted, in nanoseconds */
+	atomic(int) tick_mode; /* SCHED_TICK_*, read by other CPU's to decide if they need to kick this one */
+	u64 next_idle_kick; /* In ticks */
+	struct sched_domain domains[SCHED_DOMAIN_LEVELS]; /* Smallest first, levels that add no CPU's are left out */
+	unsigned int nr_domains;
+	struct sched_domain* llc_domain; /* The largest domain sharing a cache, NULL if this CPU doesn't share one */
+	struct sched_cpu_stats stats;
+	struct llist_head wake_list; /* Threads woken up by other CPU's, queued at the next scheduling point */
 	void* policy_priv; /* For scheduling algorithm */
+	struct sched_rt_runqueue rt; /* Real-time threads, picked before the policy's */
 	spinlock_t lock, zombie_lock;
 	struct semaphore reaper_sem;
+	struct thread_free_cache free_threads;
 };
 
 void sched_cpu_init(void);
 void sched_init(void);
 
+/**
+ * @brief Build every CPU's scheduling domains from the topology
+ *
+ * Call once every CPU is up, before the load balancer starts.
+ */
+void sched_domains_init(void);
+
 void atomic_context_switch(struct thread* prev, struct thread* next, struct context* ctx);
 struct thread* atomic_schedule(void);
 
+/**
+ * @brief Handle the fault from the first FPU/SSE instruction a thread runs
+ *
+ * Loads the thread's initial extended context, it's switched along with the thread from then on.
+ *
+ * @return false if the fault wasn't caused by a thread's first use of the FPU
+ */
+bool ext_context_fault(void);
+
 /**
  * @brief Switch to another runnable thread.
  *
@@ -113,29 +242,6 @@ struct thread* atomic_schedule(void);
  */
 int schedule(void);
 
-/**
- * @brief Schedule deferred work in a global workqueue
- *
- * @param fn The function to execute
- * @param arg The argument to pass to the function
- *
- * @retval 0 Successful
- * @retval -EAGAIN Workqueue was full
- */
-int sched_workqueue_add(void (*fn)(void*), void* arg);
-
-/**
- * @brief Schedule deferred work on a specific CPU
- *
- * @param cpu The CPU to run on
- * @param fn The function to execute
- * @param arg The argument to pass to the function
- *
- * @retval 0 Successful
- * @retval -EAGAIN Workqueue was full
- */
-int sched_workqueue_add_on(struct cpu* cpu, void(*fn)(void*), void* arg);
-
 /**
  * @brief Relinquish the CPU
  *
@@ -161,7 +267,8 @@ int sched_prepare_sleep(time_t ms, int flags);
 /**
  * @brief Wake up a thread
  *
- * If the thread is already woken up, this is a no-op.
+ * If the thread is already woken up, this is a no-op. A thread that stays on another CPU is put on
+ * that CPU's wake list and queued by the CPU itself, so it may not be runnable yet when this returns.
  *
  * @param thread The thread to wake up
  * @param wakeup_err The reason the thread is waking up
@@ -174,6 +281,8 @@ int sched_wakeup(struct thread* thread, int wakeup_err);
 /**
  * @brief Change the priority of a thread
  *
+ * Changes the real-time priority if the thread is in a real-time class.
+ *
  * @param thread The thread to change the priority of
  * @param The priority
  *
@@ -181,6 +290,72 @@ int sched_wakeup(struct thread* thread, int wakeup_err);
  */
 int sched_change_prio(struct thread* thread, int prio);
 
+/**
+ * @brief Change the CPU's a thread may run on
+ *
+ * A thread that's on a CPU outside of the mask is moved. If it's running, it's stopped first
+ * and moved once it's switched out. When a thread changes its own affinity, it's on an allowed CPU
+ * by the time this returns, unless preemption is disabled.
+ *
+ * @param thread The thread to change
+ * @param mask The allowed CPU's
+ *
+ * @retval -EINVAL No online CPU is in the mask
+ * @retval 0 Success
+ */
+int sched_set_affinity(struct thread* thread, const struct cpumask* mask);
+
+/**
+ * @brief Move a thread to another scheduling class
+ *
+ * Normal threads keep the priority they had before, or were given with sched_change_prio().
+ * Real-time threads aren't moved between CPU's by the load balancer unless one is idle.
+ *
+ * @param thread The thread to move
+ * @param sched_class SCHED_CLASS_*
+ * @param prio The real-time priority, ignored for SCHED_CLASS_NORMAL
+ *
+ * @retval -EINVAL Invalid class
+ * @retval 0 Success
+ */
+int sched_set_class(struct thread* thread, int sched_class, int prio);
+
+/**
+ * @brief Get a copy of a CPU's scheduler statistics
+ *
+ * @param cpu_id The scheduler ID of the CPU (sched_processor_id)
+ * @param stats Where to copy the statistics to
+ *
+ * @retval -EINVAL No CPU with that ID
+ * @retval 0 Success
+ */
+int sched_cpu_stats(u32 cpu_id, struct sched_cpu_stats* stats);
+
+/**
+ * @brief Get a copy of a thread's scheduler statistics
+ *
+ * A running thread's runtime is counted up to now.
+ *
+ * @param thread The thread
+ * @param stats Where to copy the statistics to
+ */
+void sched_thread_stats(struct thread* thread, struct sched_thread_stats* stats);
+
+/**
+ * @brief Print the scheduler statistics of every CPU and kernel thread
+ *
+ * Also printed every sched.stats_interval seconds if the option is set. Allocates, so it can't be
+ * called with IRQ's disabled.
+ */
+void sched_stats_dump(void);
+
+/**
+ * @brief Re-arm the current CPU's timer after a kernel timer was queued before its next event
+ *
+ * Call with IRQ's disabled.
+ */
+void sched_timer_reprogram(void);
+
 /**
  * @breif Stop the current thread and make it a zombie.
  */
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/lib/list.h>
+#include <lunar/core/timer.h>
+
+struct cpu;
+struct worker_pool;
+struct workqueue;
+
+enum workqueue_flags {
+	WQ_UNBOUND = (1 << 0), /* Run on any CPU, instead of the one the work was queued on */
+	WQ_ORDERED = (1 << 1) /* Unbound, and only one work item runs at a time, in the order they were queued */
+};
+
+enum work_flags {
+	WORK_PENDING = (1 << 0), /* Queued, or waiting on a timer, and not picked up by a worker yet */
+	WORK_INACTIVE = (1 << 1) /* Waiting behind the running item of an ordered workqueue */
+};
+
+/*
+ * Work items are embedded in whatever owns them, so queueing never allocates and can't fail. Queueing
+ * an item that's still pending does nothing, so repeated triggers before it runs only run it once.
+ * It can be queued again once a worker has picked it up, even from its own function. A worker
+ * doesn't touch an item after calling its function, so the function can free it.
+ */
+struct work {
+	void (*fn)(void*);
+	void* arg;
+	atomic(unsigned long) flags; /* WORK_* */
+	atomic(struct worker_pool*) pool; /* The pool it was last queued on */
+	struct workqueue* wq;
+	struct list_node link;
+};
+
+struct delayed_work {
+	struct work work;
+	struct timer timer;
+	struct workqueue* wq;
+};
+
+#define WORK_INITIALIZER(f, a) { .fn = f, .arg = a, .flags = atomic_init(0), .pool = atomic_init(NULL), \
+	.wq = NULL, .link = LIST_NODE_INITIALIZER }
+#define WORK_DEFINE(n, f, a) struct work n = WORK_INITIALIZER(f, a)
+static inline void work_init(struct work* work, void (*fn)(void*), void* arg) {
+	work->fn = fn;
+	work->arg = arg;
+	atomic_store_explicit(&work->flags, 0, ATOMIC_RELAXED);
+	atomic_store_explicit(&work->pool, NULL, ATOMIC_RELAXED);
+	work->wq = NULL;
+	list_node_init(&work->link);
+}
+
+void delayed_work_init(struct delayed_work* dwork, void (*fn)(void*), void* arg);
+
+/**
+ * @brief Check if a work item is waiting to run
+ * @param work The work item
+ */
+static inline bool work_pending(struct work* work) {
+	return (atomic_load(&work->flags) & WORK_PENDING) != 0;
+}
+
+extern struct workqueue* system_wq; /* Runs work on the CPU it was queued on */
+extern struct workqueue* system_unbound_wq;
+
+/**
+ * @brief Create a workqueue
+ *
+ * Workqueues share pools of workers: one for every CPU, and one for unbound work. A CPU's pool keeps
+ * one work item running, and another worker takes over when it blocks. Unbound work gets a worker
+ * for every item, as long as there are idle ones.
+ *
+ * @param name The name of the workqueue
+ * @param flags WQ_*
+ *
+ * @return NULL if there's no memory
+ */
+struct workqueue* workqueue_create(const char* name, int flags);
+
+/**
+ * @brief Wait for a workqueue to be idle and free it
+ *
+ * Nothing may queue work on it anymore.
+ *
+ * @param wq The workqueue
+ */
+void workqueue_destroy(struct workqueue* wq);
+
+/**
+ * @brief Wait until every work item on a workqueue has finished
+ *
+ * Work queued while waiting is waited for too.
+ *
+ * @param wq The workqueue
+ */
+void workqueue_flush(struct workqueue* wq);
+
+/**
+ * @brief Queue a work item
+ *
+ * Safe to call from any context.
+ *
+ * @param wq The workqueue
+ * @param work The work item
+ *
+ * @return false if it was already pending
+ */
+bool queue_work(struct workqueue* wq, struct work* work);
+
+/**
+ * @brief Queue a work item on a specific CPU
+ *
+ * @param wq The workqueue, the CPU is ignored if it's unbound
+ * @param cpu The CPU to run on
+ * @param work The work item
+ *
+ * @return false if it was already pending
+ */
+bool queue_work_on(struct workqueue* wq, struct cpu* cpu, struct work* work);
+
+/**
+ * @brief Queue a work item after a delay
+ *
+ * The timer runs on the current CPU, so bound work runs there too.
+ *
+ * @param wq The workqueue
+ * @param dwork The delayed work item
+ * @param delay_ms The number of milliseconds to wait before queueing it, zero to queue it now
+ *
+ * @return false if it was already pending
+ */
+bool queue_delayed_work(struct workqueue* wq, struct delayed_work* dwork, time_t delay_ms);
+
+/**
+ * @brief Wait for a work item to finish
+ *
+ * @param work The work item
+ * @return true if it was pending or running
+ */
+bool flush_work(struct work* work);
+
+/**
+ * @brief Take a work item off its queue
+ *
+ * Doesn't wait if a worker is already running it. Use cancel_delayed_work() for delayed work.
+ *
+ * @param work The work item
+ * @return true if it was pending
+ */
+bool cancel_work(struct work* work);
+
+/**
+ * @brief Take a work item off its queue, and wait if it's already running
+ *
+ * @param work The work item
+ * @return true if it was pending
+ */
+bool cancel_work_sync(struct work* work);
+
+/**
+ * @brief Stop a delayed work item's timer, or take it off its queue if the timer fired
+ *
+ * @param dwork The delayed work item
+ * @return true if it was pending
+ */
+bool cancel_delayed_work(struct delayed_work* dwork);
+
+/**
+ * @brief Stop a delayed work item, and wait if it's already running
+ *
+ * @param dwork The delayed work item
+ * @return true if it was pending
+ */
+bool cancel_delayed_work_sync(struct delayed_work* dwork);
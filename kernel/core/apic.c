@@ -5,6 +5,7 @@
 #include <lunar/core/panic.h>
 #include <lunar/core/apic.h>
 #include <lunar/core/printk.h>
+#include <lunar/core/waitqueue.h>
 #include <lunar/mm/buddy.h>
 #include <lunar/mm/vmm.h>
 #include <lunar/mm/heap.h>
@@ -92,9 +93,17 @@ static void ioapic_redtbl_write(u32 __iomem* ioapic, u8 entry, u8 vector,
 	ioapic_write(ioapic, IOAPIC_REG_REDTBL_BASE + 1 + (entry * 2), (u32)dest << 24);
 }
 
+/*
+ * Threads waiting for an interrupt to leave the local APIC, see apic_unset_irq(). They wait on the CPU
+ * the interrupt is sent to, with IRQ's disabled until they're queued, so the EOI can't miss them.
+ */
+static WAIT_QUEUE_DEFINE(eoi_wait);
+
 static void apic_eoi(const struct isr* isr) {
 	(void)isr;
 	lapic_write(LAPIC_REG_EOI, 0);
+	if (unlikely(wait_queue_active(&eoi_wait)))
+		wake_up_all(&eoi_wait);
 }
 
 static int ioapic_set_irq(u8 irq, u8 vector, u8 processor, bool masked) {
@@ -158,12 +167,14 @@ static bool apic_is_masked(const struct isr* isr) {
 	return (low >> 16) & 1;
 }
 
+static bool apic_irq_idle(void* arg) {
+	struct isr* isr = arg;
+	return likely(!apic_in_service(isr)) && !apic_is_pending(isr);
+}
+
 static void apic_unset_irq(struct isr* isr) {
-	while (1) {
-		if (likely(!apic_in_service(isr)) && !apic_is_pending(isr))
-			break;
-		schedule();
-	}
+	/* A pending interrupt is still delivered here, and its EOI wakes this up */
+	wait_event(&eoi_wait, apic_irq_idle, isr, 0);
 
 	isr->irq = (struct irq){ .eoi = NULL, .set_masked = NULL, .unset_irq = NULL,
 		.irq = -1, .cpu = NULL, .is_masked = NULL
@@ -0,0 +1,63 @@
+#include <lunar/core/completion.h>
+
+/* Called with the wait queue locked, so checking and taking a signal is one step */
+static bool completion_take(void* arg) {
+	struct completion* comp = arg;
+	if (comp->done == 0)
+		return false;
+	if (comp->done != COMPLETION_ALL)
+		comp->done--;
+	return true;
+}
+
+int completion_wait(struct completion* comp, int flags) {
+	return wait_event(&comp->wait, completion_take, comp, flags | WAIT_EXCLUSIVE);
+}
+
+int completion_wait_timed(struct completion* comp, time_t timeout_ms, int flags) {
+	return wait_event_timed(&comp->wait, completion_take, comp, timeout_ms, flags | WAIT_EXCLUSIVE);
+}
+
+void completion_signal(struct completion* comp) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&comp->wait.lock, &irq);
+
+	if (comp->done != COMPLETION_ALL && comp->done != COMPLETION_ALL - 1)
+		comp->done++;
+	wake_up_locked(&comp->wait, false);
+
+	spinlock_unlock_irq_restore(&comp->wait.lock, &irq);
+}
+
+void completion_signal_all(struct completion* comp) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&comp->wait.lock, &irq);
+
+	comp->done = COMPLETION_ALL;
+	wake_up_locked(&comp->wait, true);
+
+	spinlock_unlock_irq_restore(&comp->wait.lock, &irq);
+}
+
+bool completion_done(struct completion* comp) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&comp->wait.lock, &irq);
+	bool done = comp->done != 0;
+	spinlock_unlock_irq_restore(&comp->wait.lock, &irq);
+	return done;
+}
+
+int completion_reset(struct completion* comp) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&comp->wait.lock, &irq);
+
+	int ret = -EBUSY;
+	if (wait_queue_active(&comp->wait))
+		goto out;
+
+	ret = 0;
+	comp->done = 0;
+out:
+	spinlock_unlock_irq_restore(&comp->wait.lock, &irq);
+	return ret;
+}
@@ -17,6 +17,8 @@ static volatile struct limine_mp_request __limine_request mp_request = {
 	.response = NULL
 };
 
+DEFINE_PER_CPU(struct cpu*, cpu_struct);
+
 /* The pointer itself can be modified when another CPU is trying to get it, so access atomically */
 static atomic(struct smp_cpus*) smp_cpus;
 
@@ -28,7 +30,13 @@ void cpu_structs_init(void) {
 	size_t struct_size = sizeof(struct smp_cpus) + (mp_request.response->cpu_count * sizeof(struct cpu*));
 	physaddr_t address = alloc_pages(MM_ZONE_NORMAL | MM_NOFAIL, get_order(struct_size));
 	atomic_store(&smp_cpus, hhdm_virtual(address));
-	atomic_load(&smp_cpus)->count = mp_request.response->cpu_count;
+	u64 count = mp_request.response->cpu_count;
+	if (count > CONFIG_MAX_CPUS) {
+		printk(PRINTK_WARN "core: Only using %d of %llu CPUs, raise CONFIG_MAX_CPUS to use the rest\n",
+				CONFIG_MAX_CPUS, (unsigned long long)count);
+		count = CONFIG_MAX_CPUS;
+	}
+	atomic_load(&smp_cpus)->count = count;
 }
 
 void cpu_register(void) {
@@ -45,10 +53,12 @@ void cpu_init_finish(void) {
 
 void cpu_startup_aps(void) {
 	struct limine_mp_response* mp = mp_request.response;
-	atomic_store(&cpus_left, mp->cpu_count - 1);
-	for (u64 i = 0; i < mp->cpu_count; i++) {
+	i64 aps = atomic_load(&smp_cpus)->count - 1;
+	atomic_store(&cpus_left, aps);
+	for (u64 i = 0; i < mp->cpu_count && aps > 0; i++) {
 		if (mp->cpus[i]->lapic_id == mp->bsp_lapic_id)
 			continue;
+		aps--;
 
 		/* The CPU's are parked by the bootloader, an atomic write here causes the target CPU to start */
 		atomic_store_explicit(&mp->cpus[i]->goto_address, _ap_start, ATOMIC_SEQ_CST);
@@ -56,6 +66,7 @@ void cpu_startup_aps(void) {
 
 	while (atomic_load(&cpus_left))
 		cpu_relax();
+	topology_init();
 
 	struct smp_cpus* cpus = atomic_load(&smp_cpus);
 	physaddr_t cpu_structs = hhdm_physical(cpus);
@@ -78,20 +89,22 @@ void cpu_ap_init(struct limine_mp_info* mp_info) {
 	struct cpu* cpu = hhdm_virtual(alloc_pages(MM_ZONE_NORMAL | MM_NOFAIL, get_order(sizeof(*cpu))));
 	memset(cpu, 0, sizeof(*cpu));
 
-	cpu->self = cpu;
+	cpu->percpu_offset = percpu_ap_init();
+	this_cpu_write(cpu_struct, cpu);
 	cpu->lapic_id = mp_info->lapic_id;
 	cpu->processor_id = mp_info->processor_id;
 	cpu->sched_processor_id = atomic_fetch_add(&sched_ids, 1);
-
-	wrmsr(MSR_GS_BASE, (uintptr_t)cpu);
+	topology_cpu_init();
 }
 
 void cpu_bsp_init(void) {
 	static struct cpu bsp_cpu = {
-		.self = &bsp_cpu,
 		.sched_processor_id = 0,
 	};
 
+	bsp_cpu.percpu_offset = percpu_bsp_init();
+	this_cpu_write(cpu_struct, &bsp_cpu);
+
 	struct limine_mp_response* mp = mp_request.response;
 	assert(mp != NULL);
 
@@ -102,5 +115,5 @@ void cpu_bsp_init(void) {
 			break;
 		}
 	}
-	wrmsr(MSR_GS_BASE, (uintptr_t)&bsp_cpu);
+	topology_cpu_init();
 }
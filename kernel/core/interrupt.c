@@ -12,8 +12,10 @@
 #include <lunar/core/apic.h>
 #include <lunar/init/status.h>
 #include <lunar/mm/vmm.h>
+#include <lunar/mm/tlb.h>
 #include <lunar/sched/scheduler.h>
 #include <lunar/sched/preempt.h>
+#include <lunar/sched/workqueue.h>
 #include <lunar/lib/string.h>
 #include "traps.h"
 #include "i8259.h"
@@ -129,33 +131,20 @@ int interrupt_register(struct isr* isr, void (*func)(struct isr*, struct context
 /* Must be called on the target CPU of the ISR */
 static void interrupt_unregister_work(void* arg) {
 	struct isr* isr = arg;
-	struct semaphore* sem = isr->private;
 	isr->irq.unset_irq(isr);
-	semaphore_signal(sem);
 }
 
 static int __interrupt_unregister(struct isr* isr) {
-	struct semaphore* sem = kmalloc(sizeof(*sem), MM_ZONE_NORMAL);
-	if (!sem)
-		return -ENOMEM;
-
 	int err = isr->irq.set_masked(isr, true);
-	if (err) {
-		kfree(sem);
+	if (err)
 		return err;
-	}
 	bug(interrupt_synchronize(isr) != 0);
 
-	semaphore_init(sem, 0);
-	isr->private = sem; /* Safe, since the ISR is blocked from running after syncing */
-	err = sched_workqueue_add_on(isr->irq.cpu, interrupt_unregister_work, isr);
-	while (err == -EAGAIN) {
-		schedule();
-		err = sched_workqueue_add_on(isr->irq.cpu, interrupt_unregister_work, isr);
-	}
-
-	semaphore_wait(sem, 0);
-	kfree(sem);
+	/* Nothing else knows about the work item, so it can live on the stack until it's flushed */
+	struct work work;
+	work_init(&work, interrupt_unregister_work, isr);
+	queue_work_on(system_wq, isr->irq.cpu, &work);
+	flush_work(&work);
 	return 0;
 }
 
@@ -176,6 +165,11 @@ int interrupt_unregister(struct isr* isr) {
 	return err;
 }
 
+static bool isr_synced(void* arg) {
+	struct isr* isr = arg;
+	return atomic_load(&isr->inflight) == LONG_MIN;
+}
+
 int interrupt_synchronize(struct isr* isr) {
 	if (init_status_get() < INIT_STATUS_SCHED)
 		return -EWOULDBLOCK;
@@ -193,9 +187,7 @@ int interrupt_synchronize(struct isr* isr) {
 
 	spinlock_unlock_irq_restore(&isr->lock, &irq);
 
-	while (atomic_load(&isr->inflight) != LONG_MIN)
-		schedule();
-
+	wait_event(&isr->sync_wait, isr_synced, isr, 0);
 	return 0;
 }
 
@@ -248,8 +240,12 @@ static inline bool is_resched_a_bad_idea(u8 vector) {
 static void irq_exit(struct isr* isr, bool nested) {
 	if (likely(init_status_get() >= INIT_STATUS_SCHED) && !nested)
 		preempt_offset(-HARDIRQ_OFFSET);
-	if (interrupt_get_vector(isr) >= INTERRUPT_EXCEPTION_COUNT && isr->irq.irq != -1)
-		atomic_sub_fetch(&isr->inflight, 1);
+	if (interrupt_get_vector(isr) < INTERRUPT_EXCEPTION_COUNT || isr->irq.irq == -1)
+		return;
+
+	/* The last one out after a synchronize lets the waiters go */
+	if (atomic_sub_fetch(&isr->inflight, 1) == LONG_MIN)
+		wake_up_all(&isr->sync_wait);
 }
 
 static inline bool check_cpu(void) {
@@ -268,6 +264,8 @@ void __asmlinkage __isr_entry(struct context* ctx) {
 	bool bad_cpu = unlikely(is_resched_a_bad_idea(ctx->vector)) ? check_cpu() : false;
 	if (unlikely(bad_cpu))
 		swap_cpu();
+	else if (likely(!is_resched_a_bad_idea(ctx->vector)))
+		tlb_lazy_exit(); /* Flush anything that was queued while this CPU was idle */
 
 	struct isr* isr = &isr_handlers[ctx->vector];
 	bool nested;
@@ -351,6 +349,7 @@ void interrupts_init(void) {
 			isr_free_list[i] = true;
 		}
 		spinlock_init(&isr_handlers[i].lock);
+		wait_queue_init(&isr_handlers[i].sync_wait);
 		isr_handlers[i].irq.irq = -1;
 	}
 
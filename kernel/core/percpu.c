@@ -0,0 +1,163 @@
+#include <lunar/asm/msr.h>
+#include <lunar/core/percpu.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/mutex.h>
+#include <lunar/lib/string.h>
+#include <lunar/mm/buddy.h>
+#include <lunar/mm/heap.h>
+#include <lunar/mm/hhdm.h>
+
+extern u8 _ld_kernel_percpu_start[];
+extern u8 _ld_kernel_percpu_end[];
+extern u8 _ld_kernel_percpu_bsp_start[];
+extern u8 _ld_kernel_percpu_bsp_end[];
+
+DEFINE_PER_CPU(uintptr_t, this_cpu_off);
+
+/* The dynamic part of every area is handed out in units, and tracked with two bitmaps */
+#define PERCPU_UNIT 16
+#define PERCPU_ALIGN_MAX 64
+
+static MUTEX_DEFINE(dynamic_lock);
+static u64* dynamic_used; /* Units that are allocated */
+static u64* dynamic_end; /* The last unit of every allocation */
+static size_t dynamic_units;
+
+static inline size_t static_size(void) {
+	return (uintptr_t)_ld_kernel_percpu_end - (uintptr_t)_ld_kernel_percpu_start;
+}
+
+static inline size_t area_size(void) {
+	return (uintptr_t)_ld_kernel_percpu_bsp_end - (uintptr_t)_ld_kernel_percpu_bsp_start;
+}
+
+/* Where alloc_percpu() hands out addresses from, right after the template like in the areas */
+static inline uintptr_t dynamic_base(void) {
+	return (uintptr_t)_ld_kernel_percpu_end;
+}
+
+static uintptr_t install_area(u8* area) {
+	memcpy(area, _ld_kernel_percpu_start, static_size());
+	memset(area + static_size(), 0, area_size() - static_size());
+
+	/* Never zero, the area is outside the template, so GSBASE still tells kernel and user apart */
+	uintptr_t offset = (uintptr_t)area - (uintptr_t)_ld_kernel_percpu_start;
+	wrmsr(MSR_GS_BASE, offset);
+	this_cpu_write(this_cpu_off, offset);
+	return offset;
+}
+
+uintptr_t percpu_bsp_init(void) {
+	return install_area(_ld_kernel_percpu_bsp_start);
+}
+
+uintptr_t percpu_ap_init(void) {
+	physaddr_t area = alloc_pages(MM_ZONE_NORMAL | MM_NOFAIL, get_order(area_size()));
+	return install_area(hhdm_virtual(area));
+}
+
+static inline bool bit_test(const u64* map, size_t bit) {
+	return (map[bit / 64] & (1ul << (bit % 64))) != 0;
+}
+
+static inline void bit_set(u64* map, size_t bit) {
+	map[bit / 64] |= 1ul << (bit % 64);
+}
+
+static inline void bit_clear(u64* map, size_t bit) {
+	map[bit / 64] &= ~(1ul << (bit % 64));
+}
+
+static bool dynamic_init(void) {
+	if (dynamic_used)
+		return true;
+
+	dynamic_units = (area_size() - static_size()) / PERCPU_UNIT;
+	size_t map_size = ROUND_UP(dynamic_units, 64) / 8;
+	dynamic_used = kzalloc(map_size, MM_ZONE_NORMAL);
+	dynamic_end = kzalloc(map_size, MM_ZONE_NORMAL);
+	if (!dynamic_used || !dynamic_end) {
+		kfree(dynamic_used);
+		kfree(dynamic_end);
+		dynamic_used = NULL;
+		dynamic_end = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/* First fit, starting on a multiple of step */
+static long dynamic_find(size_t units, size_t step) {
+	size_t start = 0;
+	while (start + units <= dynamic_units) {
+		size_t i = 0;
+		while (i < units && !bit_test(dynamic_used, start + i))
+			i++;
+		if (i == units)
+			return start;
+
+		start = ROUND_UP(start + i + 1, step);
+	}
+
+	return -1;
+}
+
+void* alloc_percpu(size_t size, size_t align) {
+	if (size == 0 || align == 0 || (align & (align - 1)) || align > PERCPU_ALIGN_MAX)
+		return NULL;
+
+	size_t units = ROUND_UP(size, PERCPU_UNIT) / PERCPU_UNIT;
+	size_t step = align > PERCPU_UNIT ? align / PERCPU_UNIT : 1;
+
+	mutex_lock(&dynamic_lock);
+
+	long start = -1;
+	if (dynamic_init())
+		start = dynamic_find(units, step);
+	if (start < 0) {
+		mutex_unlock(&dynamic_lock);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < units; i++)
+		bit_set(dynamic_used, start + i);
+	bit_set(dynamic_end, start + units - 1);
+
+	mutex_unlock(&dynamic_lock);
+
+	/* CPU's that aren't registered yet zero their whole area when they come up */
+	void* ptr = (void*)(dynamic_base() + start * PERCPU_UNIT);
+	const struct smp_cpus* cpus = smp_cpus_get();
+	for (u32 i = 0; i < cpus->count; i++) {
+		if (cpus->cpus[i])
+			memset(per_cpu_ptr(ptr, cpus->cpus[i]), 0, size);
+	}
+
+	return ptr;
+}
+
+void free_percpu(void* ptr) {
+	if (!ptr)
+		return;
+
+	uintptr_t addr = (uintptr_t)ptr;
+	bug(addr < dynamic_base() || (addr - dynamic_base()) % PERCPU_UNIT != 0);
+	size_t unit = (addr - dynamic_base()) / PERCPU_UNIT;
+
+	mutex_lock(&dynamic_lock);
+
+	bug(unit >= dynamic_units || !bit_test(dynamic_used, unit));
+	bug(unit > 0 && bit_test(dynamic_used, unit - 1) && !bit_test(dynamic_end, unit - 1)); /* Not the start */
+	while (1) {
+		bug(unit >= dynamic_units);
+		bit_clear(dynamic_used, unit);
+		if (bit_test(dynamic_end, unit)) {
+			bit_clear(dynamic_end, unit);
+			break;
+		}
+		unit++;
+	}
+
+	mutex_unlock(&dynamic_lock);
+}
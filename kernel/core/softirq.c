@@ -52,21 +52,38 @@ void do_pending_softirqs(bool daemon) {
 		if (reent-- == 0)
 			break;
 	}
+
+	ts = timekeeper_time();
+	irqflags_t irq = local_irq_save();
+	cpu->runqueue.stats.softirq_time += timespec_to_ns(&ts) - start_ns;
+	local_irq_restore(irq);
+
+	/* Out of time, let the daemon finish the rest */
+	if (!daemon && cpu->softirqs_pending && cpu->softirqd)
+		sched_wakeup(cpu->softirqd, 0);
 }
 
 static int softirq_daemon(void* arg) {
 	(void)arg;
 
-	int err = sched_change_prio(current_thread(), SOFTIRQ_PRIO);
+	struct thread* self = current_thread();
+	int err = sched_set_class(self, SCHED_CLASS_FIFO, SOFTIRQ_PRIO);
 	if (err) {
 		printk(PRINTK_WARN "softirqd-%u: Failed to set priority: %i\n",
 				current_cpu()->sched_processor_id, err);
 	}
 
+	current_cpu()->softirqd = self;
 	while (1) {
 		preempt_offset(SOFTIRQ_OFFSET);
 		do_pending_softirqs(true);
 		preempt_offset(-SOFTIRQ_OFFSET);
+
+		/* Block until an interrupt exit leaves something behind, otherwise this CPU never goes idle */
+		irqflags_t irq = local_irq_save();
+		if (!current_cpu()->softirqs_pending)
+			sched_prepare_sleep(0, SCHED_SLEEP_BLOCK);
+		local_irq_restore(irq);
 		schedule();
 	}
 
@@ -0,0 +1,215 @@
+#include <lunar/common.h>
+#include <lunar/compiler.h>
+#include <lunar/asm/wrap.h>
+#include <lunar/core/timer.h>
+#include <lunar/core/timekeeper.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/panic.h>
+#include <lunar/sched/scheduler.h>
+
+#define LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+#define LEVEL_SHIFT(n) ((n) * TIMER_LEVEL_SHIFT)
+#define LEVEL_GRAN(n) (1ull << LEVEL_SHIFT(n))
+#define LEVEL_START(n) ((u64)LEVEL_MASK << LEVEL_SHIFT((n) - 1)) /* Smallest delay that goes in level n */
+#define WHEEL_MAX_DELAY (LEVEL_START(TIMER_LEVELS) - LEVEL_GRAN(TIMER_LEVELS - 1))
+
+static_assert(TIMER_LEVEL_SIZE == sizeof(unsigned long) * 8, "timer pending bitmap must be one word per level");
+
+/* Pick the bucket for a timer, rounding up so it never fires early */
+static unsigned int calc_bucket(u64 clk, u64 expires, u64* bucket_expiry) {
+	if (expires < clk)
+		expires = clk;
+	u64 delta = expires - clk;
+	if (delta >= LEVEL_START(TIMER_LEVELS)) {
+		expires = clk + WHEEL_MAX_DELAY;
+		delta = WHEEL_MAX_DELAY;
+	}
+
+	unsigned int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= LEVEL_START(level + 1))
+		level++;
+
+	u64 slot = (expires + LEVEL_GRAN(level) - 1) >> LEVEL_SHIFT(level);
+	*bucket_expiry = slot << LEVEL_SHIFT(level);
+	return level * TIMER_LEVEL_SIZE + (slot & LEVEL_MASK);
+}
+
+static void recalc_next_expiry(struct timer_base* base) {
+	u64 next = U64_MAX;
+	for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+		unsigned long bits = base->pending[level];
+		if (!bits)
+			continue;
+
+		/* Buckets are searched starting from the first one that isn't in the past */
+		u64 start = (base->clk + LEVEL_GRAN(level) - 1) >> LEVEL_SHIFT(level);
+		unsigned int pos = start & LEVEL_MASK;
+		unsigned long rotated = pos ? (bits >> pos) | (bits << (TIMER_LEVEL_SIZE - pos)) : bits;
+		u64 expiry = (start + __builtin_ctzl(rotated)) << LEVEL_SHIFT(level);
+		if (expiry < next)
+			next = expiry;
+	}
+
+	base->next_expiry = next;
+}
+
+static void enqueue_timer(struct timer_base* base, struct timer* timer, u64 expires) {
+	u64 bucket_expiry;
+	unsigned int bucket = calc_bucket(base->clk, expires, &bucket_expiry);
+
+	list_add_tail(&base->buckets[bucket], &timer->link);
+	base->pending[bucket / TIMER_LEVEL_SIZE] |= 1ul << (bucket % TIMER_LEVEL_SIZE);
+	timer->expires = expires;
+	timer->bucket = bucket;
+	timer->base = base;
+
+	if (bucket_expiry < base->next_expiry)
+		base->next_expiry = bucket_expiry;
+}
+
+static void detach_timer(struct timer_base* base, struct timer* timer) {
+	unsigned int bucket = timer->bucket;
+	list_remove(&timer->link);
+	timer->base = NULL;
+
+	if (list_empty(&base->buckets[bucket])) {
+		base->pending[bucket / TIMER_LEVEL_SIZE] &= ~(1ul << (bucket % TIMER_LEVEL_SIZE));
+		recalc_next_expiry(base);
+	}
+}
+
+bool timer_cancel(struct timer* timer) {
+	while (1) {
+		struct timer_base* base = timer->base;
+		if (!base)
+			return false;
+
+		/* The timer can move to another base while waiting for the lock */
+		irqflags_t irq;
+		spinlock_lock_irq_save(&base->lock, &irq);
+		bool same = timer->base == base;
+		if (same)
+			detach_timer(base, timer);
+		spinlock_unlock_irq_restore(&base->lock, &irq);
+
+		if (same)
+			return true;
+	}
+}
+
+bool timer_cancel_sync(struct timer* timer) {
+	bool pending = timer_cancel(timer);
+
+	/* The timer may have already been collected, and be running on another CPU */
+	const struct smp_cpus* cpus = smp_cpus_get();
+	for (u32 i = 0; i < cpus->count; i++) {
+		while (atomic_load(&cpus->cpus[i]->timer_base.running) == timer)
+			cpu_relax();
+	}
+
+	return pending;
+}
+
+void timer_arm(struct timer* timer, time_t expires) {
+	timer_cancel(timer);
+	u64 tick = expires > 0 ? ((u64)expires + TIMER_TICK_NS - 1) / TIMER_TICK_NS : 0;
+
+	irqflags_t irq = local_irq_save();
+	struct timer_base* base = &current_cpu()->timer_base;
+
+	spinlock_lock(&base->lock);
+	u64 prev_next = base->next_expiry;
+	enqueue_timer(base, timer, tick);
+	bool earlier = base->next_expiry < prev_next;
+	spinlock_unlock(&base->lock);
+
+	/* The CPU's timer might not fire until well after this one is due */
+	if (earlier)
+		sched_timer_reprogram();
+	local_irq_restore(irq);
+}
+
+/* Move every bucket that expires at base->clk into a list */
+static void collect_expired(struct timer_base* base, struct list_head* expired) {
+	u64 clk = base->clk;
+	for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+		unsigned int pos = clk & LEVEL_MASK;
+		if (base->pending[level] & (1ul << pos)) {
+			struct list_head* bucket = &base->buckets[level * TIMER_LEVEL_SIZE + pos];
+			base->pending[level] &= ~(1ul << pos);
+			while (!list_empty(bucket)) {
+				struct timer* timer = list_first_entry(bucket, struct timer, link);
+				list_remove(&timer->link);
+				list_add_tail(expired, &timer->link);
+			}
+		}
+
+		/* The next level only has a bucket due if clk is on its boundary */
+		if (clk & (LEVEL_GRAN(1) - 1))
+			break;
+		clk >>= TIMER_LEVEL_SHIFT;
+	}
+}
+
+void timers_run(time_t now) {
+	struct timer_base* base = &current_cpu()->timer_base;
+	u64 now_tick = (u64)now / TIMER_TICK_NS;
+
+	spinlock_lock(&base->lock);
+	while (base->clk <= now_tick) {
+		if (base->next_expiry > base->clk) {
+			/* Nothing is due until next_expiry, so skip straight to it */
+			if (base->next_expiry > now_tick) {
+				base->clk = now_tick + 1;
+				break;
+			}
+			base->clk = base->next_expiry;
+		}
+
+		struct list_head expired;
+		list_head_init(&expired);
+		collect_expired(base, &expired);
+		base->clk++;
+		recalc_next_expiry(base);
+
+		/* The lock is dropped for callbacks, so they can re-arm their own timer */
+		while (!list_empty(&expired)) {
+			struct timer* timer = list_first_entry(&expired, struct timer, link);
+			list_remove(&timer->link);
+			timer->base = NULL;
+			atomic_store(&base->running, timer);
+			spinlock_unlock(&base->lock);
+
+			timer->func(timer->arg);
+
+			spinlock_lock(&base->lock);
+			atomic_store(&base->running, NULL);
+		}
+	}
+	spinlock_unlock(&base->lock);
+}
+
+time_t timers_next_expiry(void) {
+	struct timer_base* base = &current_cpu()->timer_base;
+
+	irqflags_t irq;
+	spinlock_lock_irq_save(&base->lock, &irq);
+	u64 next = base->next_expiry;
+	spinlock_unlock_irq_restore(&base->lock, &irq);
+
+	if (next == U64_MAX)
+		return -1;
+	return (time_t)(next * TIMER_TICK_NS);
+}
+
+void timer_cpu_init(void) {
+	struct timer_base* base = &current_cpu()->timer_base;
+	spinlock_init(&base->lock);
+	for (size_t i = 0; i < ARRAY_SIZE(base->buckets); i++)
+		list_head_init(&base->buckets[i]);
+
+	struct timespec ts = timekeeper_time();
+	base->clk = (u64)timespec_to_ns(&ts) / TIMER_TICK_NS;
+	base->next_expiry = U64_MAX;
+	atomic_store(&base->running, NULL);
+}
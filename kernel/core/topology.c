@@ -0,0 +1,152 @@
+#include <lunar/asm/cpuid.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/topology.h>
+#include <lunar/core/printk.h>
+
+/* Level types of the extended topology leaves */
+#define TOPOLOGY_LEVEL_INVALID 0
+#define TOPOLOGY_LEVEL_SMT 1
+
+/* Cache types of the cache parameter leaves */
+#define CACHE_TYPE_NULL 0
+
+/* The number of APIC ID bits needed for count ID's */
+static u32 id_bits(u32 count) {
+	return count <= 1 ? 0 : 32 - __builtin_clz(count - 1);
+}
+
+static inline u32 id_shift(u32 apic_id, u32 shift) {
+	return shift >= 32 ? 0 : apic_id >> shift;
+}
+
+/*
+ * Leaf 0x1F and 0xB list the levels from SMT upwards, each with the shift to get to the next one.
+ * The shift of the last level is where the package ID starts.
+ */
+static bool read_ext_topology(u32 leaf, u32* apic_id, u32* smt_shift, u32* package_shift) {
+	u32 eax, ebx, ecx, edx;
+	cpuid(leaf, 0, &eax, &ebx, &ecx, &edx);
+	if (ebx == 0)
+		return false; /* Not supported, even if the leaf exists */
+
+	*apic_id = edx;
+	*smt_shift = 0;
+	*package_shift = 0;
+	for (u32 subleaf = 0; subleaf < 32; subleaf++) {
+		cpuid(leaf, subleaf, &eax, &ebx, &ecx, &edx);
+		u32 type = (ecx >> 8) & 0xFF;
+		if (type == TOPOLOGY_LEVEL_INVALID)
+			break;
+
+		u32 shift = eax & 0x1F;
+		if (type == TOPOLOGY_LEVEL_SMT)
+			*smt_shift = shift;
+		*package_shift = shift;
+	}
+
+	return true;
+}
+
+/* Find the bits of the APIC ID that CPU's sharing the last level cache have in common */
+static bool read_llc_shift(u32 leaf, u32* llc_shift) {
+	u32 best_level = 0;
+	for (u32 subleaf = 0; subleaf < 16; subleaf++) {
+		u32 eax, _unused;
+		cpuid(leaf, subleaf, &eax, &_unused, &_unused, &_unused);
+		if ((eax & 0x1F) == CACHE_TYPE_NULL)
+			break;
+
+		/* bits 7:5 are the level, bits 25:14 are the number of logical CPU's sharing it minus one */
+		u32 level = (eax >> 5) & 0x7;
+		if (level >= best_level) {
+			best_level = level;
+			*llc_shift = id_bits(((eax >> 14) & 0xFFF) + 1);
+		}
+	}
+
+	return best_level != 0;
+}
+
+static bool has_amd_cache_leaf(void) {
+	u32 eax, ecx, _unused;
+	cpuid(CPUID_EXT_LEAF_HIGHEST_FUNCTION, 0, &eax, &_unused, &_unused, &_unused);
+	if (eax < CPUID_EXT_LEAF_CACHE_PARAMS)
+		return false;
+
+	/* bit 22 is TopologyExtensions */
+	cpuid(CPUID_EXT_LEAF_FEATURE_BITS, 0, &_unused, &_unused, &ecx, &_unused);
+	return (ecx & (1 << 22)) != 0;
+}
+
+void topology_cpu_init(void) {
+	struct cpu* cpu = current_cpu();
+	struct cpu_topology* topo = &cpu->topology;
+
+	u32 max_leaf, eax, ebx, edx, _unused;
+	cpuid(CPUID_LEAF_HIGHEST_FUNCTION, 0, &max_leaf, &_unused, &_unused, &_unused);
+
+	u32 apic_id = cpu->lapic_id, smt_shift = 0, package_shift = 0;
+	bool found = false;
+	if (max_leaf >= CPUID_LEAF_V2_EXT_TOPOLOGY)
+		found = read_ext_topology(CPUID_LEAF_V2_EXT_TOPOLOGY, &apic_id, &smt_shift, &package_shift);
+	if (!found && max_leaf >= CPUID_LEAF_EXT_TOPOLOGY)
+		found = read_ext_topology(CPUID_LEAF_EXT_TOPOLOGY, &apic_id, &smt_shift, &package_shift);
+	if (!found) {
+		/* bit 28 is HTT, then bits 23:16 of EBX are the logical CPU's in the package */
+		cpuid(CPUID_LEAF_FEATURE_BITS, 0, &_unused, &ebx, &_unused, &edx);
+		u32 logical = (edx & (1 << 28)) ? (ebx >> 16) & 0xFF : 1;
+		u32 cores = logical;
+		if (max_leaf >= CPUID_LEAF_CACHE_PARAMS) {
+			cpuid(CPUID_LEAF_CACHE_PARAMS, 0, &eax, &_unused, &_unused, &_unused);
+			if (eax & 0x1F)
+				cores = (eax >> 26) + 1;
+		}
+
+		package_shift = id_bits(logical);
+		smt_shift = cores < logical ? id_bits(logical / cores) : 0;
+	}
+
+	/* Without cache information, assume the package shares one */
+	u32 llc_shift = package_shift;
+	if (!(max_leaf >= CPUID_LEAF_CACHE_PARAMS && read_llc_shift(CPUID_LEAF_CACHE_PARAMS, &llc_shift)) &&
+			has_amd_cache_leaf())
+		read_llc_shift(CPUID_EXT_LEAF_CACHE_PARAMS, &llc_shift);
+
+	topo->apic_id = apic_id;
+	topo->core_id = id_shift(apic_id, smt_shift);
+	topo->llc_id = id_shift(apic_id, llc_shift);
+	topo->package_id = id_shift(apic_id, package_shift);
+}
+
+void topology_init(void) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	for (u32 i = 0; i < cpus->count; i++) {
+		struct cpu_topology* topo = &cpus->cpus[i]->topology;
+		cpumask_zero(&topo->smt_mask);
+		cpumask_zero(&topo->llc_mask);
+		cpumask_zero(&topo->package_mask);
+
+		for (u32 j = 0; j < cpus->count; j++) {
+			const struct cpu_topology* other = &cpus->cpus[j]->topology;
+			if (other->package_id != topo->package_id)
+				continue;
+			cpumask_set(&topo->package_mask, j);
+			if (other->llc_id == topo->llc_id)
+				cpumask_set(&topo->llc_mask, j);
+			if (other->core_id == topo->core_id)
+				cpumask_set(&topo->smt_mask, j);
+		}
+	}
+
+	/* Every group is counted by its first CPU */
+	u32 packages = 0, llcs = 0, cores = 0;
+	for (u32 i = 0; i < cpus->count; i++) {
+		const struct cpu_topology* topo = &cpus->cpus[i]->topology;
+		packages += cpumask_next(&topo->package_mask, 0) == i;
+		llcs += cpumask_next(&topo->llc_mask, 0) == i;
+		cores += cpumask_next(&topo->smt_mask, 0) == i;
+	}
+
+	printk(PRINTK_INFO "core: %u package(s), %u last level cache(s), %u core(s), %u CPU's\n",
+			packages, llcs, cores, cpus->count);
+}
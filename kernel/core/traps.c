@@ -63,6 +63,11 @@ void do_trap(struct isr* isr, struct context* ctx) {
 	case INTERRUPT_PAGE_FAULT_VECTOR:
 		do_page_fault(ctx);
 		break;
+	case INTERRUPT_NOFPU_VECTOR:
+		/* The kernel is built without SSE, so only user threads can get here */
+		if (ctx->cs == SEGMENT_KERNEL_CODE || !ext_context_fault())
+			panic("FPU used without a context at rip: %p", ctx->rip);
+		break;
 	default:
 		panic("Unhandled Exception: %lu", ctx->vector);
 	}
@@ -0,0 +1,97 @@
+#include <lunar/core/waitqueue.h>
+#include <lunar/core/panic.h>
+#include <lunar/sched/kthread.h>
+
+static inline time_t now_ns(void) {
+	struct timespec ts = timekeeper_time();
+	return timespec_to_ns(&ts);
+}
+
+static int __wait_event(struct wait_queue* wq, bool (*cond)(void*), void* arg, time_t timeout_ms, int flags) {
+	struct wait_entry entry = { .thread = current_thread(), .exclusive = !!(flags & WAIT_EXCLUSIVE) };
+	list_node_init(&entry.link);
+	time_t deadline = timeout_ms ? now_ns() + timeout_ms * 1000000 : 0;
+	int err = 0;
+
+	irqflags_t irq;
+	spinlock_lock_irq_save(&wq->lock, &irq);
+
+	while (!cond(arg)) {
+		if (err)
+			goto out;
+
+		/* Woken up without the condition being true, only sleep for what's left of the timeout */
+		time_t ms = 0;
+		if (deadline) {
+			time_t now = now_ns();
+			if (now >= deadline) {
+				err = -ETIMEDOUT;
+				goto out;
+			}
+			ms = (deadline - now + 999999) / 1000000;
+		}
+
+		if (entry.exclusive)
+			list_add_tail(&wq->waiters, &entry.link);
+		else
+			list_add(&wq->waiters, &entry.link);
+		sched_prepare_sleep(ms, SCHED_SLEEP_BLOCK | (flags & SCHED_SLEEP_INTERRUPTIBLE));
+		spinlock_unlock_irq_restore(&wq->lock, &irq);
+
+		err = schedule();
+
+		/* Still linked if it was a timeout or a signal */
+		spinlock_lock_irq_save(&wq->lock, &irq);
+		if (list_node_linked(&entry.link))
+			list_remove(&entry.link);
+	}
+
+	err = 0;
+out:
+	spinlock_unlock_irq_restore(&wq->lock, &irq);
+	return err;
+}
+
+int wait_event(struct wait_queue* wq, bool (*cond)(void*), void* arg, int flags) {
+	return __wait_event(wq, cond, arg, 0, flags);
+}
+
+int wait_event_timed(struct wait_queue* wq, bool (*cond)(void*), void* arg, time_t timeout_ms, int flags) {
+	if (timeout_ms == 0) {
+		irqflags_t irq;
+		spinlock_lock_irq_save(&wq->lock, &irq);
+		bool ret = cond(arg);
+		spinlock_unlock_irq_restore(&wq->lock, &irq);
+		return ret ? 0 : -ETIMEDOUT;
+	}
+
+	return __wait_event(wq, cond, arg, timeout_ms, flags);
+}
+
+void wake_up_locked(struct wait_queue* wq, bool all) {
+	struct wait_entry* entry, *tmp;
+	list_for_each_entry_safe(entry, tmp, &wq->waiters, link) {
+		/* The entry is on the waiter's stack, it can be gone as soon as the waiter runs */
+		struct thread* thread = entry->thread;
+		bool exclusive = entry->exclusive;
+		list_remove(&entry->link);
+		assert(sched_wakeup(thread, 0) == 0);
+
+		if (exclusive && !all)
+			break;
+	}
+}
+
+void wake_up(struct wait_queue* wq) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&wq->lock, &irq);
+	wake_up_locked(wq, false);
+	spinlock_unlock_irq_restore(&wq->lock, &irq);
+}
+
+void wake_up_all(struct wait_queue* wq) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&wq->lock, &irq);
+	wake_up_locked(wq, true);
+	spinlock_unlock_irq_restore(&wq->lock, &irq);
+}
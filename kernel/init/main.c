@@ -111,6 +111,7 @@ _Noreturn __asmlinkage void kernel_main(void) {
 		printk(PRINTK_ERR "init: Failed to parse cmdline! err: %i\n", err);
 	else
 		set_loglevel();
+	kstack_cache_init();
 
 	if (err_e9hack && err_e9hack != -ENOENT)
 		printk(PRINTK_WARN "init: e9hack module init failed (is this real hardware?) err %i\n", err_e9hack);
@@ -128,6 +129,7 @@ _Noreturn __asmlinkage void kernel_main(void) {
 	sched_init();
 	softirq_cpu_init();
 	cpu_startup_aps();
+	sched_domains_init();
 	init_status_set(INIT_STATUS_SCHED);
 
 	sched_change_prio(current_thread(), SCHED_PRIO_MAX);
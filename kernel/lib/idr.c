@@ -0,0 +1,155 @@
+#include <lunar/common.h>
+#include <lunar/asm/errno.h>
+#include <lunar/lib/idr.h>
+#include <lunar/mm/heap.h>
+
+#define IDR_MASK (IDR_FANOUT - 1)
+#define IDR_FULL U64_MAX
+
+static inline unsigned int slot_index(long id, unsigned int level) {
+	return (id >> (level * IDR_SHIFT)) & IDR_MASK;
+}
+
+void idr_init(struct idr* idr, long max) {
+	atomic_store(&idr->root, NULL);
+	idr->max = max;
+	idr->next = 0;
+	idr->count = 0;
+	mutex_init(&idr->lock);
+
+	/* Enough levels for every ID below max */
+	idr->levels = 1;
+	while (idr->levels * IDR_SHIFT < 63 && (1l << (idr->levels * IDR_SHIFT)) < max)
+		idr->levels++;
+}
+
+static void free_node(struct idr_node* node, unsigned int level) {
+	if (!node)
+		return;
+	if (level > 0) {
+		for (int i = 0; i < IDR_FANOUT; i++)
+			free_node(atomic_load(&node->slots[i]), level - 1);
+	}
+	kfree(node);
+}
+
+void idr_destroy(struct idr* idr) {
+	mutex_lock(&idr->lock);
+	free_node(atomic_load(&idr->root), idr->levels - 1);
+	atomic_store(&idr->root, NULL);
+	idr->count = 0;
+	mutex_unlock(&idr->lock);
+}
+
+/* Find a free ID at or after start in the subtree under slot, allocating nodes on the way down */
+static long find_free(struct idr* idr, idr_slot_t* slot, unsigned int level, long base, long start, void* ptr) {
+	struct idr_node* node = atomic_load(slot);
+	if (!node) {
+		node = kzalloc(sizeof(*node), MM_ZONE_NORMAL);
+		if (!node)
+			return -ENOMEM;
+		atomic_store(slot, node); /* Published after it's zeroed, for lookups without the lock */
+	}
+
+	unsigned int shift = level * IDR_SHIFT;
+	unsigned int first = start > base ? slot_index(start, level) : 0;
+	u64 free = ~node->full & (IDR_FULL << first);
+	while (free) {
+		unsigned int i = __builtin_ctzll(free);
+		free &= free - 1;
+
+		long child_base = base + ((long)i << shift);
+		if (child_base >= idr->max)
+			return -ENOSPC;
+
+		if (level == 0) {
+			node->full |= 1ull << i;
+			atomic_store(&node->slots[i], ptr);
+			return child_base;
+		}
+
+		idr_slot_t* child = &node->slots[i];
+		long id = find_free(idr, child, level - 1, child_base, i == first ? start : child_base, ptr);
+		if (id == -ENOSPC)
+			continue;
+		if (id >= 0 && ((struct idr_node*)atomic_load(child))->full == IDR_FULL)
+			node->full |= 1ull << i;
+		return id;
+	}
+
+	return -ENOSPC;
+}
+
+long idr_alloc(struct idr* idr, void* ptr) {
+	if (!ptr)
+		return -EINVAL;
+
+	mutex_lock(&idr->lock);
+
+	long id = find_free(idr, &idr->root, idr->levels - 1, 0, idr->next, ptr);
+	if (id == -ENOSPC && idr->next != 0)
+		id = find_free(idr, &idr->root, idr->levels - 1, 0, 0, ptr); /* Wrap around */
+	if (id >= 0) {
+		idr->next = id + 1 < idr->max ? id + 1 : 0;
+		idr->count++;
+	}
+
+	mutex_unlock(&idr->lock);
+	return id;
+}
+
+/* Walk down to the leaf slot of an ID, the path is saved so full bits can be cleared on the way back up */
+static idr_slot_t* find_slot(struct idr* idr, long id, struct idr_node** path) {
+	if (id < 0 || id >= idr->max)
+		return NULL;
+
+	struct idr_node* node = atomic_load(&idr->root);
+	for (unsigned int level = idr->levels - 1; node && level > 0; level--) {
+		if (path)
+			path[level] = node;
+		node = atomic_load(&node->slots[slot_index(id, level)]);
+	}
+
+	if (!node)
+		return NULL;
+	if (path)
+		path[0] = node;
+	return &node->slots[slot_index(id, 0)];
+}
+
+void* idr_remove(struct idr* idr, long id) {
+	struct idr_node* path[64 / IDR_SHIFT + 1];
+
+	mutex_lock(&idr->lock);
+
+	void* ptr = NULL;
+	idr_slot_t* slot = find_slot(idr, id, path);
+	if (slot)
+		ptr = atomic_exchange(slot, NULL);
+	if (ptr) {
+		for (unsigned int level = 0; level < idr->levels; level++)
+			path[level]->full &= ~(1ull << slot_index(id, level));
+		idr->count--;
+	}
+
+	mutex_unlock(&idr->lock);
+	return ptr;
+}
+
+void* idr_find(struct idr* idr, long id) {
+	idr_slot_t* slot = find_slot(idr, id, NULL);
+	return slot ? atomic_load(slot) : NULL;
+}
+
+int idr_replace(struct idr* idr, long id, void* ptr) {
+	if (!ptr)
+		return -EINVAL;
+
+	mutex_lock(&idr->lock);
+	idr_slot_t* slot = find_slot(idr, id, NULL);
+	bool found = slot && atomic_load(slot);
+	if (found)
+		atomic_store(slot, ptr);
+	mutex_unlock(&idr->lock);
+	return found ? 0 : -ENOENT;
+}
@@ -0,0 +1,226 @@
+#include <lunar/common.h>
+#include <lunar/lib/rbtree.h>
+
+static inline bool is_red(const struct rb_node* node) {
+	return node && node->red;
+}
+
+/* Make new take old's place under old's parent */
+static void replace_child(struct rb_root* root, struct rb_node* old, struct rb_node* new) {
+	struct rb_node* parent = old->parent;
+	if (!parent)
+		root->node = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+	if (new)
+		new->parent = parent;
+}
+
+static void rotate_left(struct rb_root* root, struct rb_node* node) {
+	struct rb_node* right = node->right;
+	node->right = right->left;
+	if (right->left)
+		right->left->parent = node;
+	replace_child(root, node, right);
+	right->left = node;
+	node->parent = right;
+}
+
+static void rotate_right(struct rb_root* root, struct rb_node* node) {
+	struct rb_node* left = node->left;
+	node->left = left->right;
+	if (left->right)
+		left->right->parent = node;
+	replace_child(root, node, left);
+	left->right = node;
+	node->parent = left;
+}
+
+void rb_insert_color(struct rb_root* root, struct rb_node* node) {
+	while (is_red(node->parent)) {
+		struct rb_node* parent = node->parent;
+		struct rb_node* gparent = parent->parent; /* A red parent is never the root */
+
+		if (parent == gparent->left) {
+			struct rb_node* uncle = gparent->right;
+			if (is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				gparent->red = true;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->right) {
+				rotate_left(root, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			gparent->red = true;
+			rotate_right(root, gparent);
+		} else {
+			struct rb_node* uncle = gparent->left;
+			if (is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				gparent->red = true;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->left) {
+				rotate_right(root, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			gparent->red = true;
+			rotate_left(root, gparent);
+		}
+	}
+
+	root->node->red = false;
+}
+
+/* node may be NULL, so the parent is passed separately */
+static void erase_fixup(struct rb_root* root, struct rb_node* node, struct rb_node* parent) {
+	while (node != root->node && !is_red(node)) {
+		/* The sibling is never NULL, since the removed black node left it a black height of at least one */
+		if (node == parent->left) {
+			struct rb_node* sibling = parent->right;
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rotate_left(root, parent);
+				sibling = parent->right;
+			}
+			if (!is_red(sibling->left) && !is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!is_red(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red = true;
+				rotate_right(root, sibling);
+				sibling = parent->right;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			rotate_left(root, parent);
+		} else {
+			struct rb_node* sibling = parent->left;
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rotate_right(root, parent);
+				sibling = parent->left;
+			}
+			if (!is_red(sibling->left) && !is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!is_red(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red = true;
+				rotate_left(root, sibling);
+				sibling = parent->left;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			rotate_right(root, parent);
+		}
+		node = root->node;
+		break;
+	}
+
+	if (node)
+		node->red = false;
+}
+
+void rb_erase(struct rb_root* root, struct rb_node* node) {
+	struct rb_node* child, *parent;
+	bool removed_red;
+
+	if (!node->left || !node->right) {
+		child = node->left ? node->left : node->right;
+		parent = node->parent;
+		removed_red = node->red;
+		replace_child(root, node, child);
+	} else {
+		/* Two children, so the successor takes this node's place */
+		struct rb_node* successor = node->right;
+		while (successor->left)
+			successor = successor->left;
+
+		removed_red = successor->red;
+		child = successor->right;
+		if (successor->parent == node) {
+			parent = successor;
+		} else {
+			parent = successor->parent;
+			replace_child(root, successor, child);
+			successor->right = node->right;
+			successor->right->parent = successor;
+		}
+		replace_child(root, node, successor);
+		successor->left = node->left;
+		successor->left->parent = successor;
+		successor->red = node->red;
+	}
+
+	if (!removed_red)
+		erase_fixup(root, child, parent);
+}
+
+struct rb_node* rb_first(const struct rb_root* root) {
+	struct rb_node* node = root->node;
+	if (!node)
+		return NULL;
+	while (node->left)
+		node = node->left;
+	return node;
+}
+
+struct rb_node* rb_last(const struct rb_root* root) {
+	struct rb_node* node = root->node;
+	if (!node)
+		return NULL;
+	while (node->right)
+		node = node->right;
+	return node;
+}
+
+struct rb_node* rb_next(const struct rb_node* node) {
+	if (node->right) {
+		node = node->right;
+		while (node->left)
+			node = node->left;
+		return (struct rb_node*)node;
+	}
+
+	struct rb_node* parent;
+	while ((parent = node->parent) && node == parent->right)
+		node = parent;
+	return parent;
+}
+
+struct rb_node* rb_prev(const struct rb_node* node) {
+	if (node->left) {
+		node = node->left;
+		while (node->right)
+			node = node->right;
+		return (struct rb_node*)node;
+	}
+
+	struct rb_node* parent;
+	while ((parent = node->parent) && node == parent->left)
+		node = parent;
+	return parent;
+}
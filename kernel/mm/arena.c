@@ -0,0 +1,128 @@
+#include <lunar/common.h>
+#include <lunar/compiler.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/spinlock.h>
+#include <lunar/core/panic.h>
+#include <lunar/core/printk.h>
+#include <lunar/mm/buddy.h>
+#include <lunar/mm/hhdm.h>
+#include <lunar/mm/vma.h>
+#include <lunar/lib/string.h>
+#include "internal.h"
+
+#define ARENA_SIZE 0x1000000ul
+#define ARENA_PAGES (ARENA_SIZE >> PAGE_SHIFT)
+#define ULONG_BITS (sizeof(unsigned long) * 8)
+
+/* A chunk of virtual space owned by a CPU, every bit in the map is a page */
+struct vmm_arena {
+	spinlock_t lock;
+	unsigned long next; /* Where to start searching from */
+	unsigned long map[ARENA_PAGES / ULONG_BITS];
+};
+
+static struct vmm_arena* arenas = NULL;
+static uintptr_t arenas_start = 0, arenas_end = 0;
+
+static inline bool arena_test(struct vmm_arena* arena, unsigned long page) {
+	return !!(arena->map[page / ULONG_BITS] & (1ul << (page % ULONG_BITS)));
+}
+
+static long arena_find(struct vmm_arena* arena, unsigned long count) {
+	unsigned long run = 0;
+	for (unsigned long i = 0; i < ARENA_PAGES; i++) {
+		unsigned long page = (arena->next + i) % ARENA_PAGES;
+		if (page == 0)
+			run = 0; /* Runs can't wrap around */
+
+		/* Skip full words */
+		if (page % ULONG_BITS == 0 && arena->map[page / ULONG_BITS] == ULONG_MAX) {
+			run = 0;
+			i += ULONG_BITS - 1;
+			continue;
+		}
+
+		if (arena_test(arena, page)) {
+			run = 0;
+			continue;
+		}
+		if (++run == count)
+			return page + 1 - count;
+	}
+
+	return -1;
+}
+
+static void arena_set(struct vmm_arena* arena, unsigned long page, unsigned long count, bool used) {
+	for (unsigned long i = page; i < page + count; i++) {
+		bug(arena_test(arena, i) == used);
+		if (used)
+			arena->map[i / ULONG_BITS] |= 1ul << (i % ULONG_BITS);
+		else
+			arena->map[i / ULONG_BITS] &= ~(1ul << (i % ULONG_BITS));
+	}
+}
+
+void* vmm_arena_alloc(size_t size) {
+	unsigned long count = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (!arenas || count == 0 || count > VMM_ARENA_MAX_PAGES)
+		return NULL;
+
+	/* IRQ's are disabled first so the thread stays on this CPU */
+	irqflags_t irq = local_irq_save();
+	u32 index = current_cpu()->sched_processor_id;
+	struct vmm_arena* arena = &arenas[index];
+
+	spinlock_lock(&arena->lock);
+	long page = arena_find(arena, count);
+	if (page >= 0) {
+		arena_set(arena, page, count, true);
+		arena->next = (page + count) % ARENA_PAGES;
+	}
+	spinlock_unlock(&arena->lock);
+	local_irq_restore(irq);
+
+	if (page < 0)
+		return NULL;
+	return (void*)(arenas_start + index * ARENA_SIZE + ((unsigned long)page << PAGE_SHIFT));
+}
+
+void vmm_arena_free(void* address, size_t size) {
+	uintptr_t offset = (uintptr_t)address - arenas_start;
+	unsigned long count = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	unsigned long page = (offset % ARENA_SIZE) >> PAGE_SHIFT;
+	bug(!vmm_arena_contains(address) || page + count > ARENA_PAGES);
+
+	/* Can be freed from any CPU, not just the one that allocated it */
+	struct vmm_arena* arena = &arenas[offset / ARENA_SIZE];
+	irqflags_t irq;
+	spinlock_lock_irq_save(&arena->lock, &irq);
+	arena_set(arena, page, count, false);
+	spinlock_unlock_irq_restore(&arena->lock, &irq);
+}
+
+bool vmm_arena_contains(const void* address) {
+	return (uintptr_t)address >= arenas_start && (uintptr_t)address < arenas_end;
+}
+
+void vmm_arena_init(struct mm* mm) {
+	u32 count = smp_cpus_get()->count;
+	size_t size = count * ARENA_SIZE;
+
+	/* Keep the rest of the kernel from using the space, the VMA itself is never touched again */
+	void* base;
+	int err = vma_map(mm, NULL, size, MMU_NONE, 0, &base);
+	if (err) {
+		printk(PRINTK_WARN "mm: Failed to reserve per CPU arenas: %i\n", err);
+		return;
+	}
+
+	struct vmm_arena* _arenas = hhdm_virtual(alloc_pages(MM_ZONE_NORMAL | MM_NOFAIL, get_order(count * sizeof(*_arenas))));
+	memset(_arenas, 0, count * sizeof(*_arenas));
+	for (u32 i = 0; i < count; i++)
+		spinlock_init(&_arenas[i].lock);
+
+	arenas_start = (uintptr_t)base;
+	arenas_end = arenas_start + size;
+	arenas = _arenas;
+}
@@ -7,6 +7,7 @@
 #include <lunar/mm/buddy.h>
 #include <lunar/mm/mm.h>
 #include <lunar/mm/hhdm.h>
+#include <lunar/mm/shrinker.h>
 #include <lunar/lib/string.h>
 #include "internal.h"
 
@@ -527,6 +528,10 @@ physaddr_t alloc_pages(mm_t mm_flags, unsigned int order) {
 			return physical;
 		}
 
+		/* Halfway through, ask the caches for memory before falling back to other zones */
+		if (!(mm_flags & MM_ATOMIC) && retries == max_retries / 2)
+			shrinkers_run();
+
 		if (mm_flags & MM_NOFAIL && retries == 0) {
 			out_of_memory();
 			retries = max_retries;
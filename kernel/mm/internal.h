@@ -25,20 +25,90 @@ static inline void tlb_flush_single(void* virtual) {
 	__asm__ volatile("invlpg (%0)" : : "r"(virtual) : "memory");
 }
 
-static inline void tlb_flush_range(void* virtual, size_t size) {
-	unsigned long count = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
-	if (count >= 128) {
-		ctl3_write(ctl3_read()); /* Global pages disabled, this is fine */
-	} else {
-		for (unsigned long i = 0; i < count; i++)
-			tlb_flush_single((u8*)virtual + (PAGE_SIZE * i));
-	}
+enum invpcid_type {
+	INVPCID_ADDRESS = 0,
+	INVPCID_CONTEXT = 1,
+	INVPCID_ALL_GLOBAL = 2,
+	INVPCID_ALL = 3
+};
+
+static inline void tlb_invpcid(enum invpcid_type type, u16 pcid, void* virtual) {
+	struct {
+		u64 pcid;
+		void* address;
+	} desc = { .pcid = pcid, .address = virtual };
+	__asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"((unsigned long)type) : "memory");
 }
 
+/**
+ * @brief Flush a range on the current CPU
+ *
+ * Kernel ranges are flushed from every PCID, lower half ranges only from the current one.
+ * Large kernel ranges flush global entries too.
+ *
+ * @param virtual The start of the range
+ * @param size The size of the range
+ */
+void tlb_flush_range(void* virtual, size_t size);
+
+/**
+ * @brief Load an mm's page table into CR3
+ *
+ * Reuses the mm's PCID on this CPU if it still has one, so the TLB entries survive
+ * the switch. Must be called with IRQ's disabled.
+ *
+ * @param mm The mm struct to switch to
+ */
+void tlb_switch_mm(struct mm* mm);
+
+/**
+ * @brief Give an mm struct a context ID, must be called before it's ever loaded
+ * @param mm The mm struct
+ */
+void tlb_mm_init(struct mm* mm);
+
+/**
+ * @brief Enable global pages and PCID's if supported, and load the mm
+ * @param mm The mm struct to load
+ */
+void tlb_cpu_init(struct mm* mm);
+
 unsigned long pagetable_mmu_to_pt(mmuflags_t mmu_flags);
 
+/**
+ * @brief Invalidate a range on every CPU that may have it cached
+ *
+ * Doesn't return until every CPU that isn't idle has flushed the range.
+ *
+ * @param address The start of the range
+ * @param size The size of the range
+ */
 void tlb_invalidate(void* address, size_t size);
 
+/**
+ * @brief Flush a range locally, and queue the flush on other CPU's without an IPI
+ *
+ * The range must not be reused until tlb_sync_passed() returns true for the returned tag.
+ *
+ * @param address The start of the range
+ * @param size The size of the range
+ *
+ * @return A tag to pass to tlb_sync_passed()
+ */
+u64 tlb_invalidate_deferred(void* address, size_t size);
+
+/**
+ * @brief Push every queued flush out to the other CPU's in one IPI round
+ */
+void tlb_sync(void);
+
+/**
+ * @brief Check if a deferred invalidation has been seen by every CPU
+ * @param tag The tag returned by tlb_invalidate_deferred()
+ * @return true if the range is safe to reuse
+ */
+bool tlb_sync_passed(u64 tag);
+
 /**
  * @brief Map an entry into a page table
  *
@@ -109,8 +179,47 @@ physaddr_t pagetable_get_physical(pte_t* pagetable, const void* virtual);
  */
 void* pagetable_get_base_address_from_top_index(unsigned int index);
 
+/**
+ * @brief Check if kernel mappings are global
+ * @return true if CR4.PGE should be enabled
+ */
+bool pagetable_global_pages(void);
+
 void pagetable_init(void);
 
+#define VMM_ARENA_MAX_PAGES 16
+
+/**
+ * @brief Allocate virtual space from the current CPU's arena
+ *
+ * Doesn't touch the VMA list, so this doesn't need any mm locks.
+ *
+ * @param size The size of the range
+ *
+ * @return NULL if the size is too big or the arena is full
+ */
+void* vmm_arena_alloc(size_t size);
+
+/**
+ * @brief Give virtual space back to the arena it came from
+ * @param address The start of the range
+ * @param size The size of the range
+ */
+void vmm_arena_free(void* address, size_t size);
+
+/**
+ * @brief Check if an address is in any CPU's arena
+ * @param address The address to check
+ * @return true if the address came from vmm_arena_alloc()
+ */
+bool vmm_arena_contains(const void* address);
+
+/**
+ * @brief Reserve the per CPU arenas
+ * @param mm The kernel mm struct
+ */
+void vmm_arena_init(struct mm* mm);
+
 struct prevpage {
 	void* start;
 	physaddr_t physical;
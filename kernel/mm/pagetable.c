@@ -13,6 +13,8 @@
 
 #define HUGEPAGE_1G 0x40000000
 
+static bool global_pages = false;
+
 static inline pte_t* table_virtual(pte_t entry) {
 	entry &= ~(0xFFF | PT_NX);
 	return hhdm_virtual((physaddr_t)entry);
@@ -48,7 +50,16 @@ unsigned long pagetable_mmu_to_pt(mmuflags_t mmu_flags) {
 
 	if (!(mmu_flags & MMU_EXEC))
 		pt_flags |= PT_NX;
+	if (global_pages && !(mmu_flags & MMU_USER))
+		pt_flags |= PT_GLOBAL;
+
+	return pt_flags;
+}
 
+/* Global entries survive CR3 loads, so they must never be used for the lower half */
+static inline unsigned long strip_global(const void* virtual, unsigned long pt_flags) {
+	if ((uintptr_t)virtual >> 47 == 0)
+		pt_flags &= ~PT_GLOBAL;
 	return pt_flags;
 }
 
@@ -141,7 +152,7 @@ int pagetable_map(pte_t* pagetable, void* virtual, physaddr_t physical, unsigned
 	if (*pte)
 		return -EEXIST;
 
-	*pte = physical | pt_flags;
+	*pte = physical | strip_global(virtual, pt_flags);
 	return 0;
 }
 
@@ -161,7 +172,7 @@ int pagetable_update(pte_t* pagetable, void* virtual, physaddr_t physical, unsig
 	if ((uintptr_t)virtual & (page_size - 1) || physical & (page_size - 1))
 		return -EINVAL;
 
-	*pte = physical | pt_flags;
+	*pte = physical | strip_global(virtual, pt_flags);
 	return 0;
 }
 
@@ -246,12 +257,40 @@ void* pagetable_get_base_address_from_top_index(unsigned int index) {
 	return (void*)((u64)index << 39);
 }
 
+bool pagetable_global_pages(void) {
+	return global_pages;
+}
+
+/* Set the global bit on every leaf under a table, level 1 is the PDPT */
+static void pagetable_set_global(pte_t* table, unsigned int level) {
+	for (unsigned int i = 0; i < PTE_COUNT; i++) {
+		if (!(table[i] & PT_PRESENT))
+			continue;
+		if (level == 3 || table[i] & PT_HUGEPAGE)
+			table[i] |= PT_GLOBAL;
+		else
+			pagetable_set_global(table_virtual(table[i]), level + 1);
+	}
+}
+
 void pagetable_init(void) {
-	u32 ecx, _unused;
-	cpuid(0x07, 0, &_unused, &_unused, &ecx, &_unused);
+	u32 ecx, edx, _unused;
+	cpuid(CPUID_LEAF_EXT_FEATURE_BITS, 0, &_unused, &_unused, &ecx, &_unused);
 
 	/* bit 16 being set means the CPU supports level 5 paging */
 	bool level4 = ecx & (1 << 16) ? !(ctl4_read() & CTL4_LA57) : true;
 	if (!level4)
 		panic("Bootloader selected wrong paging mode!\n");
+
+	/* bit 13 is PGE, if supported make the kernel image and HHDM mapped by the bootloader global */
+	cpuid(CPUID_LEAF_FEATURE_BITS, 0, &_unused, &_unused, &_unused, &edx);
+	if (!(edx & (1 << 13)))
+		return;
+
+	global_pages = true;
+	pte_t* top = hhdm_virtual(ctl3_read() & ~CTL3_PCID_MASK);
+	for (unsigned int i = 256; i < PTE_COUNT; i++) {
+		if (top[i] & PT_PRESENT)
+			pagetable_set_global(table_virtual(top[i]), 1);
+	}
 }
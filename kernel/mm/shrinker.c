@@ -0,0 +1,23 @@
+#include <lunar/mm/shrinker.h>
+
+static atomic(struct shrinker*) shrinkers = atomic_init(NULL);
+static atomic(bool) shrinking = atomic_init(false);
+
+void shrinker_register(struct shrinker* shrinker) {
+	struct shrinker* head = atomic_load(&shrinkers);
+	do {
+		shrinker->next = head;
+	} while (!atomic_compare_exchange_weak(&shrinkers, &head, shrinker));
+}
+
+unsigned long shrinkers_run(void) {
+	if (atomic_exchange(&shrinking, true))
+		return 0;
+
+	unsigned long freed = 0;
+	for (struct shrinker* shrinker = atomic_load(&shrinkers); shrinker; shrinker = shrinker->next)
+		freed += shrinker->shrink(shrinker);
+
+	atomic_store(&shrinking, false);
+	return freed;
+}
@@ -1,5 +1,8 @@
 #include <lunar/asm/wrap.h>
+#include <lunar/asm/cpuid.h>
 #include <lunar/mm/vmm.h>
+#include <lunar/mm/hhdm.h>
+#include <lunar/mm/tlb.h>
 #include <lunar/core/interrupt.h>
 #include <lunar/core/cpu.h>
 #include <lunar/core/apic.h>
@@ -7,50 +10,374 @@
 #include <lunar/init/status.h>
 #include "internal.h"
 
-static atomic(void*) shootdown_address;
-static atomic(size_t) shootdown_size;
-static atomic(u64) shootdown_remaining = atomic_init(0);
-static SPINLOCK_DEFINE(shootdown_lock);
-
 static struct isr* shootdown_isr;
 
+/* See tlb_sync(), started is bumped before a sync, completed is set after everyone acked */
+static atomic(u64) sync_started = atomic_init(0);
+static atomic(u64) sync_completed = atomic_init(0);
+
+static bool pcid_enabled = false;
+static bool global_pages = false;
+static bool invpcid_supported = false;
+static atomic(u64) next_ctx_id = atomic_init(1);
+
 #define KERNEL_SPACE_START ((void*)0xFFFF800000000000)
 
-static void shootdown_ipi(struct isr* isr, struct context* ctx) {
-	(void)isr;
-	(void)ctx;
-	tlb_flush_range(atomic_load(&shootdown_address), atomic_load(&shootdown_size));
-	atomic_sub_fetch(&shootdown_remaining, 1);
+/*
+ * Even with global pages, the paging structure caches of other PCID's may still point
+ * to kernel page tables that were freed, so any other slot on this CPU has to be flushed before it's used again
+ */
+static void tlb_asids_invalidate_others(void) {
+	if (!pcid_enabled)
+		return;
+
+	irqflags_t irq = local_irq_save();
+	struct tlb_asids* asids = &current_cpu()->tlb_asids;
+	for (unsigned int i = 0; i < TLB_ASID_COUNT; i++) {
+		if (i != asids->current)
+			asids->slots[i].tlb_gen = 0;
+	}
+	local_irq_restore(irq);
+}
+
+/* Flush every entry in every PCID, including global ones */
+static void tlb_flush_all(void) {
+	if (invpcid_supported) {
+		tlb_invpcid(global_pages ? INVPCID_ALL_GLOBAL : INVPCID_ALL, 0, NULL);
+	} else if (global_pages) {
+		/* Toggling PGE flushes everything */
+		irqflags_t irq = local_irq_save();
+		unsigned long ctl = ctl4_read();
+		ctl4_write(ctl & ~CTL4_PGE);
+		ctl4_write(ctl);
+		local_irq_restore(irq);
+	} else {
+		ctl3_write(ctl3_read());
+		tlb_asids_invalidate_others();
+	}
+}
+
+void tlb_flush_range(void* virtual, size_t size) {
+	unsigned long count = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	bool kernel = virtual >= KERNEL_SPACE_START;
+
+	if (count >= 128) {
+		/* Lower half mappings are never global, so reloading CR3 is enough for them */
+		if (kernel)
+			tlb_flush_all();
+		else
+			ctl3_write(ctl3_read());
+		return;
+	}
+
+	for (unsigned long i = 0; i < count; i++)
+		tlb_flush_single((u8*)virtual + (PAGE_SIZE * i));
+	if (kernel)
+		tlb_asids_invalidate_others();
+}
+
+/* A lower half range of the current mm was invalidated, so other CPU's must flush it before using the mm again */
+static void tlb_mm_invalidated(void* address) {
+	if (!pcid_enabled || address >= KERNEL_SPACE_START)
+		return;
+
+	struct cpu* cpu = current_cpu();
+	u64 gen = atomic_add_fetch(&cpu->mm_struct->tlb_gen, 1);
+
+	/* This CPU just flushed it */
+	struct tlb_asid* slot = &cpu->tlb_asids.slots[cpu->tlb_asids.current];
+	if (slot->tlb_gen < gen)
+		slot->tlb_gen = gen;
+}
+
+static void tlb_flush_queued(const struct tlb_range* ranges, unsigned int count, bool flush_all) {
+	if (flush_all) {
+		tlb_flush_all();
+		return;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+		tlb_flush_range((void*)ranges[i].start, ranges[i].end - ranges[i].start);
+}
+
+void tlb_flush_pending(void) {
+	irqflags_t irq = local_irq_save();
+	struct tlb_queue* queue = &current_cpu()->tlb_queue;
+
+	if (atomic_load(&queue->done) == atomic_load(&queue->queued)) {
+		local_irq_restore(irq);
+		return;
+	}
+
+	/* Copy the ranges out, so remote CPU's aren't spinning on the lock while we flush */
+	struct tlb_range ranges[TLB_QUEUE_RANGES];
+	spinlock_lock(&queue->lock);
+	u64 queued = atomic_load(&queue->queued);
+	unsigned int count = queue->count;
+	bool flush_all = queue->flush_all;
+	for (unsigned int i = 0; i < count; i++)
+		ranges[i] = queue->ranges[i];
+	queue->count = 0;
+	queue->flush_all = false;
+	spinlock_unlock(&queue->lock);
+
+	tlb_flush_queued(ranges, count, flush_all);
+	atomic_store(&queue->done, queued);
+
+	local_irq_restore(irq);
+}
+
+/* Queue a flush on another CPU, merges the range with an existing one if they touch */
+static void tlb_queue_range(struct tlb_queue* queue, uintptr_t start, uintptr_t end) {
+	spinlock_lock(&queue->lock);
+
+	if (queue->flush_all)
+		goto out;
+
+	for (unsigned int i = 0; i < queue->count; i++) {
+		struct tlb_range* range = &queue->ranges[i];
+		if (start <= range->end && end >= range->start) {
+			if (start < range->start)
+				range->start = start;
+			if (end > range->end)
+				range->end = end;
+			goto out;
+		}
+	}
+
+	if (queue->count == TLB_QUEUE_RANGES) {
+		queue->flush_all = true;
+		queue->count = 0;
+	} else {
+		queue->ranges[queue->count++] = (struct tlb_range){ .start = start, .end = end };
+	}
+out:
+	atomic_add_fetch(&queue->queued, 1);
+	spinlock_unlock(&queue->lock);
+}
+
+static inline bool tlb_queue_pending(struct tlb_queue* queue) {
+	return atomic_load(&queue->done) != atomic_load(&queue->queued);
+}
+
+static inline bool tlb_queue_lazy(struct tlb_queue* queue) {
+	return atomic_load_explicit(&queue->lazy, ATOMIC_SEQ_CST);
+}
+
+/* Kick every CPU that has pending flushes and isn't idle, must be called with IRQ's disabled */
+static void tlb_kick_others(const struct smp_cpus* cpus) {
+	struct cpu* this_cpu = current_cpu();
+
+	/* Pairs with the fence in tlb_lazy_exit(), a CPU either sees our ranges or we see it's awake */
+	atomic_thread_fence(ATOMIC_SEQ_CST);
+
+	u32 kick_count = 0;
+	for (u32 i = 0; i < cpus->count; i++) {
+		struct cpu* cpu = cpus->cpus[i];
+		if (cpu != this_cpu && tlb_queue_pending(&cpu->tlb_queue) && !tlb_queue_lazy(&cpu->tlb_queue))
+			kick_count++;
+	}
+	if (kick_count == 0)
+		return;
+
+	if (kick_count == cpus->count - 1) {
+		bug(apic_send_ipi(NULL, shootdown_isr, APIC_IPI_CPU_OTHERS, true) != 0);
+		return;
+	}
+
+	for (u32 i = 0; i < cpus->count; i++) {
+		struct cpu* cpu = cpus->cpus[i];
+		if (cpu != this_cpu && tlb_queue_pending(&cpu->tlb_queue) && !tlb_queue_lazy(&cpu->tlb_queue))
+			bug(apic_send_ipi(cpu, shootdown_isr, APIC_IPI_CPU_TARGET, true) != 0);
+	}
 }
 
-static void do_shootdown(const struct smp_cpus* cpus, void* address, size_t size) {
-	spinlock_lock(&shootdown_lock);
+/*
+ * Wait for every other CPU to drain its queue. While waiting, our own queue is drained,
+ * since another CPU may be waiting on us with interrupts disabled.
+ */
+static void tlb_wait_others(const struct smp_cpus* cpus) {
+	struct cpu* this_cpu = current_cpu();
+	for (u32 i = 0; i < cpus->count; i++) {
+		struct cpu* cpu = cpus->cpus[i];
+		if (cpu == this_cpu)
+			continue;
+
+		u64 target = atomic_load(&cpu->tlb_queue.queued);
+		while ((i64)(atomic_load(&cpu->tlb_queue.done) - target) < 0) {
+			if (tlb_queue_lazy(&cpu->tlb_queue))
+				break;
+			tlb_flush_pending();
+			cpu_relax();
+		}
+	}
+}
 
-	atomic_store(&shootdown_address, address);
-	atomic_store(&shootdown_size, size);
-	atomic_store(&shootdown_remaining, cpus->count - 1);
+static bool tlb_needs_shootdown(const struct smp_cpus* cpus, void* address) {
+	if (cpus->count == 1 || unlikely(init_status_get() < INIT_STATUS_SCHED))
+		return false;
+	if (address >= KERNEL_SPACE_START)
+		return true;
 
-	bug(apic_send_ipi(NULL, shootdown_isr, APIC_IPI_CPU_OTHERS, true) != 0);
+	struct thread* current = current_thread();
+	return atomic_load(&current->proc->thread_count) > 1;
+}
 
-	while (atomic_load(&shootdown_remaining))
-		cpu_relax();
+static void tlb_queue_others(const struct smp_cpus* cpus, void* address, size_t size) {
+	uintptr_t start = ROUND_DOWN((uintptr_t)address, PAGE_SIZE);
+	uintptr_t end = ROUND_UP((uintptr_t)address + size, PAGE_SIZE);
 
-	spinlock_unlock(&shootdown_lock);
+	struct cpu* this_cpu = current_cpu();
+	for (u32 i = 0; i < cpus->count; i++) {
+		struct cpu* cpu = cpus->cpus[i];
+		if (cpu != this_cpu)
+			tlb_queue_range(&cpu->tlb_queue, start, end);
+	}
 }
 
 void tlb_invalidate(void* address, size_t size) {
 	const struct smp_cpus* cpus = smp_cpus_get();
 	irqflags_t irq = local_irq_save();
 
-	if (likely(init_status_get() >= INIT_STATUS_SCHED)) {
-		struct thread* current = current_thread();
-		int thread_count = atomic_load(&current->proc->thread_count);
-		if (cpus->count > 1 && (address >= KERNEL_SPACE_START || thread_count > 1))
-			do_shootdown(cpus, address, size);
+	tlb_flush_range(address, size);
+	tlb_mm_invalidated(address);
+	if (tlb_needs_shootdown(cpus, address)) {
+		tlb_queue_others(cpus, address, size);
+		tlb_kick_others(cpus);
+		tlb_wait_others(cpus);
 	}
 
+	local_irq_restore(irq);
+}
+
+u64 tlb_invalidate_deferred(void* address, size_t size) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	irqflags_t irq = local_irq_save();
+
 	tlb_flush_range(address, size);
+	tlb_mm_invalidated(address);
+	if (tlb_needs_shootdown(cpus, address))
+		tlb_queue_others(cpus, address, size);
+
+	/* Any sync started after this point will cover the range that was just queued */
+	u64 tag = atomic_load(&sync_started);
+
 	local_irq_restore(irq);
+	return tag;
+}
+
+void tlb_sync(void) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	irqflags_t irq = local_irq_save();
+
+	u64 gen = atomic_add_fetch(&sync_started, 1);
+	if (cpus->count > 1 && likely(init_status_get() >= INIT_STATUS_SCHED)) {
+		tlb_kick_others(cpus);
+		tlb_wait_others(cpus);
+	}
+
+	/* Syncs can finish out of order, so only ever move forward */
+	u64 completed = atomic_load(&sync_completed);
+	while (completed < gen && !atomic_compare_exchange_weak(&sync_completed, &completed, gen))
+		;
+
+	local_irq_restore(irq);
+}
+
+bool tlb_sync_passed(u64 tag) {
+	return atomic_load(&sync_completed) > tag;
+}
+
+void tlb_lazy_enter(void) {
+	atomic_store_explicit(&current_cpu()->tlb_queue.lazy, true, ATOMIC_SEQ_CST);
+}
+
+void tlb_lazy_exit(void) {
+	struct tlb_queue* queue = &current_cpu()->tlb_queue;
+	if (!atomic_load_explicit(&queue->lazy, ATOMIC_RELAXED))
+		return;
+
+	atomic_store_explicit(&queue->lazy, false, ATOMIC_SEQ_CST);
+	atomic_thread_fence(ATOMIC_SEQ_CST);
+	tlb_flush_pending();
+}
+
+void tlb_switch_mm(struct mm* mm) {
+	physaddr_t pagetable = hhdm_physical(mm->pagetable);
+	if (!pcid_enabled) {
+		ctl3_write(pagetable);
+		return;
+	}
+
+	struct tlb_asids* asids = &current_cpu()->tlb_asids;
+	u64 gen = atomic_load(&mm->tlb_gen);
+
+	unsigned int slot;
+	for (slot = 0; slot < TLB_ASID_COUNT; slot++) {
+		if (asids->slots[slot].ctx_id == mm->ctx_id)
+			break;
+	}
+
+	bool flush;
+	if (slot == TLB_ASID_COUNT) {
+		slot = asids->next;
+		asids->next = (asids->next + 1) % TLB_ASID_COUNT;
+		asids->slots[slot].ctx_id = mm->ctx_id;
+		flush = true;
+	} else {
+		flush = asids->slots[slot].tlb_gen < gen;
+	}
+
+	asids->slots[slot].tlb_gen = gen;
+	asids->current = slot;
+
+	/* Without the no flush bit, the PCID gets flushed as CR3 is loaded */
+	physaddr_t cr3 = pagetable | (slot + 1);
+	if (!flush)
+		cr3 |= CTL3_NOFLUSH;
+	ctl3_write(cr3);
+}
+
+void tlb_mm_init(struct mm* mm) {
+	mm->ctx_id = atomic_fetch_add(&next_ctx_id, 1);
+	atomic_store(&mm->tlb_gen, 1);
+}
+
+void tlb_cpu_init(struct mm* mm) {
+	if (pagetable_global_pages()) {
+		global_pages = true;
+		ctl4_write(ctl4_read() | CTL4_PGE);
+	}
+
+	u32 max_leaf, ebx = 0, ecx, _unused;
+	cpuid(CPUID_LEAF_HIGHEST_FUNCTION, 0, &max_leaf, &_unused, &_unused, &_unused);
+	cpuid(CPUID_LEAF_FEATURE_BITS, 0, &_unused, &_unused, &ecx, &_unused);
+	if (max_leaf >= CPUID_LEAF_EXT_FEATURE_BITS)
+		cpuid(CPUID_LEAF_EXT_FEATURE_BITS, 0, &_unused, &ebx, &_unused, &_unused);
+
+	/* bit 17 is PCID, and bit 10 of leaf 7 is INVPCID */
+	if (ecx & (1 << 17)) {
+		pcid_enabled = true;
+		invpcid_supported = !!(ebx & (1 << 10));
+
+		/* The PCID has to be 0 when enabling it */
+		ctl3_write(hhdm_physical(mm->pagetable));
+		ctl4_write(ctl4_read() | CTL4_PCIDE);
+	}
+
+	struct tlb_asids* asids = &current_cpu()->tlb_asids;
+	for (unsigned int i = 0; i < TLB_ASID_COUNT; i++)
+		asids->slots[i] = (struct tlb_asid){ .ctx_id = 0, .tlb_gen = 0 };
+	asids->current = 0;
+	asids->next = 0;
+
+	tlb_switch_mm(mm);
+}
+
+static void shootdown_ipi(struct isr* isr, struct context* ctx) {
+	(void)isr;
+	(void)ctx;
+	tlb_flush_pending();
 }
 
 void vmm_tlb_init(void) {
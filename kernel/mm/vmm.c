@@ -7,15 +7,126 @@
 #include <lunar/core/panic.h>
 #include <lunar/core/trace.h>
 #include <lunar/core/printk.h>
+#include <lunar/core/cmdline.h>
+#include <lunar/init/status.h>
 #include <lunar/mm/hhdm.h>
 #include <lunar/mm/buddy.h>
 #include <lunar/mm/vmm.h>
 #include <lunar/mm/vma.h>
+#include <lunar/mm/shrinker.h>
+#include <lunar/mm/slab.h>
+#include <lunar/sched/kthread.h>
 #include <lunar/lib/string.h>
+#include <lunar/lib/convert.h>
 #include "internal.h"
 
 static struct mm kernel_mm_struct;
 
+/*
+ * The VMA list lock only covers reserving and releasing virtual space, and page table edits are covered by
+ * the page table lock. Zeroing and TLB shootdowns are done without either, which is fine since a range
+ * is only released after every CPU has flushed it.
+ */
+
+/* Ranges unmapped with VMM_LAZY, the virtual range and the physical pages stay reserved until a TLB sync */
+struct lazy_range {
+	void* start;
+	size_t size;
+	struct prevpage* prevpages;
+	u64 tlb_tag;
+	struct lazy_range* next;
+	bool arena; /* Arena ranges have no VMA, so the pages are stored here instead of prevpages */
+	unsigned long page_count;
+	physaddr_t pages[VMM_ARENA_MAX_PAGES];
+};
+
+static struct lazy_range* lazy_ranges = NULL;
+static unsigned long lazy_pages = 0;
+static SPINLOCK_DEFINE(lazy_lock);
+static struct slab_cache* lazy_range_cache = NULL; /* Atomic, so it never calls back into the VMM */
+
+/* How many pages can be held by lazy unmaps before everything gets flushed and released */
+#define LAZY_MAX_PAGES 1024
+
+/* Give back the virtual range and the pages once every CPU has flushed them */
+static void lazy_range_release(void* start, size_t size, struct prevpage* prevpages,
+		const physaddr_t* pages, unsigned long page_count, bool arena) {
+	if (arena) {
+		for (unsigned long i = 0; i < page_count; i++)
+			free_page(pages[i]);
+		vmm_arena_free(start, size);
+	} else {
+		prevpage_success(prevpages, PREVPAGE_FREE_PREVIOUS);
+		mutex_lock(&kernel_mm_struct.vma_list_lock);
+		bug(vma_unmap(&kernel_mm_struct, start, size) != 0);
+		mutex_unlock(&kernel_mm_struct.vma_list_lock);
+	}
+}
+
+/* Returns true once enough pages are held that everything should be released */
+static bool lazy_range_add(void* start, size_t size, struct prevpage* prevpages, 
+		const physaddr_t* pages, unsigned long page_count, u64 tlb_tag) {
+	struct lazy_range* range = lazy_range_cache ? slab_cache_alloc(lazy_range_cache) : NULL;
+	if (unlikely(!range)) {
+		/* Nowhere to keep it, so wait for the flush now instead of batching it */
+		tlb_sync();
+		bug(!tlb_sync_passed(tlb_tag));
+		lazy_range_release(start, size, prevpages, pages, page_count, !!pages);
+		return false;
+	}
+
+	range->start = start;
+	range->size = size;
+	range->prevpages = prevpages;
+	range->tlb_tag = tlb_tag;
+	range->arena = !!pages;
+	range->page_count = page_count;
+	for (unsigned long i = 0; i < page_count; i++)
+		range->pages[i] = pages[i];
+
+	irqflags_t irq;
+	spinlock_lock_irq_save(&lazy_lock, &irq);
+	range->next = lazy_ranges;
+	lazy_ranges = range;
+	lazy_pages += size >> PAGE_SHIFT;
+	bool full = lazy_pages >= LAZY_MAX_PAGES;
+	spinlock_unlock_irq_restore(&lazy_lock, &irq);
+
+	return full;
+}
+
+static bool lazy_ranges_pending(void) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&lazy_lock, &irq);
+	bool pending = !!lazy_ranges;
+	spinlock_unlock_irq_restore(&lazy_lock, &irq);
+	return pending;
+}
+
+/* Must be called without any mm locks held */
+static void lazy_ranges_purge(void) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&lazy_lock, &irq);
+	struct lazy_range* range = lazy_ranges;
+	lazy_ranges = NULL;
+	lazy_pages = 0;
+	spinlock_unlock_irq_restore(&lazy_lock, &irq);
+
+	if (!range)
+		return;
+
+	/* Every range that was detached was deferred before this sync started */
+	tlb_sync();
+
+	while (range) {
+		struct lazy_range* next = range->next;
+		bug(!tlb_sync_passed(range->tlb_tag));
+		lazy_range_release(range->start, range->size, range->prevpages, range->pages, range->page_count, range->arena);
+		slab_cache_free(lazy_range_cache, range);
+		range = next;
+	}
+}
+
 static bool handle_pagetable_error(int err, int vmm_flags, pte_t* pagetable, 
 		void* virtual, physaddr_t physical, unsigned long pt_flags) {
 	if (!(err == -EEXIST && vmm_flags & VMM_FIXED))
@@ -64,6 +175,7 @@ static int __vmap_physical(pte_t* pagetable,
 	return err;
 }
 
+/* Pages are allocated without the page table lock, so it's only held for the actual edit */
 static int __vmap_alloc(pte_t* pagetable, 
 		u8* virtual, unsigned long pt_flags,
 		size_t page_size, unsigned long count, 
@@ -77,15 +189,21 @@ static int __vmap_alloc(pte_t* pagetable,
 			err = -ENOMEM;
 			goto cleanup;
 		}
+		mutex_lock(&kernel_mm_struct.pagetable_lock);
 		err = pagetable_map(pagetable, virtual, page, pt_flags);
-		if (err && !handle_pagetable_error(err, vmm_flags, pagetable, virtual, page, pt_flags))
+		if (err && !handle_pagetable_error(err, vmm_flags, pagetable, virtual, page, pt_flags)) {
+			mutex_unlock(&kernel_mm_struct.pagetable_lock);
+			free_pages(page, order);
 			goto cleanup;
+		}
+		mutex_unlock(&kernel_mm_struct.pagetable_lock);
 		mapped++;
 		virtual += page_size;
 	}
 
 	return 0;
 cleanup:
+	mutex_lock(&kernel_mm_struct.pagetable_lock);
 	while (mapped--) {
 		virtual -= page_size;
 		physaddr_t page = pagetable_get_physical(pagetable, virtual);
@@ -93,6 +211,7 @@ cleanup:
 		bug(pagetable_unmap(pagetable, virtual) != 0);
 		free_pages(page, order);
 	}
+	mutex_unlock(&kernel_mm_struct.pagetable_lock);
 	return err;
 }
 
@@ -114,6 +233,14 @@ void* vmap(void* hint, size_t size, mmuflags_t mmu_flags, int flags, void* optio
 		return NULL;
 	size = ROUND_UP(size, page_size);
 	const unsigned long page_count = size >> page_shift;
+
+	/* Small allocations like stacks and slabs come from the CPU's arena, and skip the VMA list entirely */
+	void* virtual = NULL;
+	bool arena = false;
+	if (flags == VMM_ALLOC && page_count <= VMM_ARENA_MAX_PAGES) {
+		virtual = vmm_arena_alloc(size);
+		arena = !!virtual;
+	}
 	
 	if (flags & VMM_IOMEM)
 		flags |= VMM_PHYSICAL;
@@ -122,16 +249,35 @@ void* vmap(void* hint, size_t size, mmuflags_t mmu_flags, int flags, void* optio
 
 	pte_t* pagetable = kernel_mm_struct.pagetable;
 	struct prevpage* prev_pages = NULL;
+	bool vma_locked = false;
+	int err;
 
-	mutex_lock(&kernel_mm_struct.vma_list_lock);
+	if (!arena) {
+		mutex_lock(&kernel_mm_struct.vma_list_lock);
+		vma_locked = true;
 
-	if (flags & VMM_FIXED && !(flags & VMM_NOREPLACE))
-		prev_pages = prevpage_save(&kernel_mm_struct, hint, size);
+		if (flags & VMM_FIXED && !(flags & VMM_NOREPLACE)) {
+			mutex_lock(&kernel_mm_struct.pagetable_lock);
+			prev_pages = prevpage_save(&kernel_mm_struct, hint, size);
+			mutex_unlock(&kernel_mm_struct.pagetable_lock);
+		}
 
-	void* virtual = NULL;
-	int err = vma_map(&kernel_mm_struct, hint, size, mmu_flags, flags, &virtual);
-	if (err)
-		goto cleanup;
+		err = vma_map(&kernel_mm_struct, hint, size, mmu_flags, flags, &virtual);
+		if (err == -ENOMEM && !(flags & VMM_FIXED) && lazy_ranges_pending()) {
+			mutex_unlock(&kernel_mm_struct.vma_list_lock);
+			lazy_ranges_purge();
+			mutex_lock(&kernel_mm_struct.vma_list_lock);
+			err = vma_map(&kernel_mm_struct, hint, size, mmu_flags, flags, &virtual);
+		}
+		if (err)
+			goto cleanup;
+
+		/* The range is reserved now, replaced mappings keep the lock so they can be restored on failure */
+		if (!prev_pages) {
+			mutex_unlock(&kernel_mm_struct.vma_list_lock);
+			vma_locked = false;
+		}
+	}
 
 	if (flags & VMM_PHYSICAL) {
 		if (!optional)
@@ -139,7 +285,9 @@ void* vmap(void* hint, size_t size, mmuflags_t mmu_flags, int flags, void* optio
 		physaddr_t physical = *(physaddr_t*)optional;
 		if (physical & (page_size - 1))
 			goto cleanup;
+		mutex_lock(&kernel_mm_struct.pagetable_lock);
 		err = __vmap_physical(pagetable, virtual, physical, pt_flags, page_size, page_count, flags);
+		mutex_unlock(&kernel_mm_struct.pagetable_lock);
 		if (err)
 			goto cleanup;
 	} else if (flags & VMM_ALLOC) {
@@ -151,28 +299,71 @@ void* vmap(void* hint, size_t size, mmuflags_t mmu_flags, int flags, void* optio
 			goto cleanup;
 	}
 
-	tlb_invalidate(virtual, size);
+	if (vma_locked)
+		mutex_unlock(&kernel_mm_struct.vma_list_lock);
+
+	/*
+	 * A range that wasn't mapped before can't be cached by another CPU, since unmapped ranges are
+	 * only released after every CPU flushed them. Only replaced mappings need a shootdown.
+	 */
+	if (prev_pages) {
+		tlb_invalidate(virtual, size);
+		prevpage_success(prev_pages, PREVPAGE_FREE_PREVIOUS);
+	} else {
+		tlb_flush_range(virtual, size);
+	}
 	if (flags & VMM_ALLOC)
 		memset(virtual, 0, size);
-	if (prev_pages)
-		prevpage_success(prev_pages, PREVPAGE_FREE_PREVIOUS);
-	mutex_unlock(&kernel_mm_struct.vma_list_lock);
 
 	/* Make sure the memory is now mapped correctly */
 	if (flags & VMM_ALLOC && (!(mmu_flags & MMU_WRITE) || !(mmu_flags & MMU_READ)))
 		bug(vprotect(virtual, size, mmu_flags, 0) != 0);
 	return virtual;
 cleanup:
+	if (arena) {
+		vmm_arena_free(virtual, size);
+		return NULL;
+	}
+
+	if (!vma_locked)
+		mutex_lock(&kernel_mm_struct.vma_list_lock);
 	if (virtual)
 		bug(vma_unmap(&kernel_mm_struct, virtual, size) != 0);
 	if (prev_pages) {
+		mutex_lock(&kernel_mm_struct.pagetable_lock);
 		prevpage_fail(&kernel_mm_struct, prev_pages);
+		mutex_unlock(&kernel_mm_struct.pagetable_lock);
 		tlb_invalidate(virtual, size); /* Invalidate just in case */
 	}
 	mutex_unlock(&kernel_mm_struct.vma_list_lock);
 	return NULL;
 }
 
+/* Arena ranges are always 4K pages and have no VMA, so only the page table needs updating */
+static int vprotect_arena(pte_t* pagetable, void* virtual, size_t size, unsigned long pt_flags) {
+	size = ROUND_UP(size, PAGE_SIZE);
+	if (!vmm_arena_contains((u8*)virtual + size - 1))
+		return -EINVAL;
+
+	int err = 0;
+	mutex_lock(&kernel_mm_struct.pagetable_lock);
+	for (size_t off = 0; off < size; off += PAGE_SIZE) {
+		u8* page = (u8*)virtual + off;
+		physaddr_t physical = pagetable_get_physical(pagetable, page);
+		if (!physical) {
+			err = -ENOENT;
+			break;
+		}
+		err = pagetable_update(pagetable, page, physical, pt_flags);
+		if (err)
+			break;
+	}
+	mutex_unlock(&kernel_mm_struct.pagetable_lock);
+
+	tlb_invalidate(virtual, size);
+	return err;
+}
+
 int vprotect(void* virtual, size_t size, mmuflags_t mmu_flags, int flags) {
 	if ((uintptr_t)virtual & (PAGE_SIZE - 1) || size == 0 || flags != 0)
 		return -EINVAL;
@@ -181,10 +372,14 @@ int vprotect(void* virtual, size_t size, mmuflags_t mmu_flags, int flags) {
 		return -EINVAL;
 
 	pte_t* pagetable = current_cpu()->mm_struct->pagetable;
+	if (vmm_arena_contains(virtual))
+		return vprotect_arena(pagetable, virtual, size, pt_flags);
+
 	int err = 0;
 	size_t tlb_flush_round = PAGE_SIZE;
 
 	mutex_lock(&kernel_mm_struct.vma_list_lock);
+	mutex_lock(&kernel_mm_struct.pagetable_lock);
 
 	struct prevpage* prevpages = prevpage_save(&kernel_mm_struct, virtual, size);
 
@@ -226,20 +421,59 @@ out:
 		prevpage_fail(&kernel_mm_struct, prevpages);
 	else
 		prevpage_success(prevpages, 0);
-	tlb_invalidate(start, ROUND_UP(size, tlb_flush_round));
+	mutex_unlock(&kernel_mm_struct.pagetable_lock);
 	mutex_unlock(&kernel_mm_struct.vma_list_lock);
+
+	tlb_invalidate(start, ROUND_UP(size, tlb_flush_round));
 	return err;
 }
 
+static int vunmap_arena(pte_t* pagetable, void* virtual, size_t size, int flags) {
+	size = ROUND_UP(size, PAGE_SIZE);
+	unsigned long count = size >> PAGE_SHIFT;
+	if (count > VMM_ARENA_MAX_PAGES || !vmm_arena_contains((u8*)virtual + size - 1))
+		return -EINVAL;
+
+	physaddr_t pages[VMM_ARENA_MAX_PAGES];
+	mutex_lock(&kernel_mm_struct.pagetable_lock);
+	for (unsigned long i = 0; i < count; i++) {
+		pages[i] = pagetable_get_physical(pagetable, (u8*)virtual + (i << PAGE_SHIFT));
+		if (!pages[i]) {
+			mutex_unlock(&kernel_mm_struct.pagetable_lock);
+			return -ENOENT;
+		}
+	}
+	for (unsigned long i = 0; i < count; i++)
+		bug(pagetable_unmap(pagetable, (u8*)virtual + (i << PAGE_SHIFT)) != 0);
+	mutex_unlock(&kernel_mm_struct.pagetable_lock);
+
+	if (flags & VMM_LAZY) {
+		u64 tag = tlb_invalidate_deferred(virtual, size);
+		if (lazy_range_add(virtual, size, NULL, pages, count, tag))
+			lazy_ranges_purge();
+		return 0;
+	}
+
+	tlb_invalidate(virtual, size);
+	for (unsigned long i = 0; i < count; i++)
+		free_page(pages[i]);
+	vmm_arena_free(virtual, size);
+	return 0;
+}
+
 int vunmap(void* virtual, size_t size, int flags) {
-	if ((uintptr_t)virtual & (PAGE_SIZE - 1) || size == 0 || flags != 0)
+	if ((uintptr_t)virtual & (PAGE_SIZE - 1) || size == 0 || flags & ~VMM_LAZY)
 		return -EINVAL;
 
 	pte_t* pagetable = current_cpu()->mm_struct->pagetable;
+	if (vmm_arena_contains(virtual))
+		return vunmap_arena(pagetable, virtual, size, flags);
+
 	size_t tlb_invalidate_round = PAGE_SIZE;
-	int err;
+	int err = 0;
 
 	mutex_lock(&kernel_mm_struct.vma_list_lock);
+	mutex_lock(&kernel_mm_struct.pagetable_lock);
 
 	struct prevpage* prevpages = prevpage_save(&kernel_mm_struct, virtual, size);
 
@@ -262,7 +496,7 @@ int vunmap(void* virtual, size_t size, int flags) {
 			}
 		}
 
-		vma_unmap(&kernel_mm_struct, virtual, page_size);
+		/* The VMA is kept until the range is flushed everywhere, so nobody else can map it yet */
 		err = pagetable_unmap(pagetable, virtual);
 		if (err) {
 			printk(PRINTK_CRIT "mm: Failed to unmap kernel page, err: %i", err);
@@ -273,16 +507,40 @@ int vunmap(void* virtual, size_t size, int flags) {
 	}
 
 err:
-	tlb_invalidate(start, ROUND_UP(size, tlb_invalidate_round));
-	if (err && prevpages) {
-		prevpage_fail(&kernel_mm_struct, prevpages);
-		tlb_invalidate(start, ROUND_UP(size, tlb_invalidate_round));
-	} else {
-		prevpage_success(prevpages, PREVPAGE_FREE_PREVIOUS);
+	size = ROUND_UP(size, tlb_invalidate_round);
+	if (err) {
+		if (prevpages) {
+			tlb_invalidate(start, size);
+			vma_unmap(&kernel_mm_struct, start, size);
+			prevpage_fail(&kernel_mm_struct, prevpages);
+		}
+		mutex_unlock(&kernel_mm_struct.pagetable_lock);
+		mutex_unlock(&kernel_mm_struct.vma_list_lock);
+		if (prevpages)
+			tlb_invalidate(start, size);
+		return err;
 	}
 
+	mutex_unlock(&kernel_mm_struct.pagetable_lock);
 	mutex_unlock(&kernel_mm_struct.vma_list_lock);
-	return err;
+
+	if (flags & VMM_LAZY) {
+		u64 tag = tlb_invalidate_deferred(start, size);
+		if (lazy_range_add(start, size, prevpages, NULL, 0, tag))
+			lazy_ranges_purge();
+		return 0;
+	}
+
+	tlb_invalidate(start, size);
+	prevpage_success(prevpages, PREVPAGE_FREE_PREVIOUS);
+	mutex_lock(&kernel_mm_struct.vma_list_lock);
+	bug(vma_unmap(&kernel_mm_struct, start, size) != 0);
+	mutex_unlock(&kernel_mm_struct.vma_list_lock);
+	return 0;
+}
+
+void vunmap_flush_lazy(void) {
+	lazy_ranges_purge();
 }
 
 void __iomem* iomap(physaddr_t physical, size_t size, mmuflags_t mmu_flags) {
@@ -326,10 +584,56 @@ int iounmap(void __iomem* virtual, size_t size) {
 	return vunmap((void __force*)base, total_size, 0);
 }
 
+/* How many stacks each CPU keeps around by default, can be changed with mm.kstack_cache */
+#define KSTACK_CACHE_DEFAULT 8
+
+static unsigned long kstack_cache_max = KSTACK_CACHE_DEFAULT;
+
+static inline void** kstack_link(u8* base) {
+	return (void**)(base + PAGE_SIZE);
+}
+
+static u8* kstack_cache_get(void) {
+	irqflags_t irq = local_irq_save();
+	struct kstack_cache* cache = &current_cpu()->kstack_cache;
+
+	spinlock_lock(&cache->lock);
+	u8* base = cache->head;
+	if (base) {
+		cache->head = *kstack_link(base);
+		cache->count--;
+	}
+	spinlock_unlock(&cache->lock);
+
+	local_irq_restore(irq);
+	return base;
+}
+
+static bool kstack_cache_put(u8* base) {
+	irqflags_t irq = local_irq_save();
+	struct kstack_cache* cache = &current_cpu()->kstack_cache;
+
+	spinlock_lock(&cache->lock);
+	bool cached = cache->count < kstack_cache_max;
+	if (cached) {
+		*kstack_link(base) = cache->head;
+		cache->head = base;
+		cache->count++;
+	}
+	spinlock_unlock(&cache->lock);
+
+	local_irq_restore(irq);
+	return cached;
+}
+
 void* vmap_kstack(void) {
 	const size_t total_size = KSTACK_SIZE + PAGE_SIZE;
 
-	u8* ptr = vmap(NULL, total_size, MMU_READ | MMU_WRITE, VMM_ALLOC, NULL);
+	u8* ptr = kstack_cache_get();
+	if (ptr)
+		return ptr + total_size;
+
+	ptr = vmap(NULL, total_size, MMU_READ | MMU_WRITE, VMM_ALLOC, NULL);
 	if (!ptr)
 		return NULL;
 
@@ -345,13 +649,66 @@ void* vmap_kstack(void) {
 int vunmap_kstack(void* stack) {
 	const size_t total_size = KSTACK_SIZE + PAGE_SIZE;
 	stack = (u8*)stack - total_size;
-	return vunmap(stack, total_size, 0);
+	if (kstack_cache_put(stack))
+		return 0;
+	return vunmap(stack, total_size, VMM_LAZY);
+}
+
+static unsigned long kstack_cache_shrink(struct shrinker* shrinker) {
+	(void)shrinker;
+
+	/* Unmapping takes the mm locks, which the allocating thread might be holding */
+	if (init_status_get() < INIT_STATUS_SCHED ||
+			atomic_load(&kernel_mm_struct.vma_list_lock.owner) == current_thread() ||
+			atomic_load(&kernel_mm_struct.pagetable_lock.owner) == current_thread())
+		return 0;
+
+	const size_t total_size = KSTACK_SIZE + PAGE_SIZE;
+	const struct smp_cpus* cpus = smp_cpus_get();
+	unsigned long freed = 0;
+	for (u32 i = 0; i < cpus->count; i++) {
+		struct kstack_cache* cache = &cpus->cpus[i]->kstack_cache;
+
+		irqflags_t irq;
+		spinlock_lock_irq_save(&cache->lock, &irq);
+		u8* base = cache->head;
+		cache->head = NULL;
+		cache->count = 0;
+		spinlock_unlock_irq_restore(&cache->lock, &irq);
+
+		while (base) {
+			u8* next = *kstack_link(base);
+			bug(vunmap(base, total_size, 0) != 0);
+			freed += total_size >> PAGE_SHIFT;
+			base = next;
+		}
+	}
+
+	return freed;
+}
+
+static struct shrinker kstack_shrinker = {
+	.shrink = kstack_cache_shrink
+};
+
+void kstack_cache_init(void) {
+	const char* cmdline_max = cmdline_get("mm.kstack_cache");
+	if (cmdline_max) {
+		unsigned long long max;
+		int err = kstrtoull(cmdline_max, 0, &max);
+		if (err)
+			printk(PRINTK_ERR "mm: Failed to parse mm.kstack_cache: %i\n", err);
+		else
+			kstack_cache_max = max;
+	}
+
+	shrinker_register(&kstack_shrinker);
 }
 
 void vmm_cpu_init(void) {
 	struct cpu* cpu = current_cpu();
 	cpu->mm_struct = &kernel_mm_struct;
-	ctl3_write(hhdm_physical(kernel_mm_struct.pagetable));
+	tlb_cpu_init(&kernel_mm_struct);
 }
 
 void vmm_init(void) {
@@ -363,7 +720,10 @@ void vmm_init(void) {
 	pte_t* cr3 = hhdm_virtual(ctl3_read());
 	cpu->mm_struct->pagetable = cr3;
 	mutex_init(&cpu->mm_struct->vma_list_lock);
+	mutex_init(&cpu->mm_struct->pagetable_lock);
 	list_head_init(&cpu->mm_struct->vma_list);
+	tlb_mm_init(cpu->mm_struct);
+	tlb_cpu_init(cpu->mm_struct);
 
 	int best = 0;
 	int best_len = 0;
@@ -392,13 +752,21 @@ void vmm_init(void) {
 
 	kernel_mm_struct.mmap_start = pagetable_get_base_address_from_top_index(best);
 	kernel_mm_struct.mmap_end = pagetable_get_base_address_from_top_index(best + best_len);
+
+	vmm_arena_init(&kernel_mm_struct);
+
+	/* Until this exists, lazy unmaps are flushed right away */
+	lazy_range_cache = slab_cache_create(sizeof(struct lazy_range), _Alignof(struct lazy_range),
+			MM_ZONE_NORMAL | MM_ATOMIC, NULL, NULL);
+	if (!lazy_range_cache)
+		printk(PRINTK_WARN "mm: Failed to create the lazy unmap cache, unmaps won't be batched\n");
 }
 
 void vmm_switch_mm_struct(struct mm* mm) {
 	irqflags_t irq = local_irq_save();
 
 	atomic_thread_fence(ATOMIC_SEQ_CST);
-	ctl3_write(hhdm_physical(mm->pagetable));
+	tlb_switch_mm(mm);
 	current_cpu()->mm_struct = mm;
 
 	local_irq_restore(irq);
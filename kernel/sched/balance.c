@@ -0,0 +1,293 @@
+#include <lunar/compiler.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/printk.h>
+#include <lunar/core/spinlock.h>
+#include <lunar/core/timekeeper.h>
+#include <lunar/core/time.h>
+#include <lunar/init/status.h>
+#include <lunar/sched/scheduler.h>
+#include "internal.h"
+
+#define BALANCE_INTERVAL_TICKS 64 /* How often a busy CPU checks for an imbalance in its smallest domain */
+#define CACHE_HOT_NS (SCHED_TICK_NS * 4) /* Threads that ran this recently are left alone unless a CPU would go idle */
+#define IDLE_KICK_TICKS 4 /* How often a CPU with waiting threads wakes up an idle one to steal them */
+#define WAKE_IDLE_SCAN 8 /* How many CPU's a wakeup looks at for an idle one */
+
+bool sched_can_migrate(struct runqueue* rq, struct thread* thread, struct cpu* target, bool allow_hot) {
+	/* The last thread may have been queued while still switching away, so it's still using its stack */
+	if (thread == rq->current || thread == rq->last || thread == rq->idle)
+		return false;
+	if (atomic_load(&thread->state) != THREAD_READY)
+		return false;
+	if (!thread_cpu_allowed(thread, target))
+		return false;
+	if (!allow_hot && sched_now() - thread->last_ran < CACHE_HOT_NS)
+		return false;
+	return true;
+}
+
+static inline struct cpu* cpu_by_id(const struct smp_cpus* cpus, u32 id) {
+	return id < cpus->count ? cpus->cpus[id] : NULL;
+}
+
+/* The busiest CPU of a domain, without the ones a smaller domain already looked at */
+static struct cpu* find_busiest(struct cpu* this_cpu, const struct sched_domain* sd,
+		const struct sched_domain* child, unsigned long min_queued) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	struct cpu* busiest = NULL;
+	unsigned long busiest_queued = 0;
+
+	u32 id;
+	cpumask_for_each(id, &sd->span) {
+		struct cpu* cpu = cpu_by_id(cpus, id);
+		if (!cpu || cpu == this_cpu || (child && cpumask_test(&child->span, id)))
+			continue;
+		unsigned long queued = atomic_load(&cpu->runqueue.nr_queued);
+		if (queued >= min_queued && (!busiest || queued > busiest_queued)) {
+			busiest = cpu;
+			busiest_queued = queued;
+		}
+	}
+
+	return busiest;
+}
+
+static bool pull_thread(struct cpu* this_cpu, struct cpu* src_cpu, bool allow_hot) {
+	struct runqueue* dst = &this_cpu->runqueue;
+	struct runqueue* src = &src_cpu->runqueue;
+	if (!src->policy->ops->steal || src->policy != dst->policy)
+		return false;
+
+	sched_double_lock(this_cpu, src_cpu);
+
+	/* Real-time threads are only pulled to run right away, when this CPU would otherwise idle */
+	struct thread* thread = NULL;
+	if (allow_hot)
+		thread = sched_rt_ops.steal(src, this_cpu, true);
+	if (!thread)
+		thread = src->policy->ops->steal(src, this_cpu, false);
+	if (!thread && allow_hot)
+		thread = src->policy->ops->steal(src, this_cpu, true);
+
+	if (thread) {
+		sched_move_thread(thread, this_cpu);
+		assert(thread_class_ops(dst, thread)->enqueue(dst, thread) == 0);
+
+		if (dst->current == dst->idle || sched_check_preempt(dst, thread)) {
+			this_cpu->need_resched = true;
+		} else if (atomic_load(&dst->tick_mode) != SCHED_TICK_PERIODIC) {
+			struct timespec ts = timekeeper_time();
+			sched_timer_update(this_cpu, timespec_to_ns(&ts));
+		}
+	}
+
+	sched_double_unlock(this_cpu, src_cpu);
+	return thread != NULL;
+}
+
+static inline bool cpu_idle(struct cpu* cpu) {
+	struct runqueue* rq = &cpu->runqueue;
+	return rq->current == rq->idle && !atomic_load(&rq->nr_queued);
+}
+
+/*
+ * The waker likely touched what the wakee is about to read, so pull the wakee over if the
+ * waker's CPU is less loaded. A thread that's still cache hot where it was only moves if
+ * nothing at all is waiting on the waker's CPU.
+ */
+static bool wake_affine(struct thread* thread, struct cpu* this_cpu, struct cpu* prev_cpu) {
+	unsigned long this_load = atomic_load(&this_cpu->runqueue.nr_queued);
+	unsigned long prev_load = atomic_load(&prev_cpu->runqueue.nr_queued) + 1; /* It isn't idle, so something's running */
+	if (this_load >= prev_load)
+		return false;
+
+	bool hot = sched_now() - thread->last_ran < CACHE_HOT_NS;
+	return !hot || this_load == 0;
+}
+
+/* A core is only idle if all of its hardware threads are, otherwise they compete for the same execution units */
+static bool core_idle(struct cpu* cpu) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	u32 id;
+	cpumask_for_each(id, &cpu->topology.smt_mask) {
+		struct cpu* sibling = cpu_by_id(cpus, id);
+		if (sibling && !cpu_idle(sibling))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Look for an idle CPU that shares a cache with prev_cpu first, preferring one on an idle core. Past
+ * the cache, only a few CPU's are looked at, starting after prev_cpu so wakeups don't all pile onto
+ * the same one.
+ */
+static struct cpu* find_idle_cpu(struct thread* thread, struct cpu* prev_cpu) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	const struct sched_domain* llc = prev_cpu->runqueue.llc_domain;
+	if (llc) {
+		struct cpu* idle_sibling = NULL;
+		u32 id;
+		cpumask_for_each(id, &llc->span) {
+			struct cpu* cpu = cpu_by_id(cpus, id);
+			if (!cpu || cpu == prev_cpu || !cpu_idle(cpu) || !thread_cpu_allowed(thread, cpu))
+				continue;
+			if (core_idle(cpu))
+				return cpu;
+			if (!idle_sibling)
+				idle_sibling = cpu;
+		}
+		if (idle_sibling)
+			return idle_sibling;
+	}
+
+	u32 scan = cpus->count < WAKE_IDLE_SCAN ? cpus->count : WAKE_IDLE_SCAN;
+	for (u32 i = 1; i < scan; i++) {
+		u32 id = (prev_cpu->sched_processor_id + i) % cpus->count;
+		struct cpu* cpu = cpus->cpus[id];
+		if (llc && cpumask_test(&llc->span, id))
+			continue;
+		if (cpu && cpu_idle(cpu) && thread_cpu_allowed(thread, cpu))
+			return cpu;
+	}
+
+	return NULL;
+}
+
+struct cpu* sched_select_wake_cpu(struct thread* thread) {
+	struct cpu* prev_cpu = thread->target_cpu;
+	if (unlikely(init_status_get() < INIT_STATUS_SCHED))
+		return prev_cpu;
+
+	/* Nothing to compete with, and the cache may still be warm */
+	if (cpu_idle(prev_cpu))
+		return prev_cpu;
+
+	struct cpu* this_cpu = current_cpu();
+	if (this_cpu != prev_cpu && thread_cpu_allowed(thread, this_cpu) && wake_affine(thread, this_cpu, prev_cpu))
+		return this_cpu;
+
+	struct cpu* idle = find_idle_cpu(thread, prev_cpu);
+	return idle ? idle : prev_cpu;
+}
+
+bool sched_balance_idle(struct cpu* cpu) {
+	if (unlikely(init_status_get() < INIT_STATUS_SCHED))
+		return false;
+
+	/* Anything waiting to run somewhere else is better than idling, but nearby CPU's share more cache */
+	struct runqueue* rq = &cpu->runqueue;
+	for (unsigned int i = 0; i < rq->nr_domains; i++) {
+		struct sched_domain* child = i ? &rq->domains[i - 1] : NULL;
+		struct cpu* busiest = find_busiest(cpu, &rq->domains[i], child, 1);
+		if (busiest && pull_thread(cpu, busiest, true))
+			return true;
+	}
+
+	return false;
+}
+
+/* Idle CPU's don't tick, so they won't notice work piling up here on their own. Wake up the nearest one. */
+static void kick_idle_cpu(struct cpu* this_cpu) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	struct runqueue* rq = &this_cpu->runqueue;
+	for (unsigned int i = 0; i < rq->nr_domains; i++) {
+		struct sched_domain* child = i ? &rq->domains[i - 1] : NULL;
+		struct cpu* target = NULL;
+		u32 id;
+		cpumask_for_each(id, &rq->domains[i].span) {
+			struct cpu* cpu = cpu_by_id(cpus, id);
+			if (!cpu || cpu == this_cpu || (child && cpumask_test(&child->span, id)))
+				continue;
+			if (atomic_load(&cpu->runqueue.tick_mode) != SCHED_TICK_STOPPED)
+				continue;
+
+			/* Rather a CPU on an idle core, a busy sibling would slow both down */
+			target = cpu;
+			if (core_idle(cpu))
+				break;
+		}
+
+		if (target) {
+			sched_send_resched(target);
+			return;
+		}
+	}
+}
+
+void sched_balance_tick(struct cpu* cpu) {
+	struct runqueue* rq = &cpu->runqueue;
+	if (unlikely(init_status_get() < INIT_STATUS_SCHED))
+		return;
+
+	unsigned long queued = atomic_load(&rq->nr_queued);
+	if (queued && rq->ticks >= rq->next_idle_kick) {
+		rq->next_idle_kick = rq->ticks + IDLE_KICK_TICKS;
+		kick_idle_cpu(cpu);
+	}
+
+	/* Larger domains are balanced less often, and only one thread is pulled per tick */
+	for (unsigned int i = 0; i < rq->nr_domains; i++) {
+		struct sched_domain* sd = &rq->domains[i];
+		if (rq->ticks < sd->next_balance)
+			continue;
+		sd->next_balance = rq->ticks + sd->balance_interval;
+
+		/* Moving one thread only helps if the difference is at least two */
+		struct sched_domain* child = i ? &rq->domains[i - 1] : NULL;
+		struct cpu* busiest = find_busiest(cpu, sd, child, queued + 2);
+		if (busiest && pull_thread(cpu, busiest, false))
+			return;
+	}
+}
+
+static void build_domains(struct cpu* cpu, const struct cpumask* all) {
+	struct runqueue* rq = &cpu->runqueue;
+	const struct cpumask* spans[SCHED_DOMAIN_LEVELS] = {
+		[SCHED_DOMAIN_SMT] = &cpu->topology.smt_mask,
+		[SCHED_DOMAIN_LLC] = &cpu->topology.llc_mask,
+		[SCHED_DOMAIN_PACKAGE] = &cpu->topology.package_mask,
+		[SCHED_DOMAIN_SYSTEM] = all
+	};
+
+	rq->nr_domains = 0;
+	rq->llc_domain = NULL;
+	for (int level = 0; level < SCHED_DOMAIN_LEVELS; level++) {
+		/* A domain with only this CPU, or the same CPU's as the last one, has nothing to balance */
+		if (cpumask_weight(spans[level]) < 2)
+			continue;
+		if (rq->nr_domains && cpumask_equal(spans[level], &rq->domains[rq->nr_domains - 1].span))
+			continue;
+
+		struct sched_domain* sd = &rq->domains[rq->nr_domains];
+		sd->level = level;
+		sd->span = *spans[level];
+		sd->balance_interval = BALANCE_INTERVAL_TICKS << rq->nr_domains;
+		sd->next_balance = rq->ticks + sd->balance_interval;
+		rq->nr_domains++;
+	}
+
+	for (unsigned int i = 0; i < rq->nr_domains; i++) {
+		if (rq->domains[i].level <= SCHED_DOMAIN_LLC)
+			rq->llc_domain = &rq->domains[i];
+	}
+}
+
+void sched_domains_init(void) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	struct cpumask all;
+	cpumask_zero(&all);
+	for (u32 i = 0; i < cpus->count; i++)
+		cpumask_set(&all, i);
+
+	for (u32 i = 0; i < cpus->count; i++)
+		build_domains(cpus->cpus[i], &all);
+
+	struct runqueue* rq = &current_cpu()->runqueue;
+	static const char* const level_names[SCHED_DOMAIN_LEVELS] = { "SMT", "LLC", "package", "system" };
+	for (unsigned int i = 0; i < rq->nr_domains; i++) {
+		printk(PRINTK_INFO "sched: Domain %u of CPU %u: %s, %u CPU's\n", i, current_cpu()->sched_processor_id,
+				level_names[rq->domains[i].level], cpumask_weight(&rq->domains[i].span));
+	}
+}
@@ -1,27 +1,125 @@
 #include <lunar/core/panic.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/printk.h>
 #include <lunar/asm/ctl.h>
 #include <lunar/asm/cpuid.h>
+#include <lunar/asm/msr.h>
 #include <lunar/mm/slab.h>
 #include <lunar/lib/string.h>
+#include <lunar/sched/kthread.h>
 #include "internal.h"
 
-static bool fxsave = false;
+/*
+ * The kernel is built without SSE, so only threads that use the FPU themselves have any state to keep.
+ * Threads start without it, and CR0.TS is set while they run. Their first FPU/SSE instruction
+ * traps, and from then on their state is saved and restored on every switch.
+ */
+
+enum ext_save_modes {
+	EXT_SAVE_NONE,
+	EXT_SAVE_FXSAVE,
+	EXT_SAVE_XSAVE,
+	EXT_SAVE_XSAVEOPT, /* Skips components that weren't modified since the last restore */
+	EXT_SAVE_XSAVES /* Like XSAVEOPT, but also leaves out unused components (compacted format) */
+};
+
+#define XFEATURE_X87 (1ull << 0)
+#define XFEATURE_SSE (1ull << 1)
+#define XFEATURE_AVX (1ull << 2)
+#define XFEATURE_OPMASK (1ull << 5)
+#define XFEATURE_ZMM_HI256 (1ull << 6)
+#define XFEATURE_HI16_ZMM (1ull << 7)
+#define XFEATURES_AVX512 (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+
+#define CPUID_XSAVE (1 << 26) /* Leaf 1, ECX */
+#define CPUID_XSAVEOPT (1 << 0) /* Leaf 0xD subleaf 1, EAX */
+#define CPUID_XSAVES (1 << 3) /* Leaf 0xD subleaf 1, EAX */
+
+#define FXSAVE_SIZE 512
+#define FXSAVE_FCW 0
+#define FXSAVE_MXCSR 24
+#define XSAVE_XCOMP_BV 520
+#define XCOMP_BV_COMPACTED (1ull << 63)
+
+#define FCW_DEFAULT 0x37F
+#define MXCSR_DEFAULT 0x1F80
+
+static int save_mode = EXT_SAVE_NONE;
+static u64 xfeatures = 0; /* Components enabled in XCR0 */
+
+static inline void ext_save(void* area) {
+	u32 lo = (u32)xfeatures, hi = (u32)(xfeatures >> 32);
+	switch (save_mode) {
+	case EXT_SAVE_FXSAVE:
+		__asm__ volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+		break;
+	case EXT_SAVE_XSAVE:
+		__asm__ volatile("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+		break;
+	case EXT_SAVE_XSAVEOPT:
+		__asm__ volatile("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+		break;
+	case EXT_SAVE_XSAVES:
+		__asm__ volatile("xsaves64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+		break;
+	}
+}
+
+static inline void ext_restore(void* area) {
+	u32 lo = (u32)xfeatures, hi = (u32)(xfeatures >> 32);
+	switch (save_mode) {
+	case EXT_SAVE_FXSAVE:
+		__asm__ volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+		break;
+	case EXT_SAVE_XSAVE:
+	case EXT_SAVE_XSAVEOPT:
+		__asm__ volatile("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+		break;
+	case EXT_SAVE_XSAVES:
+		__asm__ volatile("xrstors64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+		break;
+	}
+}
+
+/* CR0.TS is only set while a thread that hasn't used the FPU runs */
+static inline void switch_ext(struct thread* prev, struct thread* next) {
+	if (save_mode == EXT_SAVE_NONE)
+		return;
+
+	if (prev->fpu_used)
+		ext_save(prev->ctx.extended);
+	if (next->fpu_used) {
+		ctl0_clear_ts();
+		ext_restore(next->ctx.extended);
+	} else if (prev->fpu_used) {
+		ctl0_write(ctl0_read() | CTL0_TS);
+	}
+}
 
 void atomic_context_switch(struct thread* prev, struct thread* next, struct context* ctx) {
 	prev->ctx.general = *ctx;
-	if (fxsave)
-		__asm__ volatile("fxsave (%0)" : : "r"(prev->ctx.extended) : "memory");
+	switch_ext(prev, next);
 	*ctx = next->ctx.general;
-	if (fxsave)
-		__asm__ volatile("fxrstor (%0)" : : "r"(next->ctx.extended) : "memory");
 }
 
 void context_switch(struct thread* prev, struct thread* next) {
-	if (fxsave)
-		__asm__ volatile("fxsave (%0)" : : "r"(prev->ctx.extended) : "memory");
+	/* The kernel never touches the extended registers, so they can be switched before the general ones */
+	switch_ext(prev, next);
 	asm_context_switch(&prev->ctx.general, &next->ctx.general);
-	if (fxsave) /* Resuming on the previous thread */
-		__asm__ volatile("fxrstor (%0)" : : "r"(prev->ctx.extended) : "memory");
+}
+
+bool ext_context_fault(void) {
+	struct thread* current = current_thread();
+	if (save_mode == EXT_SAVE_NONE || current->fpu_used)
+		return false;
+
+	/* Load the initial state, it's kept up to date from now on */
+	irqflags_t irq = local_irq_save();
+	current->fpu_used = true;
+	ctl0_clear_ts();
+	ext_restore(current->ctx.extended);
+	local_irq_restore(irq);
+	return true;
 }
 
 static struct slab_cache* ext_ctx_cache = NULL;
@@ -39,28 +137,85 @@ void ext_ctx_free(void* ptr) {
 }
 
 static void ext_ctx_ctor(void* obj) {
-	memset(obj, 0, ext_ctx_cache->obj_size);
+	u8* area = obj;
+	memset(area, 0, ext_ctx_cache->obj_size);
+
+	/* Exceptions masked like after a reset, a zeroed area would unmask all of them */
+	*(u16*)(area + FXSAVE_FCW) = FCW_DEFAULT;
+	*(u32*)(area + FXSAVE_MXCSR) = MXCSR_DEFAULT;
+	if (save_mode == EXT_SAVE_XSAVES)
+		*(u64*)(area + XSAVE_XCOMP_BV) = XCOMP_BV_COMPACTED | xfeatures;
+}
+
+void ext_ctx_reset(void* ptr) {
+	if (likely(ptr != (void*)-1))
+		ext_ctx_ctor(ptr);
 }
 
 static void enable_sse(void) {
 	unsigned long ctl = ctl0_read();
-	ctl &= ~CTL0_EM;
+	ctl &= ~(CTL0_EM | CTL0_TS);
 	ctl |= CTL0_MP;
 	ctl0_write(ctl);
 	ctl = ctl4_read();
 	ctl |= CTL4_OSFXSR | CTL4_OSXMMEXCEPT;
+	if (xfeatures)
+		ctl |= CTL4_OSXSAVE;
 	ctl4_write(ctl);
 
-	u32 mxcsr = 0x1F80;
+	if (xfeatures) {
+		xctl_write(0, xfeatures);
+		if (save_mode == EXT_SAVE_XSAVES)
+			wrmsr(MSR_XSS, 0); /* Only user components are switched */
+	}
+
+	u32 mxcsr = MXCSR_DEFAULT;
 	__asm__ volatile("ldmxcsr %0" : : "m"(mxcsr) : "memory");
+
+	/* Nothing running yet has used the FPU */
+	ctl0_write(ctl0_read() | CTL0_TS);
 }
 
 static inline bool sse_supported(void) {
 	u32 edx, _unused;
-	cpuid(1, 0, &_unused, &_unused, &_unused, &edx);
+	cpuid(CPUID_LEAF_FEATURE_BITS, 0, &_unused, &_unused, &_unused, &edx);
 	return likely(!!(edx & (1 << 25)));
 }
 
+/* Pick the XSAVE components and instructions, the area's size is returned */
+static size_t xsave_probe(void) {
+	u32 eax, ebx, ecx, edx;
+	cpuid(CPUID_LEAF_HIGHEST_FUNCTION, 0, &eax, &ebx, &ecx, &edx);
+	if (eax < CPUID_LEAF_XSTATE)
+		return 0;
+	cpuid(CPUID_LEAF_FEATURE_BITS, 0, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & CPUID_XSAVE))
+		return 0;
+
+	cpuid(CPUID_LEAF_XSTATE, 0, &eax, &ebx, &ecx, &edx);
+	u64 supported = ((u64)edx << 32) | eax;
+	xfeatures = supported & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | XFEATURES_AVX512);
+	if ((xfeatures & XFEATURES_AVX512) != XFEATURES_AVX512 || !(xfeatures & XFEATURE_AVX))
+		xfeatures &= ~XFEATURES_AVX512; /* Can only be enabled together, and on top of AVX */
+	if ((xfeatures & (XFEATURE_X87 | XFEATURE_SSE)) != (XFEATURE_X87 | XFEATURE_SSE)) {
+		xfeatures = 0;
+		return 0;
+	}
+
+	cpuid(CPUID_LEAF_XSTATE, 1, &eax, &ebx, &ecx, &edx);
+	if (eax & CPUID_XSAVES)
+		save_mode = EXT_SAVE_XSAVES;
+	else if (eax & CPUID_XSAVEOPT)
+		save_mode = EXT_SAVE_XSAVEOPT;
+	else
+		save_mode = EXT_SAVE_XSAVE;
+
+	/* The size depends on what's enabled, so ask again once it's on */
+	enable_sse();
+	cpuid(CPUID_LEAF_XSTATE, save_mode == EXT_SAVE_XSAVES ? 1 : 0, &eax, &ebx, &ecx, &edx);
+	return ebx;
+}
+
 void ext_context_cpu_init(void) {
 	if (ext_ctx_cache)
 		enable_sse();
@@ -69,9 +224,21 @@ void ext_context_cpu_init(void) {
 void ext_context_init(void) {
 	if (!sse_supported())
 		return;
-	ext_ctx_cache = slab_cache_create(512, 16, MM_ZONE_NORMAL, ext_ctx_ctor, NULL);
+
+	size_t size = xsave_probe();
+	if (!size) {
+		save_mode = EXT_SAVE_FXSAVE;
+		size = FXSAVE_SIZE;
+	}
+
+	ext_ctx_cache = slab_cache_create(size, 64, MM_ZONE_NORMAL, ext_ctx_ctor, NULL);
 	if (ext_ctx_cache) {
 		enable_sse();
-		fxsave = true;
+		printk(PRINTK_INFO "sched: Extended context is %zu bytes, saved with %s\n", size,
+				save_mode == EXT_SAVE_XSAVES ? "XSAVES" :
+				save_mode == EXT_SAVE_XSAVEOPT ? "XSAVEOPT" :
+				save_mode == EXT_SAVE_XSAVE ? "XSAVE" : "FXSAVE");
+	} else {
+		save_mode = EXT_SAVE_NONE;
 	}
 }
@@ -2,13 +2,16 @@
 #include <lunar/asm/wrap.h>
 #include <lunar/asm/errno.h>
 #include <lunar/mm/heap.h>
+#include <lunar/mm/tlb.h>
 #include <lunar/core/spinlock.h>
 #include <lunar/core/cpu.h>
 #include <lunar/core/printk.h>
 #include <lunar/core/apic.h>
 #include <lunar/core/time.h>
+#include <lunar/core/cmdline.h>
 #include <lunar/sched/scheduler.h>
 #include <lunar/sched/preempt.h>
+#include <lunar/sched/idle.h>
 #include "internal.h"
 
 int sched_thread_attach(struct runqueue* rq, struct thread* thread, int prio) {
@@ -62,20 +65,73 @@ void sched_thread_detach(struct runqueue* rq, struct thread* thread) {
 	}
 }
 
+static struct cpumask online_mask, default_mask;
+
+const struct cpumask* sched_default_affinity(void) {
+	return &default_mask;
+}
+
+void sched_double_lock(struct cpu* a, struct cpu* b) {
+	/* Always lock in the same order, so two CPU's locking each other can't deadlock */
+	if (a == b) {
+		spinlock_lock(&a->runqueue.lock);
+		return;
+	}
+	struct cpu* first = a->sched_processor_id < b->sched_processor_id ? a : b;
+	struct cpu* second = first == a ? b : a;
+	spinlock_lock(&first->runqueue.lock);
+	spinlock_lock(&second->runqueue.lock);
+}
+
+void sched_double_unlock(struct cpu* a, struct cpu* b) {
+	spinlock_unlock(&a->runqueue.lock);
+	if (a != b)
+		spinlock_unlock(&b->runqueue.lock);
+}
+
+static struct isr* resched_isr;
+
+static void resched_cpu(struct cpu* cpu) {
+	struct cpu* this_cpu = current_cpu();
+	if (cpu == this_cpu)
+		this_cpu->need_resched = true;
+	else
+		sched_send_resched(cpu);
+}
+
+bool sched_check_preempt(struct runqueue* rq, struct thread* thread) {
+	if (thread_is_rt(thread) || thread_is_rt(rq->current))
+		return sched_rt_ops.check_preempt(rq, thread);
+	if (rq->policy->ops->check_preempt)
+		return rq->policy->ops->check_preempt(rq, thread);
+	return thread->prio > rq->current->prio;
+}
+
+/* A thread was queued on a runqueue, make sure its CPU notices. The runqueue must be locked. */
+static void queued_notify(struct runqueue* rq, struct cpu* cpu, bool preempt) {
+	if (preempt || rq->current == rq->idle) {
+		resched_cpu(cpu);
+	} else if (atomic_load(&rq->tick_mode) != SCHED_TICK_PERIODIC) {
+		/* The timer was pushed out, but now there are time slices to enforce */
+		if (cpu == current_cpu())
+			sched_timer_update(cpu, sched_now());
+		else
+			sched_send_resched(cpu);
+	}
+}
+
 int sched_enqueue(struct runqueue* rq, struct thread* thread) {
 	irqflags_t irq;
 	spinlock_lock_irq_save(&rq->lock, &irq);
 
 	assert(thread->attached);
-	assert(rq->policy->ops->enqueue != NULL);
-	int ret = rq->policy->ops->enqueue(rq, thread);
-	if (ret == 0 && thread->prio > rq->current->prio) {
-		struct cpu* this_cpu = current_cpu();
-		if (thread->target_cpu == this_cpu)
-			this_cpu->need_resched = true;
-		else
-			sched_send_resched(thread->target_cpu);
-	}
+	const struct sched_policy_ops* ops = thread_class_ops(rq, thread);
+	assert(ops->enqueue != NULL);
+	if (!thread->stats.queued_at)
+		sched_stats_queued(thread, sched_now(), false);
+	int ret = ops->enqueue(rq, thread);
+	if (ret == 0)
+		queued_notify(rq, thread->target_cpu, sched_check_preempt(rq, thread));
 
 	spinlock_unlock_irq_restore(&rq->lock, &irq);
 	return ret;
@@ -86,8 +142,9 @@ int sched_dequeue(struct runqueue* rq, struct thread* thread) {
 	spinlock_lock_irq_save(&rq->lock, &irq);
 
 	assert(thread->attached == true);
-	assert(rq->policy->ops->dequeue != NULL);
-	int ret = rq->policy->ops->dequeue(rq, thread);
+	const struct sched_policy_ops* ops = thread_class_ops(rq, thread);
+	assert(ops->dequeue != NULL);
+	int ret = ops->dequeue(rq, thread);
 
 	spinlock_unlock_irq_restore(&rq->lock, &irq);
 	return ret;
@@ -96,11 +153,76 @@ int sched_dequeue(struct runqueue* rq, struct thread* thread) {
 struct thread* sched_pick_next(struct runqueue* rq) {
 	irqflags_t irq;
 	spinlock_lock_irq_save(&rq->lock, &irq);
-	struct thread* ret = rq->policy->ops->pick_next(rq);
+
+	/* The current thread competes with the queued ones if it can keep running here */
+	struct thread* current = rq->current;
+	int state = atomic_load(&current->state);
+	if (current != rq->idle && current != rq->push && (state == THREAD_RUNNING || state == THREAD_READY)) {
+		if (!thread_cpu_allowed(current, current_cpu()) && !rq->push)
+			rq->push = current; /* Its affinity changed, so it gets moved after switching out */
+		else
+			thread_class_ops(rq, current)->put_prev(rq, current);
+	}
+
+	/* Real-time threads always go first */
+	struct thread* ret = sched_rt_ops.pick_next(rq);
+	if (!ret)
+		ret = rq->policy->ops->pick_next(rq);
+
 	spinlock_unlock_irq_restore(&rq->lock, &irq);
 	return ret;
 }
 
+/* Threads on the hardware threads of a CPU's core, including the CPU itself */
+static unsigned long core_thread_count(const struct smp_cpus* cpus, struct cpu* cpu) {
+	unsigned long count = 0;
+	u32 id;
+	cpumask_for_each(id, &cpu->topology.smt_mask) {
+		if (id < cpus->count && cpus->cpus[id])
+			count += atomic_load(&cpus->cpus[id]->runqueue.thread_count);
+	}
+
+	return count;
+}
+
+/*
+ * The CPU in the mask with the least threads. Ties go to the CPU with the least busy core, so threads
+ * spread over cores before sharing one, and then to the current CPU.
+ */
+static struct cpu* select_cpu(const struct cpumask* mask) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	struct cpu* best = NULL;
+	unsigned long best_tc = 0, best_core_tc = 0;
+
+	struct cpu* this_cpu = current_cpu();
+	if (cpumask_test(mask, this_cpu->sched_processor_id)) {
+		best = this_cpu;
+		best_tc = atomic_load(&this_cpu->runqueue.thread_count);
+		best_core_tc = core_thread_count(cpus, this_cpu);
+	}
+
+	u32 id;
+	cpumask_for_each(id, mask) {
+		if (id >= cpus->count)
+			break;
+		struct cpu* cpu = cpus->cpus[id];
+		if (!cpu || cpu == best)
+			continue;
+		unsigned long tc = atomic_load(&cpu->runqueue.thread_count);
+		if (best && tc > best_tc)
+			continue;
+
+		unsigned long core_tc = core_thread_count(cpus, cpu);
+		if (!best || tc < best_tc || core_tc < best_core_tc) {
+			best = cpu;
+			best_tc = tc;
+			best_core_tc = core_tc;
+		}
+	}
+
+	return best;
+}
+
 struct cpu* sched_decide_cpu(int flags) {
 	if (flags & SCHED_CPU0) {
 		const struct smp_cpus* cpus = smp_cpus_get();
@@ -112,82 +234,278 @@ struct cpu* sched_decide_cpu(int flags) {
 		return current_cpu();
 	}
 
-	const struct smp_cpus* smp_cpus = smp_cpus_get();
-	struct cpu* best = current_cpu();
-	unsigned long best_tc = atomic_load(&best->runqueue.thread_count);
-	for (u32 i = 0; i < smp_cpus->count; i++) {
-		struct cpu* current = smp_cpus->cpus[i];
-		if (current == best)
-			continue;
-		unsigned long current_tc = atomic_load(&current->runqueue.thread_count);
-		if (current_tc < best_tc) {
-			best = current;
-			best_tc = current_tc;
+	struct cpu* cpu = select_cpu(&default_mask);
+	return cpu ? cpu : current_cpu();
+}
+
+/* Queue a thread that was just woken up, and decide if it should preempt. The runqueue must be locked. */
+static bool wake_enqueue_locked(struct runqueue* rq, struct thread* thread) {
+	timer_cancel(&thread->sleep_timer);
+	assert(thread_class_ops(rq, thread)->enqueue(rq, thread) == 0);
+
+	/* Real-time threads always preempt lower ones, otherwise only policies that track it preempt on wakeup */
+	if (thread_is_rt(thread) || thread_is_rt(rq->current))
+		return sched_rt_ops.check_preempt(rq, thread);
+	return rq->policy->ops->check_preempt && rq->policy->ops->check_preempt(rq, thread);
+}
+
+/* Only one waker may win, whether it holds the runqueue lock or goes through the wake list */
+static bool claim_wakeup(struct thread* thread, int new_state) {
+	int state = atomic_load(&thread->state);
+	while (state == THREAD_BLOCKED || state == THREAD_SLEEPING) {
+		if (atomic_compare_exchange_weak(&thread->state, &state, new_state)) {
+			sched_stats_queued(thread, sched_now(), true);
+			return true;
 		}
 	}
 
-	return best;
+	return false;
 }
 
 static int __sched_wakeup_locked(struct thread* thread, int wakeup_err) {
 	if (wakeup_err != 0 && wakeup_err != -ETIMEDOUT && wakeup_err != -EINTR)
 		return -EINVAL;
-	int state = atomic_load(&thread->state);
-	if (state == THREAD_READY || state == THREAD_RUNNING)
-		return 0;
 
-	if (list_node_linked(&thread->sleep_link))
-		list_remove(&thread->sleep_link);
+	if (!claim_wakeup(thread, THREAD_READY))
+		return 0;
 
+	/* The thread can't get past sched_pick_next() until the runqueue is unlocked, so it sees the error code */
+	atomic_store(&thread->wakeup_err, wakeup_err);
 	struct runqueue* rq = &thread->target_cpu->runqueue;
+	queued_notify(rq, thread->target_cpu, wake_enqueue_locked(rq, thread));
+	return 0;
+}
 
-	atomic_store(&thread->wakeup_err, wakeup_err);
-	atomic_store(&thread->state, THREAD_READY);
-	assert(rq->policy->ops->enqueue(rq, thread) == 0);
+struct runqueue* thread_rq_lock(struct thread* thread, irqflags_t* irq) {
+	while (1) {
+		struct runqueue* rq = &thread->target_cpu->runqueue;
+		spinlock_lock_irq_save(&rq->lock, irq);
+		if (likely(rq == &thread->target_cpu->runqueue))
+			return rq;
+		spinlock_unlock_irq_restore(&rq->lock, irq);
+	}
+}
 
-	return 0;
+/* Hand a woken up thread to its CPU. The first thread on the list kicks the CPU, it takes the whole list at once. */
+static void wake_list_add(struct cpu* cpu, struct thread* thread) {
+	if (llist_add(&cpu->runqueue.wake_list, &thread->wake_node))
+		resched_cpu(cpu);
+}
+
+/* Queue the threads other CPU's woke up. Call with IRQ's disabled. */
+static void wake_list_drain(struct cpu* cpu) {
+	struct runqueue* rq = &cpu->runqueue;
+	struct llist_node* list = llist_del_all(&rq->wake_list);
+	if (!list)
+		return;
+
+	bool preempt = false;
+	struct llist_node* node, *tmp;
+	spinlock_lock(&rq->lock);
+	llist_for_each_safe(node, tmp, llist_reverse(list)) {
+		struct thread* thread = llist_entry(node, struct thread, wake_node);
+		bug(atomic_load(&thread->state) != THREAD_WAKING);
+
+		/* Moved right before the waker claimed it, nothing moves a waking thread so this is where it stays */
+		if (unlikely(thread->target_cpu != cpu)) {
+			wake_list_add(thread->target_cpu, thread);
+			continue;
+		}
+
+		rq->stats.wake.remote++;
+		atomic_store(&thread->state, THREAD_READY);
+		preempt |= wake_enqueue_locked(rq, thread);
+	}
+
+	queued_notify(rq, cpu, preempt);
+	spinlock_unlock(&rq->lock);
 }
 
 int sched_wakeup(struct thread* thread, int wakeup_err) {
-	struct runqueue* rq = &thread->target_cpu->runqueue;
+	if (wakeup_err != 0 && wakeup_err != -ETIMEDOUT && wakeup_err != -EINTR)
+		return -EINVAL;
 
-	irqflags_t irq;
-	spinlock_lock_irq_save(&rq->lock, &irq);
-	int ret = __sched_wakeup_locked(thread, wakeup_err);
-	spinlock_unlock_irq_restore(&rq->lock, &irq);
+	/* Don't bother picking a CPU for a thread that's already awake */
+	int state = atomic_load(&thread->state);
+	if (state == THREAD_READY || state == THREAD_RUNNING || state == THREAD_WAKING)
+		return 0;
 
-	return ret;
+	irqflags_t irq = local_irq_save();
+	struct cpu* this_cpu = current_cpu();
+	struct cpu* dst = sched_select_wake_cpu(thread);
+
+	/* Staying on another CPU, so let that CPU queue it instead of bouncing its runqueue lock over here */
+	if (dst == thread->target_cpu && dst != this_cpu) {
+		if (claim_wakeup(thread, THREAD_WAKING)) {
+			atomic_store(&thread->wakeup_err, wakeup_err);
+			wake_list_add(thread->target_cpu, thread);
+		}
+		local_irq_restore(irq);
+		return 0;
+	}
+
+	while (1) {
+		struct cpu* src = thread->target_cpu;
+		sched_double_lock(src, dst);
+		if (unlikely(thread->target_cpu != src)) {
+			sched_double_unlock(src, dst);
+			dst = sched_select_wake_cpu(thread);
+			continue;
+		}
+
+		/* A thread that's still switching out is using its stack, so it can't move yet */
+		struct runqueue* rq = &src->runqueue;
+		state = atomic_load(&thread->state);
+		bool asleep = state == THREAD_BLOCKED || state == THREAD_SLEEPING;
+		bool switching = thread == rq->current || thread == rq->push || (thread == rq->last && src != this_cpu);
+		if (dst != src && asleep && !switching && thread_cpu_allowed(thread, dst)) {
+			struct sched_wake_stats* stats = &dst->runqueue.stats.wake;
+			sched_move_thread(thread, dst);
+			stats->migrations++;
+			if (dst == this_cpu) {
+				stats->affine++;
+				stats->ipis_saved++;
+			} else {
+				stats->idle++;
+			}
+		}
+
+		int ret = __sched_wakeup_locked(thread, wakeup_err);
+		sched_double_unlock(src, dst);
+		local_irq_restore(irq);
+		return ret;
+	}
 }
 
 int sched_change_prio(struct thread* thread, int prio) {
-	struct runqueue* rq = &thread->target_cpu->runqueue;
-	if (!rq->policy->ops->change_prio)
-		return -ENOSYS;
-
 	if (prio < SCHED_PRIO_MIN)
 		prio = SCHED_PRIO_MIN;
 	if (prio > SCHED_PRIO_MAX)
 		prio = SCHED_PRIO_MAX;
 
 	irqflags_t irq;
-	spinlock_lock_irq_save(&rq->lock, &irq);
+	struct runqueue* rq = thread_rq_lock(thread, &irq);
 
-	int err = rq->policy->ops->change_prio(rq, thread, prio);
+	const struct sched_policy_ops* ops = thread_class_ops(rq, thread);
+	int err = ops->change_prio ? ops->change_prio(rq, thread, prio) : -ENOSYS;
 	if (likely(err == 0)) {
-		thread->prio = prio;
-		if (rq->current->prio > thread->prio) {
-			struct cpu* this_cpu = current_cpu();
-			if (thread->target_cpu == this_cpu)
-				this_cpu->need_resched = true;
-			else
-				sched_send_resched(thread->target_cpu);
+		bool resched;
+		if (thread_is_rt(thread)) {
+			/* Lowering the current thread may let a queued one run */
+			resched = thread == rq->current || sched_check_preempt(rq, thread);
+		} else {
+			thread->prio = prio;
+			resched = rq->current->prio > thread->prio;
 		}
+		if (resched)
+			resched_cpu(thread->target_cpu);
 	}
 
 	spinlock_unlock_irq_restore(&rq->lock, &irq);
 	return err;
 }
 
+int sched_set_affinity(struct thread* thread, const struct cpumask* mask) {
+	struct cpumask allowed;
+	if (!cpumask_and(&allowed, mask, &online_mask))
+		return -EINVAL;
+
+	while (1) {
+		irqflags_t irq = local_irq_save();
+		struct cpu* src = thread->target_cpu;
+		struct cpu* dst = select_cpu(&allowed);
+		sched_double_lock(src, dst);
+		if (unlikely(thread->target_cpu != src)) {
+			/* The load balancer moved it first */
+			sched_double_unlock(src, dst);
+			local_irq_restore(irq);
+			continue;
+		}
+
+		struct runqueue* rq = &src->runqueue;
+		thread->cpu_mask = allowed;
+		if (atomic_load(&thread->state) == THREAD_ZOMBIE || thread_cpu_allowed(thread, src)) {
+			sched_double_unlock(src, dst);
+			local_irq_restore(irq);
+			return 0;
+		}
+
+		/* Stop the thread, it can be moved once it's switched out and its stack isn't in use anymore */
+		bool self = thread == rq->current && src == current_cpu();
+		bool busy = thread == rq->current || thread == rq->push || (thread == rq->last && src != current_cpu()) ||
+				atomic_load(&thread->state) == THREAD_WAKING;
+		if (busy) {
+			resched_cpu(src);
+			sched_double_unlock(src, dst);
+			local_irq_restore(irq);
+
+			if (self) {
+				if (thread->preempt_count)
+					return 0; /* Moved the next time it's switched out */
+				schedule();
+			} else {
+				cpu_relax();
+			}
+			continue;
+		}
+
+		const struct sched_policy_ops* ops = thread_class_ops(rq, thread);
+		bool queued = ops->dequeue(rq, thread) == 0;
+		sched_move_thread(thread, dst);
+		if (queued) {
+			struct runqueue* dst_rq = &dst->runqueue;
+			assert(ops->enqueue(dst_rq, thread) == 0);
+			queued_notify(dst_rq, dst, sched_check_preempt(dst_rq, thread));
+		}
+
+		sched_double_unlock(src, dst);
+		local_irq_restore(irq);
+		return 0;
+	}
+}
+
+int sched_set_class(struct thread* thread, int sched_class, int prio) {
+	if (sched_class != SCHED_CLASS_NORMAL && sched_class != SCHED_CLASS_FIFO && sched_class != SCHED_CLASS_RR)
+		return -EINVAL;
+
+	if (prio < SCHED_PRIO_MIN)
+		prio = SCHED_PRIO_MIN;
+	if (prio > SCHED_PRIO_MAX)
+		prio = SCHED_PRIO_MAX;
+
+	irqflags_t irq;
+	struct runqueue* rq = thread_rq_lock(thread, &irq);
+
+	/* Take the thread out of its old class, the current thread goes through put_prev so its time is charged */
+	const struct sched_policy_ops* ops = thread_class_ops(rq, thread);
+	bool running = thread == rq->current;
+	int state = atomic_load(&thread->state);
+	if (running && (state == THREAD_RUNNING || state == THREAD_READY))
+		ops->put_prev(rq, thread);
+	bool queued = ops->dequeue(rq, thread) == 0 && !running;
+
+	bool was_rt = thread_is_rt(thread);
+	thread->sched_class = sched_class;
+	if (sched_class != SCHED_CLASS_NORMAL) {
+		thread->rt.prio = prio;
+		thread->rt.slice_left = 0;
+		thread->rt.requeue_tail = false;
+	} else if (was_rt && rq->policy->ops->thread_attach) {
+		/* The policy's state for the thread went stale while it was real-time */
+		rq->policy->ops->thread_attach(rq, thread, thread->prio);
+	}
+
+	if (queued) {
+		assert(thread_class_ops(rq, thread)->enqueue(rq, thread) == 0);
+		queued_notify(rq, thread->target_cpu, sched_check_preempt(rq, thread));
+	} else if (running) {
+		resched_cpu(thread->target_cpu);
+	}
+
+	spinlock_unlock_irq_restore(&rq->lock, &irq);
+	return 0;
+}
+
 void sched_tick(void) {
 	irqflags_t irq_flags = local_irq_save();
 
@@ -195,63 +513,182 @@ void sched_tick(void) {
 	struct runqueue* rq = &cpu->runqueue;
 	struct thread* current = rq->current;
 
+	/* Sleepers are woken up by their timers, which lock the runqueue themselves */
+	time_t now = sched_now();
+	timers_run(now);
+
 	spinlock_lock(&rq->lock);
 
-	if (rq->policy->ops->on_tick(rq, current))
+	/* The timer doesn't fire on every tick, so count the ones that passed */
+	u64 passed = (u64)(now - rq->last_tick) / SCHED_TICK_NS;
+	rq->ticks += passed;
+	rq->last_tick += passed * SCHED_TICK_NS;
+	sched_stats_update_curr(rq, now);
+
+	if (thread_class_ops(rq, current)->on_tick(rq, current))
 		cpu->need_resched = true;
 	else if (current == rq->idle)
 		cpu->need_resched = true;
 
-	struct timespec ts_now = timekeeper_time();
-	time_t now = timespec_to_ns(&ts_now);
-	while (!list_empty(&rq->sleepers)) {
-		struct thread* thread = list_first_entry(&rq->sleepers, struct thread, sleep_link);
-		if (now < thread->wakeup_time)
-			break; /* List is ordered */
+	sched_timer_update(cpu, now);
+	spinlock_unlock(&rq->lock);
+	sched_balance_tick(cpu);
+	local_irq_restore(irq_flags);
+}
+
+void sched_timer_update(struct cpu* cpu, time_t now) {
+	struct runqueue* rq = &cpu->runqueue;
+
+	time_t deadline = timers_next_expiry();
+
+	int mode = SCHED_TICK_STOPPED;
+	time_t limit = -1;
+	if (rq->current != rq->idle) {
+		if (atomic_load(&rq->nr_queued)) {
+			mode = SCHED_TICK_PERIODIC;
+			limit = now + SCHED_TICK_NS;
+		} else {
+			/* Nothing to switch to, but still tick now and then for balancing and accounting */
+			mode = SCHED_TICK_DEFERRED;
+			limit = now + SCHED_TICK_MAX_DEFER_NS;
+		}
+	}
+	if (limit >= 0 && (deadline < 0 || limit < deadline))
+		deadline = limit;
+
+	atomic_store(&rq->tick_mode, mode);
+	preempt_timer_arm(deadline < 0 ? -1 : deadline - now);
+}
+
+void sched_timer_reprogram(void) {
+	struct cpu* cpu = current_cpu();
+	struct runqueue* rq = &cpu->runqueue;
+	if (unlikely(!rq->idle))
+		return; /* Not initialized yet, the timer still fires every tick */
+
+	spinlock_lock(&rq->lock);
+	sched_timer_update(cpu, sched_now());
+	spinlock_unlock(&rq->lock);
+}
+
+void sched_sleep_timeout(void* arg) {
+	struct thread* thread = arg;
+
+	irqflags_t irq;
+	struct runqueue* rq = thread_rq_lock(thread, &irq);
+
+	/* The thread may have been woken up, and gone back to sleep before this got the lock */
+	time_t wakeup_time = thread->wakeup_time;
+	if (wakeup_time && sched_now() >= wakeup_time) {
 		int err = atomic_load(&thread->state) == THREAD_BLOCKED ? -ETIMEDOUT : 0;
 		__sched_wakeup_locked(thread, err);
-		if (current == cpu->runqueue.idle)
-			cpu->need_resched = true;
 	}
 
+	spinlock_unlock_irq_restore(&rq->lock, &irq);
+}
+
+/* Move a thread that was switched away from because it's not allowed on this CPU anymore */
+static void push_thread(struct cpu* cpu) {
+	struct runqueue* rq = &cpu->runqueue;
+
+	spinlock_lock(&rq->lock);
+	rq->last = NULL; /* Interrupts are off while switching, so the last switch is finished */
+	struct thread* thread = rq->push;
 	spinlock_unlock(&rq->lock);
-	local_irq_restore(irq_flags);
+	if (!thread)
+		return;
+
+	struct cpu* dst = select_cpu(&thread->cpu_mask);
+	if (unlikely(!dst))
+		dst = cpu; /* The mask can only be set to online CPU's, so this is just for safety */
+
+	sched_double_lock(cpu, dst);
+	if (rq->push == thread) {
+		rq->push = NULL;
+		bug(thread == rq->current);
+
+		struct runqueue* dst_rq = &dst->runqueue;
+		sched_move_thread(thread, dst);
+		assert(thread_class_ops(dst_rq, thread)->enqueue(dst_rq, thread) == 0);
+		queued_notify(dst_rq, dst, sched_check_preempt(dst_rq, thread));
+	}
+	sched_double_unlock(cpu, dst);
 }
 
 struct thread* atomic_schedule(void) {
 	struct cpu* cpu = current_cpu();
 	struct runqueue* rq = &cpu->runqueue;
 
+	/*
+	 * Switching away from a polling idle loop, so wakeups have to send IPI's again. A kick replaces
+	 * the resched IPI, so do the rest of its work too: sched_set_affinity() waits for rq->last to clear.
+	 */
+	if (rq->current == rq->idle) {
+		atomic_store(&cpu->idle_wake, 0);
+		push_thread(cpu);
+	}
+	wake_list_drain(cpu);
+
 	struct thread* prev = rq->current;
 	if (prev->preempt_count) {
 		bug(atomic_load(&prev->state) != THREAD_RUNNING);
 		return NULL;
 	}
 
-	/* If there is no thread to run, see if the current thread is still runnable. If not, pick idle */
+	/* Before picking, so a worker the pool wakes up can take over right away */
+	int prev_state = atomic_load(&prev->state);
+	if (prev->worker && (prev_state == THREAD_BLOCKED || prev_state == THREAD_SLEEPING))
+		wq_worker_sleeping(prev);
+
+	/* If there is no thread to run, see if the current thread is still runnable. If not, try stealing one or pick idle */
 	struct thread* next = sched_pick_next(rq);
+	bool prev_runnable = atomic_load(&prev->state) == THREAD_RUNNING && prev != rq->push;
+	if (!next && (prev == rq->idle || !prev_runnable) && sched_balance_idle(cpu))
+		next = sched_pick_next(rq);
 	if (!next) {
-		if (atomic_load(&prev->state) == THREAD_RUNNING)
+		if (prev_runnable)
 			next = prev;
 		else
 			next = rq->idle;
 	}
 
+	time_t now = sched_now();
 	if (prev == next) {
+		if (prev->worker)
+			wq_worker_running(prev); /* Woken up before it switched out */
 		cpu->need_resched = false;
+		spinlock_lock(&rq->lock);
+		prev->stats.queued_at = 0; /* Woken up before it switched out, it never stopped running */
+		sched_timer_update(cpu, now);
+		spinlock_unlock(&rq->lock);
 		return NULL;
 	}
 
 	/* If the state is modified (eg. by sched_thread_exit), then don't make the thread ready */
-	int prev_state = atomic_load(&prev->state);
+	prev_state = atomic_load(&prev->state);
 	if (prev_state == THREAD_RUNNING)
 		atomic_store(&prev->state, THREAD_READY);
 	else if (prev_state == THREAD_ZOMBIE)
 		semaphore_signal(&rq->reaper_sem); /* Signal the current CPU's semaphore, safe to do since IRQ's are disabled */
 
+	/* Under the lock, so the balancer never sees prev as neither current nor last */
+	spinlock_lock(&rq->lock);
+	sched_stats_switch(rq, prev, next, prev_state != THREAD_RUNNING, now);
+	prev->last_ran = now;
+	rq->last = prev;
 	rq->current = next;
+	sched_timer_update(cpu, now); /* Stops the tick if next is idle */
+	bool push = rq->push == prev;
+	spinlock_unlock(&rq->lock);
+
+	/* IRQ's stay disabled until the switch is done, so the IPI only arrives after it */
+	if (push)
+		apic_send_ipi(NULL, resched_isr, APIC_IPI_CPU_SELF, true);
+
 	cpu->need_resched = false;
 	atomic_store(&next->state, THREAD_RUNNING);
+	if (next->worker)
+		wq_worker_running(next);
 
 	return next;
 }
@@ -282,9 +719,10 @@ int sched_yield(void) {
 	struct runqueue* rq = &cpu->runqueue;
 	struct thread* current = rq->current;
 
-	assert(rq->policy->ops->on_yield);
 	spinlock_lock(&rq->lock);
-	rq->policy->ops->on_yield(rq, current);
+	const struct sched_policy_ops* ops = thread_class_ops(rq, current);
+	assert(ops->on_yield);
+	ops->on_yield(rq, current);
 	spinlock_unlock(&rq->lock);
 
 	cpu->need_resched = false;
@@ -308,12 +746,11 @@ int sched_prepare_sleep(time_t ms, int flags) {
 
 	irqflags_t irq = local_irq_save();
 
-	struct runqueue* rq = &current_cpu()->runqueue;
-	struct thread* current = rq->current;
+	struct thread* current = current_cpu()->runqueue.current;
 
 	int prev_state = atomic_load(&current->state);
-	bug(prev_state == THREAD_BLOCKED || prev_state == THREAD_SLEEPING ||
-			list_node_linked(&current->sleep_link));
+	bug(prev_state == THREAD_BLOCKED || prev_state == THREAD_SLEEPING || prev_state == THREAD_WAKING ||
+			timer_pending(&current->sleep_timer));
 
 	atomic_store(&current->sleep_interruptable, (flags & SCHED_SLEEP_INTERRUPTIBLE) != 0);
 	if (flags & SCHED_SLEEP_BLOCK)
@@ -321,26 +758,10 @@ int sched_prepare_sleep(time_t ms, int flags) {
 	else
 		atomic_store(&current->state, THREAD_SLEEPING);
 
-	/* Check if the thread is blocking with no timeout */
-	if (sleep_end) {
-		current->wakeup_time = sleep_end;
-		spinlock_lock(&rq->lock);
-
-		/* Now put the thread in order by wakeup time */
-		struct thread* pos;
-		bool inserted = false;
-		list_for_each_entry(pos, &rq->sleepers, sleep_link) {
-			if (current->wakeup_time < pos->wakeup_time) {
-				list_add_before(&pos->sleep_link, &current->sleep_link);
-				inserted = true;
-				break;
-			}
-		}
-		if (!inserted)
-			list_add_tail(&rq->sleepers, &current->sleep_link);
-
-		spinlock_unlock(&rq->lock);
-	}
+	/* Blocking with no timeout doesn't need a timer */
+	current->wakeup_time = sleep_end;
+	if (sleep_end)
+		timer_arm(&current->sleep_timer, sleep_end);
 
 	local_irq_restore(irq);
 	return 0;
@@ -365,17 +786,13 @@ _Noreturn void sched_thread_exit(void) {
 
 static struct proc* kproc;
 
-static void idle_thread(void) {
-	while (1)
-		cpu_halt();
-}
-
 static struct thread* create_bootstrap_thread(struct runqueue* rq, void* exec, int state, int prio) {
 	struct thread* thread = thread_create(kproc, PAGE_SIZE);
 	if (!thread)
 		panic("Failed to create a bootstrap thread\n");
 
 	thread->target_cpu = current_cpu();
+	thread_pin(thread, thread->target_cpu);
 	atomic_store(&thread->state, state);
 	thread_set_ring(thread, THREAD_RING_KERNEL);
 	thread_set_exec(thread, exec);
@@ -388,19 +805,23 @@ static void sched_bootstrap_processor(void) {
 	struct runqueue* rq = &current_cpu()->runqueue;
 	spinlock_init(&rq->lock);
 	spinlock_init(&rq->zombie_lock);
+	llist_head_init(&rq->wake_list);
 	semaphore_init(&rq->reaper_sem, 0);
+	thread_free_cache_init(&rq->free_threads);
+	assert(sched_rt_ops.init(rq) == 0);
 
 	struct thread* thread = create_bootstrap_thread(rq, NULL, THREAD_RUNNING, SCHED_PRIO_DEFAULT);
+	thread->stats.exec_start = sched_now();
 	rq->current = thread;
-	thread = create_bootstrap_thread(rq, idle_thread, THREAD_READY, SCHED_PRIO_MIN);
+	thread = create_bootstrap_thread(rq, idle_loop, THREAD_READY, SCHED_PRIO_MIN);
 	rq->idle = thread;
 
-	list_head_init(&rq->sleepers);
 	list_head_init(&rq->zombies);
 }
 
 void sched_cpu_init(void) {
 	sched_policy_cpu_init();
+	timer_cpu_init();
 	preempt_cpu_init();
 	ext_context_cpu_init();
 	sched_bootstrap_processor();
@@ -408,12 +829,13 @@ void sched_cpu_init(void) {
 	reaper_cpu_init();
 }
 
-static struct isr* resched_isr;
-
 static void resched_ipi(struct isr* isr, struct context* ctx) {
 	(void)isr;
 	(void)ctx;
 
+	push_thread(current_cpu());
+	wake_list_drain(current_cpu());
+
 	struct thread* current = current_thread();
 	if (current->preempt_count)
 		return;
@@ -421,11 +843,86 @@ static void resched_ipi(struct isr* isr, struct context* ctx) {
 }
 
 void sched_send_resched(struct cpu* target) {
+	if (idle_kick_polling(target))
+		return;
 	apic_send_ipi(target, resched_isr, APIC_IPI_CPU_TARGET, true);
 }
 
+/* Parses a list like "2,4-7" into a mask */
+static int parse_cpu_list(const char* str, struct cpumask* mask) {
+	cpumask_zero(mask);
+	while (*str) {
+		u32 first = 0, last;
+		if (*str < '0' || *str > '9')
+			return -EINVAL;
+		while (*str >= '0' && *str <= '9') {
+			first = first * 10 + (*str++ - '0');
+			if (first >= CONFIG_MAX_CPUS)
+				return -ERANGE;
+		}
+
+		last = first;
+		if (*str == '-') {
+			str++;
+			if (*str < '0' || *str > '9')
+				return -EINVAL;
+			last = 0;
+			while (*str >= '0' && *str <= '9') {
+				last = last * 10 + (*str++ - '0');
+				if (last >= CONFIG_MAX_CPUS)
+					return -ERANGE;
+			}
+		}
+		if (last < first)
+			return -ERANGE;
+
+		for (u32 cpu = first; cpu <= last; cpu++)
+			cpumask_set(mask, cpu);
+		if (*str == ',')
+			str++;
+		else if (*str)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void affinity_init(void) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	cpumask_zero(&online_mask);
+	for (u32 i = 0; i < cpus->count; i++)
+		cpumask_set(&online_mask, i);
+	default_mask = online_mask;
+
+	/* Isolated CPU's only run threads that are explicitly given affinity to them */
+	const char* isolcpus = cmdline_get("sched.isolcpus");
+	if (!isolcpus)
+		return;
+
+	struct cpumask isolated;
+	int err = parse_cpu_list(isolcpus, &isolated);
+	if (err) {
+		printk(PRINTK_ERR "sched: Failed to parse sched.isolcpus: %i\n", err);
+		return;
+	}
+
+	bool any = false;
+	for (u32 i = 0; i < cpus->count; i++) {
+		if (cpumask_test(&isolated, i))
+			cpumask_clear(&default_mask, i);
+		else
+			any = true;
+	}
+	if (!any) {
+		printk(PRINTK_ERR "sched: sched.isolcpus can't isolate every CPU\n");
+		default_mask = online_mask;
+	}
+}
+
 void sched_init(void) {
+	affinity_init();
 	sched_policy_cpu_init();
+	timer_cpu_init();
 	preempt_cpu_init();
 	procthrd_init();
 	ext_context_init();
@@ -439,6 +936,9 @@ void sched_init(void) {
 	sched_bootstrap_processor();
 	workqueue_init();
 	reaper_cpu_init();
+	sched_stats_init(kproc);
+	pbrr_bench();
+	idle_init();
 
 	resched_isr = interrupt_alloc();
 	if (unlikely(!resched_isr))
@@ -0,0 +1,350 @@
+#include <lunar/lib/rbtree.h>
+#include <lunar/mm/heap.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/time.h>
+#include <lunar/core/timekeeper.h>
+#include "internal.h"
+
+/*
+ * Fair share scheduling. Every thread accumulates virtual runtime, which is the time it spent
+ * running scaled by its weight, and the thread with the least of it runs next. Threads that
+ * sleep a lot fall behind, so they preempt the current thread when they wake up.
+ */
+
+#define FAIR_LATENCY_NS 6000000ull /* Every runnable thread should get to run once in this period */
+#define FAIR_MIN_GRANULARITY_NS 750000ull /* Shortest slice, so threads don't switch constantly */
+#define FAIR_WAKEUP_GRANULARITY_NS 1000000ull /* How far behind a waking thread has to be to preempt */
+#define FAIR_NICE_0_WEIGHT 1024
+
+/* Each nice level is about 10% more or less CPU time, same as the table other kernels use */
+static const unsigned long nice_to_weight[40] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15
+};
+
+struct fair_thread {
+	struct thread* thread;
+	struct rb_node node; /* Link in the timeline */
+	u64 vruntime;
+	u64 exec_start; /* When the thread last started running or was last charged, 0 if never */
+	u64 slice_ran; /* Time ran since it was picked */
+	unsigned long weight;
+	bool queued; /* In the timeline */
+	bool migrated; /* vruntime is relative, because it was stolen by another CPU */
+};
+
+struct fair_runqueue {
+	struct rb_root timeline; /* Queued threads ordered by vruntime */
+	struct rb_node* leftmost;
+	u64 min_vruntime; /* Only moves forward */
+	unsigned long queued_weight;
+};
+
+/* Maps SCHED_PRIO_DEFAULT to nice 0, the minimum to 19 and the maximum to -20 */
+static unsigned long prio_to_weight(int posix_prio) {
+	int nice;
+	if (posix_prio <= SCHED_PRIO_DEFAULT)
+		nice = (SCHED_PRIO_DEFAULT - posix_prio) * 19 / (SCHED_PRIO_DEFAULT - SCHED_PRIO_MIN);
+	else
+		nice = -(posix_prio - SCHED_PRIO_DEFAULT) * 20 / (SCHED_PRIO_MAX - SCHED_PRIO_DEFAULT);
+	return nice_to_weight[nice + 20];
+}
+
+static inline u64 now_ns(void) {
+	struct timespec ts = timekeeper_time();
+	return timespec_to_ns(&ts);
+}
+
+static inline bool vruntime_before(u64 a, u64 b) {
+	return (i64)(a - b) < 0;
+}
+
+static inline u64 scale_delta(u64 delta, unsigned long weight) {
+	return weight == FAIR_NICE_0_WEIGHT ? delta : delta * FAIR_NICE_0_WEIGHT / weight;
+}
+
+static void timeline_insert(struct fair_runqueue* fq, struct fair_thread* ft) {
+	struct rb_node** link = &fq->timeline.node, *parent = NULL;
+	bool leftmost = true;
+
+	/* Equal keys go to the right, so threads with the same vruntime run in FIFO order */
+	while (*link) {
+		parent = *link;
+		struct fair_thread* pos = rb_entry(parent, struct fair_thread, node);
+		if (vruntime_before(ft->vruntime, pos->vruntime)) {
+			link = &parent->left;
+		} else {
+			link = &parent->right;
+			leftmost = false;
+		}
+	}
+
+	rb_link_node(&ft->node, parent, link);
+	rb_insert_color(&fq->timeline, &ft->node);
+	if (leftmost)
+		fq->leftmost = &ft->node;
+	fq->queued_weight += ft->weight;
+	ft->queued = true;
+}
+
+static void timeline_remove(struct fair_runqueue* fq, struct fair_thread* ft) {
+	if (fq->leftmost == &ft->node)
+		fq->leftmost = rb_next(&ft->node);
+	rb_erase(&fq->timeline, &ft->node);
+	fq->queued_weight -= ft->weight;
+	ft->queued = false;
+}
+
+static inline bool is_accounted(struct runqueue* rq, struct thread* thread) {
+	if (thread == rq->idle || thread_is_rt(thread))
+		return false;
+	return ((struct fair_thread*)thread->policy_priv)->exec_start != 0;
+}
+
+static void update_min_vruntime(struct runqueue* rq, struct fair_runqueue* fq) {
+	u64 vruntime = 0;
+	bool found = false;
+
+	struct thread* current = rq->current;
+	int state = atomic_load(&current->state);
+	if (is_accounted(rq, current) && (state == THREAD_RUNNING || state == THREAD_READY)) {
+		vruntime = ((struct fair_thread*)current->policy_priv)->vruntime;
+		found = true;
+	}
+	if (fq->leftmost) {
+		u64 left = rb_entry(fq->leftmost, struct fair_thread, node)->vruntime;
+		if (!found || vruntime_before(left, vruntime))
+			vruntime = left;
+		found = true;
+	}
+
+	if (found && vruntime_before(fq->min_vruntime, vruntime))
+		fq->min_vruntime = vruntime;
+}
+
+/* Charge the current thread for the time it ran since the last update */
+static void update_current(struct runqueue* rq, struct fair_runqueue* fq, u64 now) {
+	struct thread* current = rq->current;
+	if (!is_accounted(rq, current))
+		return;
+
+	struct fair_thread* ft = current->policy_priv;
+	u64 delta = now > ft->exec_start ? now - ft->exec_start : 0;
+	ft->exec_start = now;
+	ft->slice_ran += delta;
+	ft->vruntime += scale_delta(delta, ft->weight);
+	update_min_vruntime(rq, fq);
+}
+
+/* This thread's share of the latency period */
+static u64 ideal_slice(struct fair_runqueue* fq, struct fair_thread* ft) {
+	u64 slice = FAIR_LATENCY_NS * ft->weight / (fq->queued_weight + ft->weight);
+	return slice < FAIR_MIN_GRANULARITY_NS ? FAIR_MIN_GRANULARITY_NS : slice;
+}
+
+static int fair_init(struct runqueue* rq) {
+	struct fair_runqueue* fq = kzalloc(sizeof(*fq), MM_ZONE_NORMAL);
+	if (!fq)
+		return -ENOMEM;
+
+	rb_root_init(&fq->timeline);
+	rq->policy_priv = fq;
+	return 0;
+}
+
+static void fair_thread_attach(struct runqueue* rq, struct thread* thread, int posix_prio) {
+	struct fair_runqueue* fq = rq->policy_priv;
+	struct fair_thread* ft = thread->policy_priv;
+	ft->thread = thread;
+	ft->weight = prio_to_weight(posix_prio);
+	ft->vruntime = fq->min_vruntime; /* New threads start level with everyone else */
+	ft->exec_start = 0;
+}
+
+static int fair_enqueue(struct runqueue* rq, struct thread* thread) {
+	struct fair_thread* ft = thread->policy_priv;
+	if (ft->queued)
+		return -EALREADY;
+
+	struct fair_runqueue* fq = rq->policy_priv;
+	if (ft->migrated) {
+		ft->vruntime += fq->min_vruntime;
+		ft->migrated = false;
+	}
+
+	/*
+	 * Sleepers get a bit of credit, but can't bank all of the time they slept. This also covers threads
+	 * moved while asleep, their relative vruntime is from a min_vruntime that kept advancing meanwhile.
+	 * Queued threads are never that far behind, so stolen ones keep their place.
+	 */
+	u64 floor = fq->min_vruntime - FAIR_LATENCY_NS / 2;
+	if (vruntime_before(ft->vruntime, floor))
+		ft->vruntime = floor;
+
+	timeline_insert(fq, ft);
+	atomic_add_fetch(&rq->nr_queued, 1);
+	return 0;
+}
+
+static int fair_dequeue(struct runqueue* rq, struct thread* thread) {
+	struct fair_thread* ft = thread->policy_priv;
+	if (!ft->queued)
+		return -ENOENT;
+
+	timeline_remove(rq->policy_priv, ft);
+	atomic_sub_fetch(&rq->nr_queued, 1);
+	return 0;
+}
+
+static void fair_put_prev(struct runqueue* rq, struct thread* current) {
+	struct fair_runqueue* fq = rq->policy_priv;
+	update_current(rq, fq, now_ns());
+
+	/* The current thread goes back into the timeline, it might still be the leftmost */
+	struct fair_thread* cft = current->policy_priv;
+	if (!cft->queued) {
+		timeline_insert(fq, cft);
+		atomic_add_fetch(&rq->nr_queued, 1);
+	}
+}
+
+static struct thread* fair_pick_next(struct runqueue* rq) {
+	struct fair_runqueue* fq = rq->policy_priv;
+	u64 now = now_ns();
+	update_current(rq, fq, now);
+
+	if (!fq->leftmost)
+		return NULL;
+
+	struct fair_thread* next = rb_entry(fq->leftmost, struct fair_thread, node);
+	timeline_remove(fq, next);
+	atomic_sub_fetch(&rq->nr_queued, 1);
+
+	next->exec_start = now;
+	next->slice_ran = 0;
+	return next->thread;
+}
+
+static int fair_change_prio(struct runqueue* rq, struct thread* thread, int posix_prio) {
+	struct fair_runqueue* fq = rq->policy_priv;
+	struct fair_thread* ft = thread->policy_priv;
+
+	/* Charge the old weight first */
+	if (thread == rq->current)
+		update_current(rq, fq, now_ns());
+
+	unsigned long weight = prio_to_weight(posix_prio);
+	if (ft->queued)
+		fq->queued_weight = fq->queued_weight - ft->weight + weight;
+	ft->weight = weight;
+
+	return 0;
+}
+
+static bool fair_on_tick(struct runqueue* rq, struct thread* current) {
+	if (current == rq->idle)
+		return false;
+
+	struct fair_runqueue* fq = rq->policy_priv;
+	struct fair_thread* ft = current->policy_priv;
+	update_current(rq, fq, now_ns());
+
+	u64 slice = ideal_slice(fq, ft);
+	if (ft->slice_ran >= slice)
+		return true;
+
+	/* Don't let the current thread get too far ahead of the one waiting the longest */
+	if (fq->leftmost) {
+		struct fair_thread* left = rb_entry(fq->leftmost, struct fair_thread, node);
+		if ((i64)(ft->vruntime - left->vruntime) > (i64)slice)
+			return true;
+	}
+
+	return false;
+}
+
+static void fair_on_yield(struct runqueue* rq, struct thread* current) {
+	struct fair_runqueue* fq = rq->policy_priv;
+	struct fair_thread* ft = current->policy_priv;
+	update_current(rq, fq, now_ns());
+
+	/* Go behind everything that's queued, fair_put_prev puts it back into the timeline */
+	struct rb_node* last = rb_last(&fq->timeline);
+	if (last) {
+		u64 vruntime = rb_entry(last, struct fair_thread, node)->vruntime + 1;
+		if (vruntime_before(ft->vruntime, vruntime))
+			ft->vruntime = vruntime;
+	}
+}
+
+static bool fair_check_preempt(struct runqueue* rq, struct thread* thread) {
+	struct thread* current = rq->current;
+	if (current == rq->idle)
+		return true;
+
+	struct fair_runqueue* fq = rq->policy_priv;
+	update_current(rq, fq, now_ns());
+
+	struct fair_thread* cft = current->policy_priv;
+	struct fair_thread* ft = thread->policy_priv;
+	i64 lead = (i64)(cft->vruntime - ft->vruntime);
+	return lead > (i64)scale_delta(FAIR_WAKEUP_GRANULARITY_NS, ft->weight);
+}
+
+static struct thread* fair_steal(struct runqueue* rq, struct cpu* target, bool allow_hot) {
+	struct fair_runqueue* fq = rq->policy_priv;
+
+	/* Start from the right, those would wait the longest here */
+	for (struct rb_node* node = rb_last(&fq->timeline); node; node = rb_prev(node)) {
+		struct fair_thread* ft = rb_entry(node, struct fair_thread, node);
+		if (!sched_can_migrate(rq, ft->thread, target, allow_hot))
+			continue;
+
+		timeline_remove(fq, ft);
+		atomic_sub_fetch(&rq->nr_queued, 1);
+		ft->vruntime -= fq->min_vruntime;
+		ft->migrated = true;
+		return ft->thread;
+	}
+
+	return NULL;
+}
+
+static void fair_migrate(struct runqueue* rq, struct thread* thread) {
+	/* Same as stealing, the vruntime is made relative and fair_enqueue rebases it on the new runqueue */
+	struct fair_runqueue* fq = rq->policy_priv;
+	struct fair_thread* ft = thread->policy_priv;
+	if (!ft->migrated) {
+		ft->vruntime -= fq->min_vruntime;
+		ft->migrated = true;
+	}
+}
+
+static const struct sched_policy_ops fair_ops = {
+	.init = fair_init,
+	.thread_attach = fair_thread_attach,
+	.thread_detach = NULL,
+	.enqueue = fair_enqueue,
+	.dequeue = fair_dequeue,
+	.put_prev = fair_put_prev,
+	.pick_next = fair_pick_next,
+	.change_prio = fair_change_prio,
+	.on_tick = fair_on_tick,
+	.on_yield = fair_on_yield,
+	.steal = fair_steal,
+	.migrate = fair_migrate,
+	.check_preempt = fair_check_preempt
+};
+
+static struct sched_policy __sched_policy fair = {
+	.name = "fair",
+	.desc = "Fair share (virtual runtime)",
+	.ops = &fair_ops,
+	.thread_priv_size = sizeof(struct fair_thread)
+};
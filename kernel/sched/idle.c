@@ -0,0 +1,229 @@
+#include <lunar/compiler.h>
+#include <lunar/asm/cpuid.h>
+#include <lunar/asm/errno.h>
+#include <lunar/asm/wrap.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/irq.h>
+#include <lunar/core/printk.h>
+#include <lunar/core/cmdline.h>
+#include <lunar/lib/convert.h>
+#include <lunar/lib/string.h>
+#include <lunar/sched/idle.h>
+#include <lunar/mm/tlb.h>
+#include "internal.h"
+
+#define IDLE_POLL_MAX_NS 10000ll /* Polling longer than this costs more than an IPI saves */
+#define IDLE_POLL_CHECK_MASK 15 /* Reading the clock is slow, so only check it every 16 spins */
+
+static atomic(struct idle_driver*) idle_driver;
+static struct idle_driver default_driver;
+static unsigned int max_state = IDLE_STATES_MAX - 1;
+static bool timer_always_running;
+
+bool idle_mwait_usable(void) {
+	u32 eax, ecx, _unused;
+	cpuid(CPUID_LEAF_HIGHEST_FUNCTION, 0, &eax, &_unused, &_unused, &_unused);
+	if (eax < CPUID_LEAF_MONITOR)
+		return false;
+
+	/* bit 3 is MONITOR/MWAIT */
+	cpuid(CPUID_LEAF_FEATURE_BITS, 0, &_unused, &_unused, &ecx, &_unused);
+	return (ecx & (1 << 3)) != 0;
+}
+
+static bool arat_supported(void) {
+	u32 eax, _unused;
+	cpuid(CPUID_LEAF_HIGHEST_FUNCTION, 0, &eax, &_unused, &_unused, &_unused);
+	if (eax < CPUID_LEAF_THERMAL_POWER)
+		return false;
+
+	/* bit 2 is ARAT, the LAPIC timer keeps running in deep C-states */
+	cpuid(CPUID_LEAF_THERMAL_POWER, 0, &eax, &_unused, &_unused, &_unused);
+	return (eax & (1 << 2)) != 0;
+}
+
+/* Stop polling, returns true if the CPU was kicked */
+static bool idle_wake_clear(struct cpu* cpu) {
+	if (!(atomic_exchange(&cpu->idle_wake, 0) & IDLE_WAKE_KICKED))
+		return false;
+
+	cpu->need_resched = true;
+	return true;
+}
+
+/* Anything that should end the idle period, IDLE_WAKE_POLLING is cleared if the idle thread was switched out */
+static inline bool idle_should_exit(struct cpu* cpu) {
+	return cpu->need_resched || atomic_load(&cpu->idle_wake) != IDLE_WAKE_POLLING;
+}
+
+bool idle_kick_polling(struct cpu* cpu) {
+	unsigned int wake = atomic_load(&cpu->idle_wake);
+	while (wake & IDLE_WAKE_POLLING) {
+		if (wake & IDLE_WAKE_KICKED)
+			return true;
+		if (atomic_compare_exchange_weak(&cpu->idle_wake, &wake, wake | IDLE_WAKE_KICKED))
+			return true;
+	}
+
+	return false;
+}
+
+void idle_enter_mwait(struct idle_state* state) {
+	struct cpu* cpu = current_cpu();
+
+	/* A kick between the check and MWAIT still ends the wait, since the line is already monitored */
+	cpu_monitor(&cpu->idle_wake);
+	if (idle_should_exit(cpu)) {
+		local_irq_enable();
+		return;
+	}
+	cpu_sti_mwait((u32)state->data);
+}
+
+void idle_enter_halt(struct idle_state* state) {
+	(void)state;
+	cpu_sti_halt();
+}
+
+int idle_driver_register(struct idle_driver* driver) {
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < driver->count && i < IDLE_STATES_MAX; i++) {
+		struct idle_state* state = &driver->states[i];
+		if (!state->enter)
+			continue;
+		if ((state->flags & IDLE_STATE_TIMER_STOP) && !timer_always_running)
+			continue;
+		if (count != i)
+			driver->states[count] = *state;
+		count++;
+	}
+	if (count == 0)
+		return -EINVAL;
+	driver->count = count;
+
+	atomic_store(&idle_driver, driver);
+	printk(PRINTK_INFO "sched: Using idle driver \"%s\" with %u state(s)\n", driver->name, count);
+	for (unsigned int i = 0; i < count; i++) {
+		struct idle_state* state = &driver->states[i];
+		printk(PRINTK_INFO "sched: Idle state %u: %s, exit latency %lu us, target residency %lu us\n",
+				i, state->name, state->exit_latency_ns / 1000, state->target_residency_ns / 1000);
+	}
+
+	return 0;
+}
+
+/* The deepest state worth entering until the next timer, interrupts from devices aren't predicted */
+static unsigned int select_state(struct idle_driver* driver, u64 predicted) {
+	unsigned int index = 0;
+	for (unsigned int i = 1; i < driver->count && i <= max_state; i++) {
+		if (driver->states[i].target_residency_ns > predicted)
+			break;
+		index = i;
+	}
+
+	return index;
+}
+
+/* Spin until woken up or the time runs out, returns true if there's something to do */
+static bool idle_poll(struct cpu* cpu, time_t until) {
+	unsigned long spins = 0;
+	while (!idle_should_exit(cpu)) {
+		if ((++spins & IDLE_POLL_CHECK_MASK) == 0 && sched_now() >= until)
+			return false;
+		cpu_relax();
+	}
+
+	return true;
+}
+
+static void idle_enter(struct cpu* cpu) {
+	struct idle_driver* driver = atomic_load(&idle_driver);
+
+	time_t now = sched_now();
+	time_t next = timers_next_expiry();
+	u64 predicted = next < 0 ? U64_MAX : next > now ? (u64)(next - now) : 0;
+	struct idle_state* state = &driver->states[select_state(driver, predicted)];
+
+	/*
+	 * Poll for about as long as it takes to wake up from the state first. A wakeup in that window
+	 * comes in without an IPI and without the exit latency, and otherwise it wastes at most twice
+	 * the time that the state itself would have.
+	 */
+	atomic_store(&cpu->idle_wake, IDLE_WAKE_POLLING);
+	u64 poll_ns = state->exit_latency_ns < IDLE_POLL_MAX_NS ? state->exit_latency_ns : IDLE_POLL_MAX_NS;
+	if (predicted < poll_ns)
+		poll_ns = predicted;
+	if (poll_ns && idle_poll(cpu, now + poll_ns)) {
+		idle_wake_clear(cpu);
+		return;
+	}
+
+	local_irq_disable();
+
+	/* Only states that watch idle_wake can be woken up by it, the rest need the IPI */
+	if (!(state->flags & IDLE_STATE_POLLING) && idle_wake_clear(cpu)) {
+		local_irq_enable();
+		return;
+	}
+	if (cpu->need_resched) {
+		local_irq_enable();
+		idle_wake_clear(cpu);
+		return;
+	}
+
+	state->enter(state);
+	idle_wake_clear(cpu);
+}
+
+void idle_loop(void) {
+	struct cpu* cpu = current_cpu(); /* The idle thread is pinned */
+	while (1) {
+		if (cpu->need_resched) {
+			schedule();
+			continue;
+		}
+
+		tlb_lazy_enter(); /* Nothing here touches memory that can be unmapped, so skip shootdowns */
+		idle_enter(cpu);
+		tlb_lazy_exit();
+	}
+}
+
+static void max_state_init(void) {
+	const char* cmdline_max = cmdline_get("idle.max_state");
+	if (!cmdline_max)
+		return;
+
+	unsigned long long value;
+	int err = kstrtoull(cmdline_max, 0, &value);
+	if (err) {
+		printk(PRINTK_ERR "sched: Failed to parse idle.max_state: %i\n", err);
+		return;
+	}
+
+	max_state = value < IDLE_STATES_MAX ? value : IDLE_STATES_MAX - 1;
+}
+
+void idle_init(void) {
+	timer_always_running = arat_supported();
+	max_state_init();
+
+	/* C1 is always there, firmware can register deeper states later */
+	struct idle_state* state = &default_driver.states[0];
+	if (idle_mwait_usable()) {
+		default_driver.name = "mwait";
+		strlcpy(state->name, "C1 (MWAIT)", sizeof(state->name));
+		state->flags = IDLE_STATE_POLLING;
+		state->enter = idle_enter_mwait;
+		state->data = 0x00; /* C1, no sub-state */
+	} else {
+		default_driver.name = "halt";
+		strlcpy(state->name, "C1 (HLT)", sizeof(state->name));
+		state->enter = idle_enter_halt;
+	}
+	state->exit_latency_ns = 2000;
+	state->target_residency_ns = 2000;
+	default_driver.count = 1;
+
+	assert(idle_driver_register(&default_driver) == 0);
+}
@@ -3,10 +3,13 @@
 #include <lunar/compiler.h>
 #include <lunar/asm/errno.h>
 #include <lunar/sched/scheduler.h>
+#include <lunar/core/cpu.h>
 
 /*
  * NOTES:
- * thread_enqueue, thread_dequeue, pick_next may be called from an atomic context.
+ * thread_enqueue, thread_dequeue, pick_next, steal may be called from an atomic context.
+ * Policies must keep rq->nr_queued equal to the number of threads in their queues.
+ * Policies only ever see SCHED_CLASS_NORMAL threads, real-time threads are handled by sched_rt_ops.
  */
 struct sched_policy_ops {
 	int (*init)(struct runqueue*); /* Initialize the runqueue */
@@ -14,10 +17,14 @@ struct sched_policy_ops {
 	void (*thread_detach)(struct runqueue*, struct thread*); /* Detach a thread from a runqueue */
 	int (*enqueue)(struct runqueue*, struct thread*); /* Add a new thread to the queue */
 	int (*dequeue)(struct runqueue*, struct thread*); /* Remove a thread from the queue */
-	struct thread* (*pick_next)(struct runqueue*); /* Add the current thread to the queue only if running, and return the next thread */
+	void (*put_prev)(struct runqueue*, struct thread*); /* Put the current thread back into the queue, it's still runnable */
+	struct thread* (*pick_next)(struct runqueue*); /* Remove the next thread from the queue and return it, NULL if empty */
 	int (*change_prio)(struct runqueue*, struct thread*, int); /* Change the priority of a thread, returns -errno on failure */
 	bool (*on_tick)(struct runqueue*, struct thread*); /* Happens on a timer interrupt, returns true if should reschedule */
 	void (*on_yield)(struct runqueue*, struct thread*); /* Called when yielding (but not for sleeping/blocking) */
+	struct thread* (*steal)(struct runqueue*, struct cpu*, bool); /* Remove a queued thread that sched_can_migrate() allows, may be NULL */
+	void (*migrate)(struct runqueue*, struct thread*); /* A thread that isn't queued is moving to another CPU, may be NULL */
+	bool (*check_preempt)(struct runqueue*, struct thread*); /* Should a newly queued thread preempt current? NULL compares prio */
 };
 
 struct sched_policy {
@@ -26,8 +33,27 @@ struct sched_policy {
 	size_t thread_priv_size; /* Size of thread->policy_priv, allocated by the core */
 };
 
+#define SCHED_TICK_NS 1000000ll
+#define SCHED_TICK_MAX_DEFER_NS (SCHED_TICK_NS * 64) /* A lone thread still gets a tick this often */
+
 #define __sched_policy __attribute__((section(".schedpolicies"), aligned(8), used))
 
+/* The real-time classes, checked before the runqueue's policy */
+extern const struct sched_policy_ops sched_rt_ops;
+
+static inline bool thread_is_rt(const struct thread* thread) {
+	return thread->sched_class != SCHED_CLASS_NORMAL;
+}
+
+/**
+ * @brief Get the operations for the class a thread is in
+ * @param rq The runqueue the thread is on
+ * @param thread The thread
+ */
+static inline const struct sched_policy_ops* thread_class_ops(struct runqueue* rq, const struct thread* thread) {
+	return thread_is_rt(thread) ? &sched_rt_ops : rq->policy->ops;
+}
+
 void sched_policy_cpu_init(void);
 void preempt_cpu_init(void);
 void procthrd_init(void);
@@ -36,7 +62,230 @@ void ext_context_init(void);
 void kthread_init(struct proc* kernel_proc);
 void workqueue_cpu_init(void);
 void workqueue_init(void);
+
+/**
+ * @brief Tell a worker's pool that it's about to block, so another worker can run
+ *
+ * Called from the scheduler with IRQ's disabled when a worker thread switches out asleep.
+ *
+ * @param thread The worker thread
+ */
+void wq_worker_sleeping(struct thread* thread);
+
+/**
+ * @brief Tell a worker's pool that it's running again
+ * @param thread The worker thread
+ */
+void wq_worker_running(struct thread* thread);
 void reaper_cpu_init(void);
+void idle_init(void);
+
+/**
+ * @brief Check if a thread may be allowed to run on a CPU
+ * @param thread The thread to check
+ * @param cpu The CPU to check
+ */
+static inline bool thread_cpu_allowed(const struct thread* thread, const struct cpu* cpu) {
+	return cpumask_test(&thread->cpu_mask, cpu->sched_processor_id);
+}
+
+/**
+ * @brief Keep a thread on a CPU
+ * @param thread The thread to pin
+ * @param cpu The CPU to pin it to
+ */
+static inline void thread_pin(struct thread* thread, struct cpu* cpu) {
+	cpumask_zero(&thread->cpu_mask);
+	cpumask_set(&thread->cpu_mask, cpu->sched_processor_id);
+}
+
+/**
+ * @brief Get the CPU's threads may run on unless they ask for others
+ *
+ * Every online CPU, except the ones isolated with the sched.isolcpus option.
+ */
+const struct cpumask* sched_default_affinity(void);
+
+/**
+ * @brief Lock two runqueues in an order that can't deadlock
+ *
+ * Call with IRQ's disabled. The CPU's may be the same.
+ *
+ * @param a The first CPU
+ * @param b The second CPU
+ */
+void sched_double_lock(struct cpu* a, struct cpu* b);
+
+/**
+ * @brief Unlock runqueues locked with sched_double_lock
+ * @param a The first CPU
+ * @param b The second CPU
+ */
+void sched_double_unlock(struct cpu* a, struct cpu* b);
+
+/**
+ * @brief Move a thread's accounting from one CPU to another
+ *
+ * Both runqueues must be locked, and the thread must not be in either's queues.
+ *
+ * @param thread The thread to move
+ * @param dst The CPU to move it to
+ */
+static inline void sched_move_thread(struct thread* thread, struct cpu* dst) {
+	struct runqueue* src = &thread->target_cpu->runqueue;
+	const struct sched_policy_ops* ops = thread_class_ops(src, thread);
+	if (ops->migrate)
+		ops->migrate(src, thread);
+
+	atomic_sub_fetch(&src->thread_count, 1);
+	thread->target_cpu = dst;
+	thread->stats.nr_migrations++;
+	atomic_add_fetch(&dst->runqueue.thread_count, 1);
+}
+
+static inline time_t sched_now(void) {
+	struct timespec ts = timekeeper_time();
+	return timespec_to_ns(&ts);
+}
+
+/**
+ * @brief Lock the runqueue a thread is on
+ *
+ * The load balancer can move the thread while waiting on the lock, so this retries until it has the right one.
+ *
+ * @param thread The thread
+ * @param irq Where to save the IRQ state
+ *
+ * @return The locked runqueue
+ */
+struct runqueue* thread_rq_lock(struct thread* thread, irqflags_t* irq);
+
+/**
+ * @brief Note that a thread became runnable, for its wait time and wakeup latency
+ *
+ * Call with the thread's runqueue locked, or after claiming its wakeup.
+ *
+ * @param thread The thread
+ * @param now The current time in nanoseconds
+ * @param woken The thread was woken up, rather than created or preempted
+ */
+static inline void sched_stats_queued(struct thread* thread, time_t now, bool woken) {
+	thread->stats.queued_at = now;
+	thread->stats.woken = woken;
+}
+
+/**
+ * @brief Count the current thread's runtime up to now
+ *
+ * Call with the runqueue locked.
+ *
+ * @param rq The runqueue
+ * @param now The current time in nanoseconds
+ */
+void sched_stats_update_curr(struct runqueue* rq, time_t now);
+
+/**
+ * @brief Account a context switch
+ *
+ * Call with the runqueue locked, before rq->current is changed.
+ *
+ * @param rq The runqueue
+ * @param prev The thread switching out
+ * @param next The thread switching in
+ * @param voluntary prev blocked, slept or exited
+ * @param now The current time in nanoseconds
+ */
+void sched_stats_switch(struct runqueue* rq, struct thread* prev, struct thread* next, bool voluntary, time_t now);
+
+/**
+ * @brief Start the periodic statistics dump, if the sched.stats_interval option is set
+ * @param kernel_proc The kernel process, its threads are included in dumps
+ */
+void sched_stats_init(struct proc* kernel_proc);
+
+/**
+ * @brief Time pbrr_pick_next() and print the cost per pick, if the sched.pbrr_bench option is set
+ *
+ * The option is the number of picks, up to a million. It runs on private runqueues at boot.
+ */
+void pbrr_bench(void);
+
+/**
+ * @brief Check if a queued thread can be moved to another CPU
+ *
+ * The runqueue must be locked.
+ *
+ * @param rq The runqueue the thread is queued on
+ * @param thread The thread to check
+ * @param target The CPU it would move to
+ * @param allow_hot Allow threads that ran recently, and likely still have a warm cache
+ */
+bool sched_can_migrate(struct runqueue* rq, struct thread* thread, struct cpu* target, bool allow_hot);
+
+/**
+ * @brief Check if a newly queued thread should preempt the current one
+ *
+ * The runqueue must be locked.
+ *
+ * @param rq The runqueue the thread was queued on
+ * @param thread The queued thread
+ */
+bool sched_check_preempt(struct runqueue* rq, struct thread* thread);
+
+/**
+ * @brief Pick the CPU a waking thread should be queued on
+ *
+ * Only a hint, the runqueues aren't locked.
+ *
+ * @param thread The thread being woken up
+ * @return The CPU, thread->target_cpu to leave it where it was
+ */
+struct cpu* sched_select_wake_cpu(struct thread* thread);
+
+/**
+ * @brief Pull a thread from the busiest CPU, because this CPU is about to go idle
+ *
+ * Call with IRQ's disabled and no runqueue locks held.
+ *
+ * @param cpu The current CPU
+ * @return true if a thread was pulled into this CPU's runqueue
+ */
+bool sched_balance_idle(struct cpu* cpu);
+
+/**
+ * @brief Periodically even out the load between this CPU and the busiest one
+ *
+ * Called from sched_tick with IRQ's disabled and no runqueue locks held.
+ *
+ * @param cpu The current CPU
+ */
+void sched_balance_tick(struct cpu* cpu);
+
+/**
+ * @brief Timer callback that ends a thread's timed sleep
+ * @param arg The thread
+ */
+void sched_sleep_timeout(void* arg);
+
+/**
+ * @brief Arm the current CPU's timer
+ *
+ * Call with IRQ's disabled.
+ *
+ * @param delay_ns Nanoseconds from now, negative to stop the timer
+ */
+void preempt_timer_arm(time_t delay_ns);
+
+/**
+ * @brief Program the current CPU's timer for its next event
+ *
+ * The next event is the earliest kernel timer, and a tick if threads are waiting for the current one.
+ * Call with the runqueue locked.
+ *
+ * @param cpu The current CPU
+ * @param now The current time in nanoseconds
+ */
+void sched_timer_update(struct cpu* cpu, time_t now);
 
 /**
  * @brief Send a reschedule IPI to a CPU
@@ -122,6 +371,9 @@ struct thread* thread_create(struct proc* proc, size_t stack_size);
 
 /**
  * @brief Destroy a thread
+ *
+ * Threads with a kernel sized stack are kept in the CPU's thread cache if there's room.
+ *
  * @param thread The thread to destroy
  *
  * @reval 0 Success
@@ -129,6 +381,19 @@ struct thread* thread_create(struct proc* proc, size_t stack_size);
  */
 int thread_destroy(struct thread* thread);
 
+#define THREAD_REF_PARKED (1ul << 63) /* In a thread's refcount, the reaper is waiting for the references to drop */
+
+/**
+ * @brief Drop a reference to a thread
+ *
+ * A zombie the reaper parked because of the reference is reaped once the last one is dropped.
+ *
+ * @param thread The thread
+ */
+void thread_put(struct thread* thread);
+
+void thread_free_cache_init(struct thread_free_cache* cache);
+
 /**
  * @brief Set a thread either in kernel mode or user mode
  *
@@ -155,6 +420,27 @@ struct proc* proc_create(void);
  */
 int proc_destroy(struct proc* proc);
 
+/**
+ * @brief Find a process by its PID
+ *
+ * Nothing keeps the process alive, so the caller must know it can't be destroyed.
+ *
+ * @param pid The process ID
+ * @return The process, NULL if there's none with that ID
+ */
+struct proc* proc_find(pid_t pid);
+
+/**
+ * @brief Find a thread in a process by its TID
+ *
+ * Nothing keeps the thread alive, so the caller must know it can't be destroyed.
+ *
+ * @param proc The process to search
+ * @param tid The thread ID
+ * @return The thread, NULL if there's none with that ID
+ */
+struct thread* thread_find(struct proc* proc, tid_t tid);
+
 /**
  * @brief Set the address for the thread to start execution
  * @param thread The thread
@@ -196,6 +482,12 @@ void* ext_ctx_alloc(void);
  */
 void ext_ctx_free(void* ptr);
 
+/**
+ * @brief Put an extended processor context back in its initial state
+ * @param ptr The context
+ */
+void ext_ctx_reset(void* ptr);
+
 /**
  * @brief Switch to another thread
  *
@@ -11,16 +11,21 @@
 #include <lunar/asm/flags.h>
 #include <lunar/lib/format.h>
 #include <lunar/lib/string.h>
-#include <lunar/lib/hashtable.h>
 #include "internal.h"
 
-struct kthread {
-	char name[40];
-	struct thread* thread;
-};
+/*
+ * Kthreads are found through the kernel process' thread IDs, which are looked up without a lock.
+ * Only joinable threads are visible, and they can't be freed until they're detached.
+ */
 
 static struct proc* kproc;
-static struct hashtable* kthread_table;
+
+static struct thread* kthread_find(tid_t id) {
+	struct thread* thread = thread_find(kproc, id);
+	if (!thread || !atomic_load(&thread->joinable))
+		return NULL;
+	return thread;
+}
 
 tid_t kthread_create(int sched_flags, int (*func)(void*), void* arg, const char* fmt, ...) {
 	struct thread* thread = thread_create(kproc, KSTACK_SIZE);
@@ -30,6 +35,8 @@ tid_t kthread_create(int sched_flags, int (*func)(void*), void* arg, const char*
 	thread_set_ring(thread, THREAD_RING_KERNEL);
 	thread_set_exec(thread, asm_kthread_start);
 	thread->target_cpu = sched_decide_cpu(sched_flags);
+	if (sched_flags & (SCHED_THIS_CPU | SCHED_CPU0))
+		thread_pin(thread, thread->target_cpu);
 
 	int err = sched_thread_attach(&thread->target_cpu->runqueue, thread, SCHED_PRIO_DEFAULT);
 	if (err)
@@ -39,25 +46,19 @@ tid_t kthread_create(int sched_flags, int (*func)(void*), void* arg, const char*
 	thread->ctx.general.rdi = (uintptr_t)func;
 	thread->ctx.general.rsi = (uintptr_t)arg;
 
-	/* Now set up the kthread structure */
-	struct kthread kthread_struct;
-	kthread_struct.thread = thread;
 	va_list va;
 	va_start(va, fmt);
-	int count = vsnprintf(kthread_struct.name, sizeof(kthread_struct.name), fmt, va);
+	int count = vsnprintf(thread->name, sizeof(thread->name), fmt, va);
 	if (unlikely(count < 0)) {
 		printk(PRINTK_WARN "sched: vsnprintf format failed on kthread name!\n");
-		strlcpy(kthread_struct.name, "kthread", sizeof(kthread_struct.name));
-	} else if ((size_t)count >= sizeof(kthread_struct.name)) {
+		strlcpy(thread->name, "kthread", sizeof(thread->name));
+	} else if ((size_t)count >= sizeof(thread->name)) {
 		printk(PRINTK_WARN "sched: kthread name too long!\n");
 	}
 	va_end(va);
 
-	/* Make sure there is no collision (very unlikely) */
-	bug(hashtable_search(kthread_table, &thread->id, sizeof(thread->id), &kthread_struct) == 0);
-	err = hashtable_insert(kthread_table, &thread->id, sizeof(thread->id), &kthread_struct);
-	if (err)
-		goto err_hashtable;
+	/* Visible to the other kthread functions from here on */
+	atomic_store(&thread->joinable, true);
 
 	err = sched_enqueue(&thread->target_cpu->runqueue, thread);
 	if (unlikely(err))
@@ -65,8 +66,8 @@ tid_t kthread_create(int sched_flags, int (*func)(void*), void* arg, const char*
 
 	return thread->id;
 err:
-	hashtable_remove(kthread_table, &thread->id, sizeof(thread->id));
-err_hashtable:
+	atomic_store(&thread->joinable, false);
+	atomic_sub_fetch(&thread->refcount, 1);
 	sched_thread_detach(&thread->target_cpu->runqueue, thread);
 err_attach:
 	thread_destroy(thread);
@@ -74,37 +75,28 @@ err_attach:
 }
 
 int kthread_detach(tid_t id) {
-	struct kthread kthread_struct;
-	int err = hashtable_search(kthread_table, &id, sizeof(id), &kthread_struct);
-	if (err == -ENOENT)
-		return -ESRCH;
-	else if (unlikely(err))
-		return err;
+	struct thread* thread = thread_find(kproc, id);
 
-	bug(hashtable_remove(kthread_table, &id, sizeof(id)) != 0);
-	struct thread* thread = kthread_struct.thread;
-	bug(atomic_fetch_sub(&thread->refcount, 1) == 0);
+	/* Only one caller can clear it, the thread may be freed right after */
+	if (!thread || !atomic_exchange(&thread->joinable, false))
+		return -ESRCH;
 
+	thread_put(thread);
 	return 0;
 }
 
 int kthread_wait_for_completion(tid_t id) {
-	struct kthread kthread_struct;
-	int err = hashtable_search(kthread_table, &id, sizeof(id), &kthread_struct);
-	if (err == -ENOENT)
+	struct thread* thread = kthread_find(id);
+	if (!thread)
 		return -ESRCH;
-	else if (unlikely(err))
-		return err;
-
-	struct thread* thread = kthread_struct.thread;
-	while (atomic_load(&thread->state) != THREAD_ZOMBIE)
-		schedule();
 
+	completion_wait(&thread->exited, 0);
 	return 0;
 }
 
 _Noreturn void kthread_exit(int exit) {
 	(void)exit;
+	completion_signal_all(&current_thread()->exited);
 	sched_thread_exit();
 }
 
@@ -122,7 +114,4 @@ __diag_pop();
 
 void kthread_init(struct proc* kernel_proc) {
 	kproc = kernel_proc;
-	kthread_table = hashtable_create(50, sizeof(struct kthread));
-	if (unlikely(!kthread_table))
-		panic("Failed to create kthread hashtable");
 }
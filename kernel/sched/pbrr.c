@@ -1,6 +1,10 @@
 #include <lunar/lib/list.h>
+#include <lunar/lib/convert.h>
 #include <lunar/mm/heap.h>
 #include <lunar/core/cpu.h>
+#include <lunar/core/irq.h>
+#include <lunar/core/printk.h>
+#include <lunar/core/cmdline.h>
 #include "internal.h"
 
 #define PBRR_PRIO_COUNT 32
@@ -8,6 +12,7 @@
 #define PBRR_MAX_PRIO 31
 #define PBRR_PRIO_GROUP_SHIFT 3
 #define DEFAULT_SLICE_TICKS 10
+#define PBRR_BENCH_PICKS_MAX 1000000ull /* The picks run with IRQ's disabled, like the real ones */
 
 struct rr_thread {
 	struct thread* thread;
@@ -16,10 +21,17 @@ struct rr_thread {
 	struct list_node link;
 };
 
+/*
+ * Every priority can be picked prio_weight() times before the lower ones get a turn. Budgets are
+ * refilled lazily: starting a new epoch makes every stale budget count as full.
+ */
 struct rr_runqueue {
 	struct list_head queues[PBRR_PRIO_COUNT];
-	u32 active_bitmap;
-	int prio_budget[PBRR_PRIO_COUNT];
+	u32 active_bitmap; /* Priorities with queued threads */
+	u32 budget_bitmap; /* Priorities with budget left this epoch */
+	u64 epoch;
+	int prio_budget[PBRR_PRIO_COUNT]; /* Only valid if budget_epoch matches epoch */
+	u64 budget_epoch[PBRR_PRIO_COUNT];
 };
 
 /* Sanity check */
@@ -31,8 +43,18 @@ static inline int prio_weight(int p) {
 }
 
 static inline void reset_budgets(struct rr_runqueue* rrq) {
-	for (int p = 0; p < PBRR_PRIO_COUNT; p++)
+	rrq->epoch++;
+	rrq->budget_bitmap = (u32)((1ull << PBRR_PRIO_COUNT) - 1);
+}
+
+/* Take one pick from a priority's budget, refilling it first if it's from an old epoch */
+static inline void consume_budget(struct rr_runqueue* rrq, int p) {
+	if (rrq->budget_epoch[p] != rrq->epoch) {
+		rrq->budget_epoch[p] = rrq->epoch;
 		rrq->prio_budget[p] = prio_weight(p);
+	}
+	if (--rrq->prio_budget[p] == 0)
+		rrq->budget_bitmap &= ~(1ul << p);
 }
 
 static int scale_prio(int posix_prio) {
@@ -62,19 +84,30 @@ static int pbrr_init(struct runqueue* rq) {
 	for (size_t i = 0; i < ARRAY_SIZE(pbrq->queues); i++)
 		list_head_init(&pbrq->queues[i]);
 	pbrq->active_bitmap = 0;
-	reset_budgets(pbrq);
+	reset_budgets(pbrq); /* kzalloc zeroed budget_epoch, so every budget starts out full */
 	return 0;
 }
 
+static inline void queue_add(struct runqueue* rq, struct rr_runqueue* rrq, struct rr_thread* rrt) {
+	list_add_tail(&rrq->queues[rrt->prio], &rrt->link);
+	rrq->active_bitmap |= (1ul << rrt->prio);
+	atomic_add_fetch(&rq->nr_queued, 1);
+}
+
+static inline void queue_remove(struct runqueue* rq, struct rr_runqueue* rrq, struct rr_thread* rrt) {
+	int prio = rrt->prio;
+	list_remove(&rrt->link);
+	if (list_empty(&rrq->queues[prio]))
+		rrq->active_bitmap &= ~(1ul << prio);
+	atomic_sub_fetch(&rq->nr_queued, 1);
+}
+
 static int pbrr_enqueue(struct runqueue* rq, struct thread* thread) {
 	struct rr_thread* rrt = thread->policy_priv;
 	if (list_node_linked(&rrt->link))
 		return -EALREADY;
 
-	struct rr_runqueue* rrq = rq->policy_priv;
-	list_add_tail(&rrq->queues[rrt->prio], &rrt->link);
-	rrq->active_bitmap |= (1ul << rrt->prio);
-
+	queue_add(rq, rq->policy_priv, rrt);
 	return 0;
 }
 
@@ -83,82 +116,53 @@ static int pbrr_dequeue(struct runqueue* rq, struct thread* thread) {
 	if (!list_node_linked(&rrt->link))
 		return -ENOENT;
 
-	struct rr_runqueue* rrq = rq->policy_priv;
-	int prio = rrt->prio;
-	list_remove(&rrt->link);
-	if (list_empty(&rrq->queues[prio]))
-		rrq->active_bitmap &= ~(1ul << prio);
-
+	queue_remove(rq, rq->policy_priv, rrt);
 	return 0;
 }
 
-static int highest_ready_prio_budget(struct rr_runqueue* rrq) {
-	unsigned long bm = rrq->active_bitmap;
-	while (bm) {
-		int p = (int)((sizeof(unsigned long) * 8) - 1 - __builtin_clzl(bm));
-		if (rrq->prio_budget[p] > 0)
-			return p;
-		bm &= ~(1ul << p);
-	}
-
-	return -1;
-}
-
-static inline int highest_ready_prio(unsigned long bm) {
+static inline int highest_ready_prio(u32 bm) {
 	if (!bm)
 		return -1;
-	return (int)((sizeof(unsigned long) * 8) - 1 - __builtin_clzl(bm));
+	return 31 - __builtin_clz(bm);
 }
 
-static struct rr_thread* pop_head_and_maybe_clear(struct rr_runqueue* rrq, int prio) {
+static struct rr_thread* pop_head_and_maybe_clear(struct runqueue* rq, struct rr_runqueue* rrq, int prio) {
 	struct list_head* head = &rrq->queues[prio];
 	if (list_empty(head))
 		return NULL;
 
-	struct list_node* node = head->node.next;
-	list_remove(node);
-
-	struct rr_thread* rrt = container_of(node, struct rr_thread, link);
-	if (list_empty(head))
-		rrq->active_bitmap &= ~(1ul << prio);
-
+	struct rr_thread* rrt = list_first_entry(head, struct rr_thread, link);
+	queue_remove(rq, rrq, rrt);
 	return rrt;
 }
 
-static struct thread* pbrr_pick_next(struct runqueue* rq) {
-	struct rr_runqueue* rrq = rq->policy_priv;
-
-	struct thread* current = rq->current;
+static void pbrr_put_prev(struct runqueue* rq, struct thread* current) {
+	/* Place current thread at the end of the list and mark the priority as active */
 	struct rr_thread* crt = current->policy_priv;
-	int state = atomic_load(&current->state);
-	bool runnable = (state == THREAD_RUNNING || state == THREAD_READY);
+	if (!list_node_linked(&crt->link))
+		queue_add(rq, rq->policy_priv, crt);
+}
 
-	/* Place current thread at the end of the list and mark the priority as active */
-	if (runnable && !list_node_linked(&crt->link) && current != rq->idle) {
-		int p = crt->prio;
-		list_add_tail(&rrq->queues[p], &crt->link);
-		rrq->active_bitmap |= 1ul << p;
-	}
+static struct thread* pbrr_pick_next(struct runqueue* rq) {
+	struct rr_runqueue* rrq = rq->policy_priv;
 
-	/* Make sure budgets are reset */
-	if (unlikely(rrq->prio_budget[0] == 0))
+	/* The lowest priority used up its budget, or every queued one did, so start a new round */
+	if (unlikely(!(rrq->budget_bitmap & 1)))
 		reset_budgets(rrq);
 
-	int p = highest_ready_prio_budget(rrq);
+	int p = highest_ready_prio(rrq->active_bitmap & rrq->budget_bitmap);
 	if (p < 0) {
-		reset_budgets(rrq); /* All active had empty budgets, so reset them */
-		p = highest_ready_prio_budget(rrq);
-		if (p < 0) /* No threads to schedule */ 
+		reset_budgets(rrq);
+		p = highest_ready_prio(rrq->active_bitmap);
+		if (p < 0) /* No threads to schedule */
 			return NULL;
 	}
 
 	/* Pop a thread from the priority queue */
-	struct rr_thread* next_rrt = pop_head_and_maybe_clear(rrq, p);
+	struct rr_thread* next_rrt = pop_head_and_maybe_clear(rq, rrq, p);
 	bug(next_rrt == NULL); /* Well, I guess the bitmap lied to us!! */
 
-	if (rrq->prio_budget[p] > 0)
-		rrq->prio_budget[p]--;
-
+	consume_budget(rrq, p);
 	next_rrt->slice_left = DEFAULT_SLICE_TICKS;
 	return next_rrt->thread;
 }
@@ -199,23 +203,123 @@ static bool pbrr_on_tick(struct runqueue* rq, struct thread* current) {
 }
 
 static void pbrr_on_yield(struct runqueue* rq, struct thread* current) {
-	(void)rq; /* pbrr_pick_next already adds to the end of the queue */
+	(void)rq; /* pbrr_put_prev already adds to the end of the queue */
 	struct rr_thread* rr_current = current->policy_priv;
 	rr_current->slice_left = DEFAULT_SLICE_TICKS;
 }
 
+static struct thread* pbrr_steal(struct runqueue* rq, struct cpu* target, bool allow_hot) {
+	struct rr_runqueue* rrq = rq->policy_priv;
+
+	/* Lowest priorities first, and from the tail, since those would wait the longest here */
+	unsigned long bm = rrq->active_bitmap;
+	while (bm) {
+		int p = __builtin_ctzl(bm);
+		bm &= ~(1ul << p);
+
+		struct rr_thread* rrt;
+		list_for_each_entry_reverse(rrt, &rrq->queues[p], link) {
+			if (!sched_can_migrate(rq, rrt->thread, target, allow_hot))
+				continue;
+			queue_remove(rq, rrq, rrt);
+			return rrt->thread;
+		}
+	}
+
+	return NULL;
+}
+
 static const struct sched_policy_ops pbrr_ops = {
 	.init = pbrr_init,
 	.thread_attach = pbrr_thread_attach,
 	.thread_detach = NULL,
 	.enqueue = pbrr_enqueue,
 	.dequeue = pbrr_dequeue,
+	.put_prev = pbrr_put_prev,
 	.pick_next = pbrr_pick_next,
 	.change_prio = pbrr_change_prio,
 	.on_tick = pbrr_on_tick,
-	.on_yield = pbrr_on_yield
+	.on_yield = pbrr_on_yield,
+	.steal = pbrr_steal
 };
 
+/* Pick with prio_count priorities queued, the picked thread goes straight back like a preempted one would */
+static int bench_picks(struct thread* threads, unsigned int prio_count, u64 picks) {
+	struct runqueue* rq = kzalloc(sizeof(*rq), MM_ZONE_NORMAL);
+	if (!rq)
+		return -ENOMEM;
+	int err = pbrr_init(rq);
+	if (err) {
+		kfree(rq);
+		return err;
+	}
+
+	/* Spread over the whole range, so every weight group takes part */
+	for (unsigned int i = 0; i < prio_count; i++) {
+		struct rr_thread* rrt = threads[i].policy_priv;
+		rrt->prio = PBRR_MAX_PRIO - i * PBRR_PRIO_COUNT / prio_count;
+		list_node_init(&rrt->link);
+		queue_add(rq, rq->policy_priv, rrt);
+	}
+
+	irqflags_t irq = local_irq_save();
+	time_t start = sched_now();
+	for (u64 i = 0; i < picks; i++)
+		pbrr_put_prev(rq, pbrr_pick_next(rq));
+	time_t elapsed = sched_now() - start;
+	local_irq_restore(irq);
+
+	/* In tenths of a nanosecond, a pick only takes a few */
+	u64 per_pick = (u64)elapsed * 10 / picks;
+	printk(PRINTK_INFO "sched: pbrr_pick_next with %u priorities queued: %lu.%lu ns per pick over %lu picks\n",
+			prio_count, per_pick / 10, per_pick % 10, picks);
+
+	kfree(rq->policy_priv);
+	kfree(rq);
+	return 0;
+}
+
+void pbrr_bench(void) {
+	const char* cmdline_picks = cmdline_get("sched.pbrr_bench");
+	if (!cmdline_picks)
+		return;
+
+	unsigned long long picks;
+	int err = kstrtoull(cmdline_picks, 0, &picks);
+	if (err) {
+		printk(PRINTK_ERR "sched: Failed to parse sched.pbrr_bench: %i\n", err);
+		return;
+	}
+	if (picks == 0)
+		return;
+	if (picks > PBRR_BENCH_PICKS_MAX)
+		picks = PBRR_BENCH_PICKS_MAX;
+
+	/* Only the fields the policy touches are set up, the threads never run */
+	struct thread* threads = kzalloc(sizeof(*threads) * PBRR_PRIO_COUNT, MM_ZONE_NORMAL);
+	struct rr_thread* rrts = kzalloc(sizeof(*rrts) * PBRR_PRIO_COUNT, MM_ZONE_NORMAL);
+	if (threads && rrts) {
+		for (unsigned int i = 0; i < PBRR_PRIO_COUNT; i++) {
+			threads[i].policy_priv = &rrts[i];
+			rrts[i].thread = &threads[i];
+		}
+
+		/* The worst case for the old bitmap walk, and the common one */
+		err = bench_picks(threads, PBRR_PRIO_COUNT, picks);
+		if (!err)
+			err = bench_picks(threads, 2, picks);
+	} else {
+		err = -ENOMEM;
+	}
+	if (err)
+		printk(PRINTK_ERR "sched: Failed to run the pbrr benchmark: %i\n", err);
+
+	if (threads)
+		kfree(threads);
+	if (rrts)
+		kfree(rrts);
+}
+
 static struct sched_policy __sched_policy pbrr = {
 	.name = "pbrr",
 	.desc = "Priority-based round robin",
@@ -246,10 +350,12 @@ static const struct sched_policy_ops rr_ops = {
 	.thread_detach = NULL,
 	.enqueue = pbrr_enqueue,
 	.dequeue = pbrr_dequeue,
+	.put_prev = pbrr_put_prev,
 	.pick_next = pbrr_pick_next,
 	.change_prio = rr_change_prio,
 	.on_tick = pbrr_on_tick,
-	.on_yield = pbrr_on_yield
+	.on_yield = pbrr_on_yield,
+	.steal = pbrr_steal
 };
 
 static struct sched_policy __sched_policy rr = {
@@ -1,6 +1,8 @@
 #include <lunar/types.h>
 #include <lunar/common.h>
 #include <lunar/asm/segment.h>
+#include <lunar/asm/cpuid.h>
+#include <lunar/asm/msr.h>
 #include <lunar/core/cpu.h>
 #include <lunar/core/io.h>
 #include <lunar/core/apic.h>
@@ -12,21 +14,82 @@
 #include <lunar/mm/vmm.h>
 #include "internal.h"
 
-#define TIMER_TRIGGER_TIME_USEC 1000u
+#define TIMER_TRIGGER_TIME_USEC ((u32)(SCHED_TICK_NS / 1000))
+#define TIMER_MAX_DELAY_NS 1000000000ll /* Keeps the count math from overflowing, sched_tick arms it again */
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
 
-static u32 lapic_timer_get_ticks_for_preempt(void) {
+static inline u64 rdtsc(void) {
+	u32 low, high;
+	__asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((u64)high << 32) | low;
+}
+
+/* The deadline is in TSC counts, so the TSC must tick at a constant rate */
+static bool tsc_deadline_usable(void) {
+	u32 eax, ecx, edx, _unused;
+	cpuid(CPUID_LEAF_FEATURE_BITS, 0, &_unused, &_unused, &ecx, &_unused);
+	if (!(ecx & (1 << 24)))
+		return false;
+
+	cpuid(CPUID_EXT_LEAF_HIGHEST_FUNCTION, 0, &eax, &_unused, &_unused, &_unused);
+	if (eax < CPUID_EXT_LEAF_PM_FEATURES)
+		return false;
+	cpuid(CPUID_EXT_LEAF_PM_FEATURES, 0, &_unused, &_unused, &_unused, &edx);
+	return (edx & (1 << 8)) != 0;
+}
+
+/* Measures both the LAPIC timer and the TSC over one tick */
+static u32 lapic_timer_get_ticks_for_preempt(u64* tsc_ticks) {
 	lapic_write(LAPIC_REG_TIMER_DIVIDE, 0x03); /* Set the divisor to 16 */
+	u64 tsc_start = rdtsc();
 	lapic_write(LAPIC_REG_TIMER_INITIAL, U32_MAX); /* Set the initial count to the maximum */
 	timekeeper_stall(TIMER_TRIGGER_TIME_USEC);
 	lapic_write(LAPIC_REG_LVT_TIMER, 1 << 16); /* Stop timer */
+	*tsc_ticks = rdtsc() - tsc_start;
 
 	/* Now just return the difference of the initial count and the current count */
 	return U32_MAX - lapic_read(LAPIC_REG_TIMER_CURRENT); 
 }
 
+void preempt_timer_arm(time_t delay_ns) {
+	struct cpu* cpu = current_cpu();
+	if (cpu->tsc_deadline_ticks) {
+		if (delay_ns < 0) {
+			wrmsr(MSR_TSC_DEADLINE, 0); /* Disarms it */
+			return;
+		}
+		if (delay_ns > TIMER_MAX_DELAY_NS)
+			delay_ns = TIMER_MAX_DELAY_NS;
+
+		/* A deadline that already passed fires right away */
+		wrmsr(MSR_TSC_DEADLINE, rdtsc() + (u64)delay_ns * cpu->tsc_deadline_ticks / SCHED_TICK_NS);
+		return;
+	}
+
+	if (delay_ns < 0) {
+		lapic_write(LAPIC_REG_TIMER_INITIAL, 0); /* Stops a one-shot timer */
+		return;
+	}
+	if (delay_ns > TIMER_MAX_DELAY_NS)
+		delay_ns = TIMER_MAX_DELAY_NS;
+
+	u64 count = (u64)delay_ns * cpu->lapic_timer_ticks / SCHED_TICK_NS;
+	if (count == 0)
+		count = 1;
+	if (count > U32_MAX)
+		count = U32_MAX;
+	lapic_write(LAPIC_REG_TIMER_INITIAL, (u32)count);
+}
+
 static void lapic_timer(struct isr* isr, struct context* ctx) {
 	(void)isr;
 	(void)ctx;
+
+	/* 
+	 * Keep ticking in case the softirq doesn't run right away (or at all before the scheduler
+	 * is up), sched_tick replaces this with the real next event.
+	 */
+	preempt_timer_arm(SCHED_TICK_NS);
 	raise_softirq(SOFTIRQ_TIMER);
 }
 
@@ -40,13 +103,26 @@ void preempt_cpu_init(void) {
 		interrupt_register(lapic_timer_isr, lapic_timer, apic_set_irq, -1, NULL, false);
 	}
 
-	u32 ticks = lapic_timer_get_ticks_for_preempt();
-	lapic_write(LAPIC_REG_LVT_TIMER, interrupt_get_vector(lapic_timer_isr) | (1 << 17));
-	lapic_write(LAPIC_REG_TIMER_DIVIDE, 0x03);
-	lapic_write(LAPIC_REG_TIMER_INITIAL, ticks);
+	/*
+	 * One-shot or TSC-deadline mode, every event is programmed by sched_timer_update(). The deadline
+	 * is a single MSR write instead of an APIC access, and doesn't drift with the LAPIC timer's clock.
+	 */
+	u64 tsc_ticks;
+	u32 ticks = lapic_timer_get_ticks_for_preempt(&tsc_ticks);
+	current_cpu()->lapic_timer_ticks = ticks;
+	if (tsc_deadline_usable() && tsc_ticks) {
+		lapic_write(LAPIC_REG_LVT_TIMER, interrupt_get_vector(lapic_timer_isr) | LAPIC_TIMER_TSC_DEADLINE);
+		__asm__ volatile("mfence" : : : "memory"); /* The mode switch must land before the first MSR write */
+		current_cpu()->tsc_deadline_ticks = tsc_ticks;
+	} else {
+		lapic_write(LAPIC_REG_LVT_TIMER, interrupt_get_vector(lapic_timer_isr));
+		lapic_write(LAPIC_REG_TIMER_DIVIDE, 0x03);
+	}
+	preempt_timer_arm(SCHED_TICK_NS);
 
-	printk(PRINTK_DBG "sched: LAPIC timer calibrated at %u ticks per %u us on CPU %u\n", 
-			ticks, TIMER_TRIGGER_TIME_USEC, current_cpu()->sched_processor_id);
+	printk(PRINTK_DBG "sched: LAPIC timer calibrated at %u ticks per %u us on CPU %u%s\n", 
+			ticks, TIMER_TRIGGER_TIME_USEC, current_cpu()->sched_processor_id,
+			current_cpu()->tsc_deadline_ticks ? ", using the TSC deadline" : "");
 	if (current_cpu()->sched_processor_id == 0)
 		bug(register_softirq(sched_tick, SOFTIRQ_TIMER) != 0);
 }
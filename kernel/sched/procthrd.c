@@ -6,7 +6,9 @@
 #include <lunar/core/cpu.h>
 #include <lunar/core/trace.h>
 #include <lunar/core/mutex.h>
+#include <lunar/core/cmdline.h>
 #include <lunar/lib/string.h>
+#include <lunar/lib/convert.h>
 #include <lunar/mm/slab.h>
 #include <lunar/mm/heap.h>
 #include "internal.h"
@@ -17,91 +19,172 @@
 static struct slab_cache* proc_cache;
 static struct slab_cache* thread_cache;
 
-static u8* pid_map = NULL;
-static SPINLOCK_DEFINE(pid_lock);
+static struct idr pids;
 static const pid_t pid_max = 0x10000;
 static const tid_t tid_max = 0x10000;
 
-static long long alloc_id(u8* map, long long max) {
-	for (long long id = 0; id < max; id++) {
-		size_t byte = id >> 3;
-		unsigned int bit = id & 7;
-		if ((map[byte] & (1 << bit)) == 0) {
-			map[byte] |= (1 << bit);
-			return id;
-		}
-	}
+/* How many threads each CPU keeps around by default, can be changed with sched.thread_cache */
+#define THREAD_CACHE_DEFAULT 8
 
-	return max;
-}
+static unsigned long thread_free_cache_max = THREAD_CACHE_DEFAULT;
 
-static inline void free_id(u8* map, long long id, long long max) {
-	assert(id <= max);
-	size_t byte = id >> 3;
-	unsigned int bit = id & 7;
-	map[byte] &= ~(1 << bit);
+static void thread_free_stack(u8* stack, size_t stack_size) {
+	const size_t stack_total = stack_size + THREAD_STACK_GUARD_SIZE;
+	if (stack_size == KSTACK_SIZE)
+		assert(vunmap_kstack(stack + stack_total) == 0);
+	else
+		assert(vunmap(stack, stack_total, VMM_LAZY) == 0);
 }
 
-struct thread* thread_create(struct proc* proc, size_t stack_size) {
+/* Allocate a thread along with its stack and extended context */
+static struct thread* thread_alloc(size_t stack_size) {
 	struct thread* thread = slab_cache_alloc(thread_cache);
 	if (!thread)
 		return NULL;
 
-	thread->id = alloc_id(proc->tid_map, tid_max);
-	if (unlikely(thread->id == tid_max))
-		goto err_id;
+	const size_t stack_total = stack_size + THREAD_STACK_GUARD_SIZE;
+	if (stack_size == KSTACK_SIZE) {
+		/* Same layout as a kernel stack, so it can come from the stack cache */
+		u8* stack = vmap_kstack();
+		thread->stack = stack ? stack - stack_total : NULL;
+		if (!thread->stack)
+			goto err_stack;
+	} else {
+		thread->stack = vmap(NULL, stack_total, MMU_READ | MMU_WRITE, VMM_ALLOC, NULL);
+		if (!thread->stack)
+			goto err_stack;
+		assert(vprotect(thread->stack, THREAD_STACK_GUARD_SIZE, MMU_NONE, 0) == 0); /* guard page */
+	}
+	thread->stack_size = stack_size;
 
-	thread->target_cpu = NULL; /* Let the scheduler decide what CPU to schedule on */
-	thread->proc = proc;
-	thread->cpu_mask = ULONG_MAX;
-	atomic_store(&thread->state, THREAD_NEW);
+	thread->ctx.extended = ext_ctx_alloc();
+	if (!thread->ctx.extended)
+		goto err_ctx;
 
+	return thread;
+err_ctx:
+	thread_free_stack(thread->stack, stack_size);
+err_stack:
+	slab_cache_free(thread_cache, thread);
+	return NULL;
+}
+
+static void thread_free(struct thread* thread) {
+	thread_free_stack(thread->stack, thread->stack_size);
+	ext_ctx_free(thread->ctx.extended);
+	slab_cache_free(thread_cache, thread);
+}
+
+void thread_free_cache_init(struct thread_free_cache* cache) {
+	list_head_init(&cache->threads);
+	cache->count = 0;
+	spinlock_init(&cache->lock);
+}
+
+static struct thread* thread_free_cache_get(void) {
+	irqflags_t irq = local_irq_save();
+	struct thread_free_cache* cache = &current_cpu()->runqueue.free_threads;
+
+	spinlock_lock(&cache->lock);
+	struct thread* thread = NULL;
+	if (!list_empty(&cache->threads)) {
+		thread = list_first_entry(&cache->threads, struct thread, proc_link);
+		list_remove(&thread->proc_link);
+		cache->count--;
+	}
+	spinlock_unlock(&cache->lock);
+
+	local_irq_restore(irq);
+	return thread;
+}
+
+/* Keep a thread with its stack and extended context, or free it if it doesn't fit */
+static void thread_release(struct thread* thread) {
+	if (thread->stack_size != KSTACK_SIZE) {
+		thread_free(thread);
+		return;
+	}
+
+	/* Only threads that used the FPU touched theirs */
+	if (thread->fpu_used)
+		ext_ctx_reset(thread->ctx.extended);
+
+	irqflags_t irq = local_irq_save();
+	struct thread_free_cache* cache = &current_cpu()->runqueue.free_threads;
+
+	spinlock_lock(&cache->lock);
+	bool cached = cache->count < thread_free_cache_max;
+	if (cached) {
+		list_add(&cache->threads, &thread->proc_link);
+		cache->count++;
+	}
+	spinlock_unlock(&cache->lock);
+
+	local_irq_restore(irq);
+	if (!cached)
+		thread_free(thread);
+}
+
+struct thread* thread_create(struct proc* proc, size_t stack_size) {
 	if (stack_size & (PAGE_SIZE - 1)) {
 		printk(PRINTK_WARN "sched: stack size not a multiple of page size!\n");
 		stack_size = ROUND_UP(stack_size, PAGE_SIZE);
 	}
-	const size_t stack_total = stack_size + THREAD_STACK_GUARD_SIZE;
-	thread->stack = vmap(NULL, stack_total, MMU_READ | MMU_WRITE, VMM_ALLOC, NULL);
-	if (!thread->stack)
-		goto err_stack;
-	assert(vprotect(thread->stack, THREAD_STACK_GUARD_SIZE, MMU_NONE, 0) == 0); /* guard page */
-	thread->stack_size = stack_size;
+
+	struct thread* thread = stack_size == KSTACK_SIZE ? thread_free_cache_get() : NULL;
+	if (!thread) {
+		thread = thread_alloc(stack_size);
+		if (!thread)
+			return NULL;
+	}
+
+	/* Lookups by ID can find it as soon as it has one, so it can't look like a kthread yet */
+	atomic_store(&thread->joinable, false);
+	thread->name[0] = '\0';
+	completion_init(&thread->exited);
+	thread->worker = NULL;
+	memset(&thread->stats, 0, sizeof(thread->stats));
+
+	long id = idr_alloc(&proc->tids, thread);
+	if (unlikely(id < 0)) {
+		thread->fpu_used = false;
+		thread_release(thread);
+		return NULL;
+	}
+	thread->id = id;
+
+	thread->target_cpu = NULL; /* Let the scheduler decide what CPU to schedule on */
+	thread->proc = proc;
+	thread->cpu_mask = *sched_default_affinity();
+	thread->sched_class = SCHED_CLASS_NORMAL;
+	atomic_store(&thread->state, THREAD_NEW);
 
 	memset(&thread->ctx.general, 0, sizeof(thread->ctx.general));
 	thread->ctx.thread_local = NULL; /* unused for now */
-	thread->ctx.extended = ext_ctx_alloc();
-	if (!thread->ctx.extended)
-		goto err_ctx;
 
 	thread->preempt_count = 0;
+	thread->fpu_used = false;
 	
 	list_node_init(&thread->proc_link);
-	list_node_init(&thread->sleep_link);
+	timer_init(&thread->sleep_timer, sched_sleep_timeout, thread);
 	list_node_init(&thread->zombie_link);
 	list_node_init(&thread->block_link);
+	list_node_init(&thread->rt.link);
 
 	thread->ctx.general.rflags = RFLAGS_DEFAULT;
-	thread->ctx.general.rsp = (u8*)thread->stack + stack_total;
+	thread->ctx.general.rsp = (u8*)thread->stack + stack_size + THREAD_STACK_GUARD_SIZE;
 
 	atomic_store(&thread->refcount, 0);
 	return thread;
-err_ctx:
-	assert(vunmap(thread->stack, stack_total, 0) == 0);
-err_stack:
-	free_id(proc->tid_map, thread->id, tid_max);
-err_id:
-	return NULL;
 }
 
 int thread_destroy(struct thread* thread) {
 	if (atomic_load(&thread->refcount) != 0)
 		return -EBUSY;
 
-	const size_t stack_total = thread->stack_size + THREAD_STACK_GUARD_SIZE;
-	assert(vunmap(thread->stack, stack_total, 0) == 0);
-	free_id(thread->proc->tid_map, thread->id, tid_max);
-	ext_ctx_free(thread->ctx.extended);
-	slab_cache_free(thread_cache, thread);
+	timer_cancel_sync(&thread->sleep_timer); /* The callback may still be running on another CPU */
+	idr_remove(&thread->proc->tids, thread->id);
+	thread_release(thread);
 
 	return 0;
 }
@@ -128,24 +211,16 @@ struct proc* proc_create(void) {
 	if (!proc)
 		return NULL;
 
-	irqflags_t irq;
-	spinlock_lock_irq_save(&pid_lock, &irq);
-	proc->pid = alloc_id(pid_map, pid_max);
-	spinlock_unlock_irq_restore(&pid_lock, &irq);
-
-	if (unlikely(proc->pid == pid_max)) {
+	long pid = idr_alloc(&pids, proc);
+	if (unlikely(pid < 0)) {
 		slab_cache_free(proc_cache, proc);
 		return NULL;
 	}
-
+	proc->pid = pid;
 	proc->mm_struct = NULL;
 
-	proc->tid_map = kzalloc((tid_max + 7) >> 3, MM_ZONE_NORMAL);
-	if (!proc->tid_map) {
-		free_id(pid_map, proc->pid, pid_max);
-		slab_cache_free(proc_cache, proc);
-		return NULL;
-	}
+	/* Nodes are only allocated once threads are created */
+	idr_init(&proc->tids, tid_max);
 
 	list_head_init(&proc->threads);
 	atomic_store(&proc->thread_count, 0);
@@ -158,16 +233,21 @@ int proc_destroy(struct proc* proc) {
 	if (atomic_load(&proc->thread_count))
 		return -EBUSY;
 
-	irqflags_t irq;
-	spinlock_lock_irq_save(&pid_lock, &irq);
-	free_id(pid_map, proc->pid, pid_max);
-	spinlock_unlock_irq_restore(&pid_lock, &irq);
-	kfree(proc->tid_map);
+	idr_remove(&pids, proc->pid);
+	idr_destroy(&proc->tids);
 
 	slab_cache_free(proc_cache, proc);
 	return 0;
 }
 
+struct proc* proc_find(pid_t pid) {
+	return idr_find(&pids, pid);
+}
+
+struct thread* thread_find(struct proc* proc, tid_t tid) {
+	return idr_find(&proc->tids, tid);
+}
+
 int thread_attach_to_proc(struct thread* thread) {
 	struct proc* proc = thread->proc;
 	irqflags_t irq;
@@ -208,10 +288,18 @@ err:
 void procthrd_init(void) {
 	proc_cache = slab_cache_create(sizeof(struct proc), _Alignof(struct proc), MM_ZONE_NORMAL, NULL, NULL);
 	assert(proc_cache != NULL);
-	const size_t pid_map_size = (pid_max + 7) >> 3;
-	pid_map = vmap(NULL, pid_map_size, MMU_READ | MMU_WRITE, VMM_ALLOC, NULL);
-	assert(pid_map != NULL);
+	idr_init(&pids, pid_max);
 
 	thread_cache = slab_cache_create(sizeof(struct thread), _Alignof(struct thread), MM_ZONE_NORMAL, NULL, NULL);
 	assert(thread_cache != NULL);
+
+	const char* cmdline_max = cmdline_get("sched.thread_cache");
+	if (cmdline_max) {
+		unsigned long long max;
+		int err = kstrtoull(cmdline_max, 0, &max);
+		if (err)
+			printk(PRINTK_ERR "sched: Failed to parse sched.thread_cache: %i\n", err);
+		else
+			thread_free_cache_max = max;
+	}
 }
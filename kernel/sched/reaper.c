@@ -5,10 +5,37 @@
 #include "internal.h"
 
 static inline void reap_thread(struct runqueue* rq, struct thread* thread) {
+	atomic_store(&thread->refcount, 0); /* Clear THREAD_REF_PARKED */
 	sched_thread_detach(rq, thread);
 	thread_destroy(thread);
 }
 
+/* Mark a zombie as waiting for its references to drop, unless there are none */
+static bool park_zombie(struct thread* thread) {
+	unsigned long ref = atomic_load(&thread->refcount);
+	while (ref != 0) {
+		if (atomic_compare_exchange_weak(&thread->refcount, &ref, ref | THREAD_REF_PARKED))
+			return true;
+	}
+
+	return false;
+}
+
+void thread_put(struct thread* thread) {
+	unsigned long ref = atomic_load(&thread->refcount);
+	while (1) {
+		bug((ref & ~THREAD_REF_PARKED) == 0);
+
+		/* A parked zombie doesn't move, and can't be reaped before this reference is dropped */
+		struct cpu* cpu = thread->target_cpu;
+		if (atomic_compare_exchange_weak(&thread->refcount, &ref, ref - 1)) {
+			if (ref - 1 == THREAD_REF_PARKED)
+				semaphore_signal(&cpu->runqueue.reaper_sem);
+			return;
+		}
+	}
+}
+
 static int reaper_thread(void* arg) {
 	(void)arg;
 
@@ -19,29 +46,40 @@ static int reaper_thread(void* arg) {
 	while (init_status_get() < INIT_STATUS_SCHED)
 		cpu_relax();
 
-	irqflags_t irq;
 	struct runqueue* rq = &current_cpu()->runqueue;
-	bool sleep = true;
+	struct list_head parked; /* Zombies that are still referenced, only touched by this thread */
+	list_head_init(&parked);
 	while (1) {
-		if (sleep)
-			semaphore_wait(&rq->reaper_sem, 0);
+		semaphore_wait(&rq->reaper_sem, 0);
+
+		/* Every zombie signals once, and they're all taken at once below */
+		while (semaphore_try(&rq->reaper_sem))
+			;
 
-		struct thread* victim = NULL;
+		struct list_head zombies;
+		list_head_init(&zombies);
+
+		irqflags_t irq;
 		spinlock_lock_irq_save(&rq->zombie_lock, &irq);
+		list_splice_init(&rq->zombies, &zombies);
+		spinlock_unlock_irq_restore(&rq->zombie_lock, &irq);
 
-		sleep = list_empty(&rq->zombies);
-		if (!sleep) {
-			victim = list_first_entry(&rq->zombies, struct thread, zombie_link);
-			list_remove(&victim->zombie_link);
-			if (atomic_load(&victim->refcount) > 0) {
-				list_add_tail(&rq->zombies, &victim->zombie_link);
-				victim = NULL;
-			}
+		struct thread* thread, *tmp;
+		list_for_each_entry_safe(thread, tmp, &zombies, zombie_link) {
+			list_remove(&thread->zombie_link);
+			if (park_zombie(thread))
+				list_add_tail(&parked, &thread->zombie_link);
+			else
+				reap_thread(rq, thread);
 		}
 
-		spinlock_unlock_irq_restore(&rq->zombie_lock, &irq);
-		if (victim)
-			reap_thread(rq, victim);
+		/* The last thread_put() on a parked zombie signals this thread */
+		list_for_each_entry_safe(thread, tmp, &parked, zombie_link) {
+			if (atomic_load(&thread->refcount) == THREAD_REF_PARKED) {
+				list_remove(&thread->zombie_link);
+				reap_thread(rq, thread);
+			}
+		}
 	}
 
 	kthread_exit(0);
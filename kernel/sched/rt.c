@@ -0,0 +1,170 @@
+#include <lunar/lib/list.h>
+#include <lunar/core/cpu.h>
+#include "internal.h"
+
+/*
+ * Real-time classes. Every priority has a FIFO list, and the highest non-empty one always runs.
+ * SCHED_CLASS_RR threads additionally take turns with others of the same priority.
+ */
+
+#define RT_RR_SLICE_TICKS 10
+
+static inline struct thread* rt_entry(struct list_node* node) {
+	return container_of(node, struct thread, rt.link);
+}
+
+static int highest_prio(const struct sched_rt_runqueue* rtq) {
+	for (int i = ARRAY_SIZE(rtq->bitmap) - 1; i >= 0; i--) {
+		if (rtq->bitmap[i])
+			return i * 64 + 63 - __builtin_clzll(rtq->bitmap[i]);
+	}
+
+	return -1;
+}
+
+static void queue_add(struct runqueue* rq, struct thread* thread, bool head) {
+	struct sched_rt_runqueue* rtq = &rq->rt;
+	int prio = thread->rt.prio;
+	if (head)
+		list_add(&rtq->queues[prio], &thread->rt.link);
+	else
+		list_add_tail(&rtq->queues[prio], &thread->rt.link);
+	rtq->bitmap[prio / 64] |= 1ull << (prio % 64);
+	atomic_add_fetch(&rq->nr_queued, 1);
+}
+
+static void queue_remove(struct runqueue* rq, struct thread* thread) {
+	struct sched_rt_runqueue* rtq = &rq->rt;
+	int prio = thread->rt.prio;
+	list_remove(&thread->rt.link);
+	if (list_empty(&rtq->queues[prio]))
+		rtq->bitmap[prio / 64] &= ~(1ull << (prio % 64));
+	atomic_sub_fetch(&rq->nr_queued, 1);
+}
+
+static int rt_init(struct runqueue* rq) {
+	struct sched_rt_runqueue* rtq = &rq->rt;
+	for (size_t i = 0; i < ARRAY_SIZE(rtq->queues); i++)
+		list_head_init(&rtq->queues[i]);
+	for (size_t i = 0; i < ARRAY_SIZE(rtq->bitmap); i++)
+		rtq->bitmap[i] = 0;
+	return 0;
+}
+
+static int rt_enqueue(struct runqueue* rq, struct thread* thread) {
+	if (list_node_linked(&thread->rt.link))
+		return -EALREADY;
+
+	thread->rt.requeue_tail = false;
+	queue_add(rq, thread, false);
+	return 0;
+}
+
+static int rt_dequeue(struct runqueue* rq, struct thread* thread) {
+	if (!list_node_linked(&thread->rt.link))
+		return -ENOENT;
+
+	queue_remove(rq, thread);
+	return 0;
+}
+
+static void rt_put_prev(struct runqueue* rq, struct thread* thread) {
+	if (list_node_linked(&thread->rt.link))
+		return;
+
+	/* Preempted threads keep their place, they didn't give up the CPU */
+	bool tail = thread->rt.requeue_tail;
+	thread->rt.requeue_tail = false;
+	queue_add(rq, thread, !tail);
+}
+
+static struct thread* rt_pick_next(struct runqueue* rq) {
+	int prio = highest_prio(&rq->rt);
+	if (prio < 0)
+		return NULL;
+
+	struct thread* next = rt_entry(rq->rt.queues[prio].node.next);
+	queue_remove(rq, next);
+	if (!next->rt.slice_left)
+		next->rt.slice_left = RT_RR_SLICE_TICKS; /* Preempted threads keep what's left of their turn */
+	return next;
+}
+
+static int rt_change_prio(struct runqueue* rq, struct thread* thread, int prio) {
+	if (thread->rt.prio == prio)
+		return 0;
+
+	bool queued = list_node_linked(&thread->rt.link);
+	if (queued)
+		queue_remove(rq, thread);
+	thread->rt.prio = prio;
+	if (queued)
+		queue_add(rq, thread, false);
+
+	return 0;
+}
+
+static bool rt_on_tick(struct runqueue* rq, struct thread* current) {
+	if (current->sched_class != SCHED_CLASS_RR)
+		return false;
+	if (current->rt.slice_left && --current->rt.slice_left)
+		return false;
+
+	current->rt.slice_left = RT_RR_SLICE_TICKS;
+	if (list_empty(&rq->rt.queues[current->rt.prio]))
+		return false; /* Nobody to take turns with */
+
+	current->rt.requeue_tail = true;
+	return true;
+}
+
+static void rt_on_yield(struct runqueue* rq, struct thread* current) {
+	(void)rq;
+	current->rt.requeue_tail = true;
+	current->rt.slice_left = RT_RR_SLICE_TICKS;
+}
+
+static struct thread* rt_steal(struct runqueue* rq, struct cpu* target, bool allow_hot) {
+	struct sched_rt_runqueue* rtq = &rq->rt;
+
+	/* Highest priorities first, they're hurt the most by waiting */
+	for (int i = ARRAY_SIZE(rtq->bitmap) - 1; i >= 0; i--) {
+		u64 bm = rtq->bitmap[i];
+		while (bm) {
+			int bit = 63 - __builtin_clzll(bm);
+			bm &= ~(1ull << bit);
+
+			struct thread* thread;
+			list_for_each_entry(thread, &rtq->queues[i * 64 + bit], rt.link) {
+				if (!sched_can_migrate(rq, thread, target, allow_hot))
+					continue;
+				queue_remove(rq, thread);
+				return thread;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static bool rt_check_preempt(struct runqueue* rq, struct thread* thread) {
+	struct thread* current = rq->current;
+	if (!thread_is_rt(current))
+		return thread_is_rt(thread);
+	return thread_is_rt(thread) && thread->rt.prio > current->rt.prio;
+}
+
+const struct sched_policy_ops sched_rt_ops = {
+	.init = rt_init,
+	.thread_attach = NULL,
+	.thread_detach = NULL,
+	.enqueue = rt_enqueue,
+	.dequeue = rt_dequeue,
+	.put_prev = rt_put_prev,
+	.pick_next = rt_pick_next,
+	.change_prio = rt_change_prio,
+	.on_tick = rt_on_tick,
+	.on_yield = rt_on_yield,
+	.steal = rt_steal,
+	.check_preempt = rt_check_preempt
+};
@@ -0,0 +1,211 @@
+#include <lunar/compiler.h>
+#include <lunar/asm/errno.h>
+#include <lunar/core/cpu.h>
+#include <lunar/core/printk.h>
+#include <lunar/core/cmdline.h>
+#include <lunar/lib/convert.h>
+#include <lunar/lib/format.h>
+#include <lunar/lib/string.h>
+#include <lunar/mm/heap.h>
+#include <lunar/sched/workqueue.h>
+#include "internal.h"
+
+/* What the dump prints about a thread, copied so printing doesn't hold the thread lock */
+struct thread_snapshot {
+	char name[THREAD_NAME_LEN];
+	tid_t id;
+	u32 cpu_id;
+	struct sched_thread_stats stats;
+};
+
+static struct proc* kproc;
+static struct delayed_work dump_work;
+static time_t dump_interval_ms;
+
+static unsigned int lat_bucket(u64 ns) {
+	u64 us = ns / 1000;
+	if (us == 0)
+		return 0;
+
+	unsigned int bucket = 64 - __builtin_clzll(us);
+	return bucket < SCHED_LAT_BUCKETS ? bucket : SCHED_LAT_BUCKETS - 1;
+}
+
+void sched_stats_update_curr(struct runqueue* rq, time_t now) {
+	struct thread* current = rq->current;
+	time_t delta = now - current->stats.exec_start;
+	if (delta <= 0)
+		return;
+
+	current->stats.runtime += delta;
+	current->stats.exec_start = now;
+	if (current == rq->idle)
+		rq->stats.idle_time += delta;
+}
+
+void sched_stats_switch(struct runqueue* rq, struct thread* prev, struct thread* next, bool voluntary, time_t now) {
+	struct sched_cpu_stats* stats = &rq->stats;
+	sched_stats_update_curr(rq, now);
+	stats->nr_switches++;
+
+	if (voluntary) {
+		prev->stats.nr_voluntary++;
+	} else {
+		prev->stats.nr_involuntary++;
+		if (prev != rq->idle)
+			sched_stats_queued(prev, now, false); /* Still runnable, it waits from now on */
+	}
+
+	next->stats.exec_start = now;
+	time_t queued_at = next->stats.queued_at;
+	if (!queued_at)
+		return; /* The idle thread */
+
+	/* The waker may be on another CPU, so its clock can be slightly ahead */
+	u64 delay = now > queued_at ? now - queued_at : 0;
+	next->stats.queued_at = 0;
+	next->stats.wait_time += delay;
+	stats->run_delay += delay;
+	stats->nr_run_delay++;
+	if (next->stats.woken) {
+		stats->wake_latency[lat_bucket(delay)]++;
+		if (delay > stats->wake_latency_max)
+			stats->wake_latency_max = delay;
+	}
+}
+
+int sched_cpu_stats(u32 cpu_id, struct sched_cpu_stats* stats) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	if (cpu_id >= cpus->count || !cpus->cpus[cpu_id])
+		return -EINVAL;
+
+	struct runqueue* rq = &cpus->cpus[cpu_id]->runqueue;
+	irqflags_t irq;
+	spinlock_lock_irq_save(&rq->lock, &irq);
+
+	if (likely(rq->current))
+		sched_stats_update_curr(rq, sched_now());
+	*stats = rq->stats;
+
+	spinlock_unlock_irq_restore(&rq->lock, &irq);
+	return 0;
+}
+
+void sched_thread_stats(struct thread* thread, struct sched_thread_stats* stats) {
+	irqflags_t irq;
+	struct runqueue* rq = thread_rq_lock(thread, &irq);
+
+	if (rq->current == thread)
+		sched_stats_update_curr(rq, sched_now());
+	*stats = thread->stats;
+
+	spinlock_unlock_irq_restore(&rq->lock, &irq);
+}
+
+static void dump_cpu(u32 cpu_id) {
+	struct sched_cpu_stats stats;
+	if (sched_cpu_stats(cpu_id, &stats))
+		return;
+
+	u64 avg_delay = stats.nr_run_delay ? stats.run_delay / stats.nr_run_delay : 0;
+	printk(PRINTK_INFO "sched: CPU %u: %lu switches, idle %lu ms, softirq %lu ms, run delay %lu us avg\n",
+			cpu_id, stats.nr_switches, stats.idle_time / 1000000, stats.softirq_time / 1000000, avg_delay / 1000);
+	printk(PRINTK_INFO "sched: CPU %u: wakeups %lu affine, %lu idle, %lu migrated, %lu remote, %lu IPI's saved\n",
+			cpu_id, stats.wake.affine, stats.wake.idle, stats.wake.migrations, stats.wake.remote, stats.wake.ipis_saved);
+
+	/* Only the buckets that were hit, as "<limit>: count" in microseconds */
+	char buf[256];
+	size_t len = 0;
+	for (unsigned int i = 0; i < SCHED_LAT_BUCKETS; i++) {
+		if (!stats.wake_latency[i])
+			continue;
+
+		int count;
+		if (i == SCHED_LAT_BUCKETS - 1)
+			count = snprintf(buf + len, sizeof(buf) - len, " >=%lu: %lu", 1ul << (i - 1), stats.wake_latency[i]);
+		else
+			count = snprintf(buf + len, sizeof(buf) - len, " <%lu: %lu", 1ul << i, stats.wake_latency[i]);
+		if (count < 0 || (size_t)count >= sizeof(buf) - len)
+			break;
+		len += count;
+	}
+	buf[len] = '\0';
+
+	printk(PRINTK_INFO "sched: CPU %u: wakeup latency max %lu us, histogram (us):%s\n",
+			cpu_id, stats.wake_latency_max / 1000, buf);
+}
+
+void sched_stats_dump(void) {
+	const struct smp_cpus* cpus = smp_cpus_get();
+	for (u32 i = 0; i < cpus->count; i++)
+		dump_cpu(i);
+
+	if (!kproc)
+		return;
+
+	/* Threads created after the count was read are left out, this is only a sample anyway */
+	size_t max = atomic_load(&kproc->thread_count);
+	if (max == 0)
+		return;
+	struct thread_snapshot* snapshots = kmalloc(max * sizeof(*snapshots), MM_ZONE_NORMAL);
+	if (!snapshots) {
+		printk(PRINTK_WARN "sched: No memory to dump thread statistics\n");
+		return;
+	}
+
+	irqflags_t irq;
+	spinlock_lock_irq_save(&kproc->thread_lock, &irq);
+
+	size_t count = 0;
+	struct thread* thread;
+	list_for_each_entry(thread, &kproc->threads, proc_link) {
+		if (count == max)
+			break;
+
+		struct thread_snapshot* snapshot = &snapshots[count++];
+		memcpy(snapshot->name, thread->name, sizeof(snapshot->name));
+		snapshot->id = thread->id;
+		snapshot->cpu_id = thread->target_cpu->sched_processor_id;
+		sched_thread_stats(thread, &snapshot->stats);
+	}
+
+	spinlock_unlock_irq_restore(&kproc->thread_lock, &irq);
+
+	for (size_t i = 0; i < count; i++) {
+		const struct thread_snapshot* snapshot = &snapshots[i];
+		const struct sched_thread_stats* stats = &snapshot->stats;
+		printk(PRINTK_INFO "sched: %s (%i) on CPU %u: run %lu ms, wait %lu ms, %lu voluntary, %lu involuntary, %lu migrations\n",
+				snapshot->name[0] ? snapshot->name : "?", snapshot->id, snapshot->cpu_id,
+				stats->runtime / 1000000, stats->wait_time / 1000000, stats->nr_voluntary,
+				stats->nr_involuntary, stats->nr_migrations);
+	}
+
+	kfree(snapshots);
+}
+
+static void dump_work_fn(void* arg) {
+	(void)arg;
+	sched_stats_dump();
+	queue_delayed_work(system_unbound_wq, &dump_work, dump_interval_ms);
+}
+
+void sched_stats_init(struct proc* kernel_proc) {
+	kproc = kernel_proc;
+
+	const char* cmdline_interval = cmdline_get("sched.stats_interval");
+	if (!cmdline_interval)
+		return;
+
+	unsigned long long interval;
+	int err = kstrtoull(cmdline_interval, 0, &interval);
+	if (err) {
+		printk(PRINTK_ERR "sched: Failed to parse sched.stats_interval: %i\n", err);
+		return;
+	}
+	if (interval == 0)
+		return;
+
+	dump_interval_ms = interval * 1000;
+	delayed_work_init(&dump_work, dump_work_fn, NULL);
+	queue_delayed_work(system_unbound_wq, &dump_work, dump_interval_ms);
+}
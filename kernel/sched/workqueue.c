@@ -1,99 +1,526 @@
 #include <lunar/core/panic.h>
-#include <lunar/asm/cpuid.h>
 #include <lunar/asm/wrap.h>
 #include <lunar/lib/list.h>
+#include <lunar/lib/string.h>
 #include <lunar/sched/kthread.h>
-#include <lunar/mm/slab.h>
-#include <lunar/core/semaphore.h>
+#include <lunar/sched/workqueue.h>
+#include <lunar/mm/heap.h>
+#include <lunar/core/waitqueue.h>
+#include <lunar/core/printk.h>
 #include <lunar/core/cpu.h>
 #include "internal.h"
 
-static LIST_HEAD_DEFINE(global_workqueue);
-static SPINLOCK_DEFINE(global_lock);
-static SEMAPHORE_DEFINE(global_sem, 0);
+/*
+ * Work runs in pools of workers, one pool for every CPU and one for unbound work. A CPU's pool only
+ * wakes a worker when none of its workers are running, and the scheduler tells the pool when a
+ * worker blocks so another one can take over. Every worker that starts on work makes sure there's
+ * an idle worker left for that, extra idle workers exit after a while.
+ */
 
-static int worker_thread(void* arg) {
-	struct cpu* cpu = arg;
+#define WORKERS_MAX 32 /* Per pool */
+#define WORKER_IDLE_TIMEOUT_MS 300000
 
-	spinlock_t* const lock = cpu ? &cpu->workqueue_lock : &global_lock;
-	struct list_head* const list = cpu ? &cpu->workqueue : &global_workqueue;
-	struct semaphore* const sem = cpu ? &cpu->workqueue_sem : &global_sem;
-	while (1) {
-		semaphore_wait(sem, 0);
+struct worker {
+	struct thread* thread;
+	struct worker_pool* pool;
+	struct work* current; /* The work item being run */
+	struct workqueue* current_wq;
+	struct list_node link; /* Link for pool->workers */
+	struct list_node idle_link; /* Link for pool->idle */
+	bool active; /* Counted in pool->nr_running */
+	bool blocked; /* Active, but sleeping so it's not counted */
+};
+
+struct worker_pool {
+	struct cpu* cpu; /* NULL for the unbound pool */
+	struct list_head works;
+	struct list_head workers;
+	struct list_head idle; /* Most recently idle first, so the others can time out */
+	unsigned int nr_workers;
+	unsigned int nr_idle; /* Idle workers, including ones that are starting up */
+	unsigned int next_id;
+	atomic(unsigned int) nr_running; /* Workers running work that aren't blocked */
+	unsigned int flushers; /* Threads waiting in flush_work() */
+	struct wait_queue flush_wait;
+	spinlock_t lock;
+};
+
+struct workqueue {
+	char name[32];
+	int flags;
+	atomic(long) nr_pending; /* Queued or running work items */
+	struct wait_queue flush_wait; /* The lock is held while the last item finishes, so it's safe to free after a flush */
+	bool active; /* WQ_ORDERED: an item is in the pool, protected by the unbound pool's lock */
+	struct list_head inactive; /* WQ_ORDERED: items waiting for the active one, protected by the unbound pool's lock */
+};
+
+static struct worker_pool unbound_pool;
+
+struct workqueue* system_wq = NULL;
+struct workqueue* system_unbound_wq = NULL;
+
+static inline time_t now_ns(void) {
+	struct timespec ts = timekeeper_time();
+	return timespec_to_ns(&ts);
+}
+
+/* Call with the pool locked */
+static void wake_idle_worker(struct worker_pool* pool) {
+	/* Workers that are still starting up check for work on their own */
+	if (list_empty(&pool->idle))
+		return;
+
+	struct worker* worker = list_first_entry(&pool->idle, struct worker, idle_link);
+	list_remove(&worker->idle_link);
+	pool->nr_idle--;
+	assert(sched_wakeup(worker->thread, 0) == 0);
+}
+
+/* Call with the pool locked */
+static void pool_insert(struct worker_pool* pool, struct work* work) {
+	list_add_tail(&pool->works, &work->link);
+	if (!pool->cpu || atomic_load(&pool->nr_running) == 0)
+		wake_idle_worker(pool);
+}
+
+/* Let the next item of an ordered workqueue into the pool. Call with the unbound pool locked. */
+static void ordered_next(struct workqueue* wq) {
+	if (list_empty(&wq->inactive)) {
+		wq->active = false;
+		return;
+	}
+
+	struct work* work = list_first_entry(&wq->inactive, struct work, link);
+	list_remove(&work->link);
+	atomic_fetch_and(&work->flags, ~WORK_INACTIVE);
+	pool_insert(&unbound_pool, work);
+}
+
+static void workqueue_put(struct workqueue* wq) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&wq->flush_wait.lock, &irq);
+	if (atomic_sub_fetch(&wq->nr_pending, 1) == 0)
+		wake_up_locked(&wq->flush_wait, true);
+	spinlock_unlock_irq_restore(&wq->flush_wait.lock, &irq);
+}
+
+/* The caller owns the pending bit. Call with IRQ's disabled. */
+static void __queue_work(struct workqueue* wq, struct cpu* cpu, struct work* work) {
+	struct worker_pool* pool;
+	if (wq->flags & WQ_UNBOUND)
+		pool = &unbound_pool;
+	else
+		pool = (cpu ? cpu : current_cpu())->worker_pool;
+
+	atomic_add_fetch(&wq->nr_pending, 1);
+
+	spinlock_lock(&pool->lock);
+	work->wq = wq;
+	atomic_store(&work->pool, pool);
+	if ((wq->flags & WQ_ORDERED) && wq->active) {
+		atomic_fetch_or(&work->flags, WORK_INACTIVE);
+		list_add_tail(&wq->inactive, &work->link);
+	} else {
+		if (wq->flags & WQ_ORDERED)
+			wq->active = true;
+		pool_insert(pool, work);
+	}
+	spinlock_unlock(&pool->lock);
+}
+
+bool queue_work_on(struct workqueue* wq, struct cpu* cpu, struct work* work) {
+	/* Nothing can interrupt between taking the pending bit and queueing, cancel_work() relies on it */
+	irqflags_t irq = local_irq_save();
+	bool queued = !(atomic_fetch_or(&work->flags, WORK_PENDING) & WORK_PENDING);
+	if (queued)
+		__queue_work(wq, cpu, work);
+	local_irq_restore(irq);
+	return queued;
+}
+
+bool queue_work(struct workqueue* wq, struct work* work) {
+	return queue_work_on(wq, NULL, work);
+}
+
+static void delayed_work_timer(void* arg) {
+	struct delayed_work* dwork = arg;
+	__queue_work(dwork->wq, NULL, &dwork->work);
+}
+
+void delayed_work_init(struct delayed_work* dwork, void (*fn)(void*), void* arg) {
+	work_init(&dwork->work, fn, arg);
+	timer_init(&dwork->timer, delayed_work_timer, dwork);
+	dwork->wq = NULL;
+}
+
+bool queue_delayed_work(struct workqueue* wq, struct delayed_work* dwork, time_t delay_ms) {
+	irqflags_t irq = local_irq_save();
+	bool queued = !(atomic_fetch_or(&dwork->work.flags, WORK_PENDING) & WORK_PENDING);
+	if (queued) {
+		if (delay_ms == 0) {
+			__queue_work(wq, NULL, &dwork->work);
+		} else {
+			dwork->wq = wq;
+			timer_arm(&dwork->timer, now_ns() + delay_ms * 1000000);
+		}
+	}
+	local_irq_restore(irq);
+	return queued;
+}
+
+bool cancel_work(struct work* work) {
+	while (work_pending(work)) {
+		/* Pending but not on a list yet, the other CPU is in the middle of queueing it */
+		struct worker_pool* pool = atomic_load(&work->pool);
+		if (!pool) {
+			cpu_relax();
+			continue;
+		}
 
 		irqflags_t irq;
-		spinlock_lock_irq_save(lock, &irq);
+		spinlock_lock_irq_save(&pool->lock, &irq);
 
-		struct work* work = NULL;
-		if (!list_empty(list)) {
-			work = list_first_entry(list, struct work, link);
+		struct workqueue* wq = work->wq;
+		bool queued = work_pending(work) && atomic_load(&work->pool) == pool && list_node_linked(&work->link);
+		if (queued) {
 			list_remove(&work->link);
+			unsigned long flags = atomic_fetch_and(&work->flags, ~(WORK_PENDING | WORK_INACTIVE));
+			if ((wq->flags & WQ_ORDERED) && !(flags & WORK_INACTIVE))
+				ordered_next(wq);
 		}
 
-		spinlock_unlock_irq_restore(lock, &irq);
-		if (work)
-			work->fn(work->arg);
+		spinlock_unlock_irq_restore(&pool->lock, &irq);
+		if (queued) {
+			workqueue_put(wq);
+			return true;
+		}
+		cpu_relax();
 	}
 
-	kthread_exit(0);
+	return false;
 }
 
-static struct slab_cache* atomic_work_cache = NULL;
+/* Call with the pool locked */
+static bool work_busy(struct worker_pool* pool, struct work* work) {
+	if (work_pending(work) && atomic_load(&work->pool) == pool)
+		return true;
 
-static int __sched_workqueue_add(struct list_head* wq,
-		struct semaphore* wq_sem, spinlock_t* wq_lock,
-		void (*fn)(void*), void* arg) {
-	struct work* work = slab_cache_alloc(atomic_work_cache);
-	if (!work)
-		return -ENOMEM;
+	struct worker* worker;
+	list_for_each_entry(worker, &pool->workers, link) {
+		if (worker->current == work)
+			return true;
+	}
 
-	work->fn = fn;
-	work->arg = arg;
-	list_node_init(&work->link);
+	return false;
+}
+
+struct work_flush {
+	struct worker_pool* pool;
+	struct work* work;
+};
+
+static bool work_flushed(void* arg) {
+	struct work_flush* flush = arg;
 
 	irqflags_t irq;
-	spinlock_lock_irq_save(wq_lock, &irq);
-	list_add_tail(wq, &work->link);
-	spinlock_unlock_irq_restore(wq_lock, &irq);
+	spinlock_lock_irq_save(&flush->pool->lock, &irq);
+	bool busy = work_busy(flush->pool, flush->work);
+	spinlock_unlock_irq_restore(&flush->pool->lock, &irq);
+	return !busy;
+}
+
+bool flush_work(struct work* work) {
+	struct thread* current = current_thread();
+	bug(current->worker && current->worker->current == work);
+
+	struct worker_pool* pool = atomic_load(&work->pool);
+	if (!pool)
+		return false;
+
+	/* Counted before checking, so a worker finishing the item right after sees it has to wake this up */
+	irqflags_t irq;
+	spinlock_lock_irq_save(&pool->lock, &irq);
+	bool busy = work_busy(pool, work);
+	if (busy)
+		pool->flushers++;
+	spinlock_unlock_irq_restore(&pool->lock, &irq);
+	if (!busy)
+		return false;
+
+	struct work_flush flush = { .pool = pool, .work = work };
+	wait_event(&pool->flush_wait, work_flushed, &flush, 0);
+
+	spinlock_lock_irq_save(&pool->lock, &irq);
+	pool->flushers--;
+	spinlock_unlock_irq_restore(&pool->lock, &irq);
+	return true;
+}
+
+bool cancel_work_sync(struct work* work) {
+	bool pending = cancel_work(work);
+	flush_work(work);
+	return pending;
+}
+
+bool cancel_delayed_work(struct delayed_work* dwork) {
+	if (timer_cancel(&dwork->timer)) {
+		atomic_fetch_and(&dwork->work.flags, ~WORK_PENDING);
+		return true;
+	}
+
+	return cancel_work(&dwork->work);
+}
+
+bool cancel_delayed_work_sync(struct delayed_work* dwork) {
+	bool pending;
+	if (timer_cancel_sync(&dwork->timer)) {
+		atomic_fetch_and(&dwork->work.flags, ~WORK_PENDING);
+		pending = true;
+	} else {
+		pending = cancel_work(&dwork->work);
+	}
 
-	semaphore_signal(wq_sem);
+	flush_work(&dwork->work);
+	return pending;
+}
+
+static int worker_thread(void* arg);
+
+/* The pool already counts the worker in nr_workers and nr_idle */
+static int create_worker(struct worker_pool* pool, unsigned int id) {
+	struct worker* worker = kzalloc(sizeof(*worker), MM_ZONE_NORMAL);
+	if (!worker)
+		return -ENOMEM;
+
+	worker->pool = pool;
+	list_node_init(&worker->link);
+	list_node_init(&worker->idle_link);
+
+	/* Bound workers are only created on their own CPU */
+	tid_t tid;
+	if (pool->cpu)
+		tid = kthread_create(SCHED_THIS_CPU, worker_thread, worker, "worker%u-%u", pool->cpu->sched_processor_id, id);
+	else
+		tid = kthread_create(0, worker_thread, worker, "worker-u%u", id);
+	if (tid < 0) {
+		kfree(worker);
+		return tid;
+	}
+
+	bug(kthread_detach(tid) != 0);
 	return 0;
 }
 
-int sched_workqueue_add(void (*fn)(void*), void* arg) {
-	return __sched_workqueue_add(&global_workqueue, &global_sem, &global_lock, fn, arg);
+/* Call with the pool locked, it's unlocked while creating the worker */
+static int pool_add_worker(struct worker_pool* pool, irqflags_t* irq) {
+	pool->nr_workers++;
+	pool->nr_idle++;
+	unsigned int id = pool->next_id++;
+	spinlock_unlock_irq_restore(&pool->lock, irq);
+
+	int err = create_worker(pool, id);
+
+	spinlock_lock_irq_save(&pool->lock, irq);
+	if (err) {
+		pool->nr_workers--;
+		pool->nr_idle--;
+	}
+	return err;
 }
 
-int sched_workqueue_add_on(struct cpu* cpu, void(*fn)(void*), void* arg) {
-	return __sched_workqueue_add(&cpu->workqueue, &cpu->workqueue_sem, &cpu->workqueue_lock, fn, arg);
+/* Sleep until there's work, returns false if the worker should exit. Call with the pool locked. */
+static bool worker_idle(struct worker_pool* pool, struct worker* worker, irqflags_t* irq) {
+	list_add(&pool->idle, &worker->idle_link);
+	pool->nr_idle++;
+	sched_prepare_sleep(WORKER_IDLE_TIMEOUT_MS, SCHED_SLEEP_BLOCK);
+	spinlock_unlock_irq_restore(&pool->lock, irq);
+
+	int err = schedule();
+
+	spinlock_lock_irq_save(&pool->lock, irq);
+	if (!list_node_linked(&worker->idle_link))
+		return true; /* Taken off the list by whoever woke it up */
+	list_remove(&worker->idle_link);
+	pool->nr_idle--;
+
+	/* One idle worker always stays */
+	return err != -ETIMEDOUT || pool->nr_idle == 0 || !list_empty(&pool->works);
 }
 
-void workqueue_cpu_init(void) {
-	struct cpu* cpu = current_cpu();
+static int worker_thread(void* arg) {
+	struct worker* worker = arg;
+	struct worker_pool* pool = worker->pool;
+	struct thread* current = current_thread();
 
-	semaphore_init(&cpu->workqueue_sem, 0);
-	spinlock_init(&cpu->workqueue_lock);
-	list_head_init(&cpu->workqueue);
+	irqflags_t irq;
+	spinlock_lock_irq_save(&pool->lock, &irq);
+	worker->thread = current;
+	current->worker = worker;
+	list_add_tail(&pool->workers, &worker->link);
+	pool->nr_idle--;
 
-	/* global workqueue */
-	tid_t id = kthread_create(SCHED_THIS_CPU, worker_thread, NULL, 
-			"worker%u-%u", current_cpu()->sched_processor_id, 0);
-	if (id < 0)
-		panic("Failed to create worker threads");
-	kthread_detach(id);
+	while (1) {
+		if (list_empty(&pool->works)) {
+			if (worker->active) {
+				worker->active = false;
+				atomic_sub_fetch(&pool->nr_running, 1);
+			}
+			if (!worker_idle(pool, worker, &irq))
+				break;
+			continue;
+		}
+
+		/* A CPU's pool keeps one item running, the running worker gets to the rest or wakes one up when it blocks */
+		if (!worker->active && pool->cpu && atomic_load(&pool->nr_running) > 0) {
+			if (!worker_idle(pool, worker, &irq))
+				break;
+			continue;
+		}
+
+		if (!worker->active) {
+			worker->active = true;
+			atomic_add_fetch(&pool->nr_running, 1);
+		}
+
+		/* Have a worker ready to take over if this one blocks */
+		if (pool->nr_idle == 0 && pool->nr_workers < WORKERS_MAX) {
+			int err = pool_add_worker(pool, &irq);
+			if (err)
+				printk(PRINTK_WARN "sched: Failed to create a worker (%d)\n", err);
+			if (!err || list_empty(&pool->works))
+				continue;
+		}
+
+		struct work* work = list_first_entry(&pool->works, struct work, link);
+		list_remove(&work->link);
+		void (*fn)(void*) = work->fn;
+		void* fn_arg = work->arg;
+		struct workqueue* wq = work->wq;
+		worker->current = work;
+		worker->current_wq = wq;
+		atomic_fetch_and(&work->flags, ~WORK_PENDING); /* Can be queued again from here on */
+		spinlock_unlock_irq_restore(&pool->lock, &irq);
+
+		fn(fn_arg);
+
+		spinlock_lock_irq_save(&pool->lock, &irq);
+		worker->current = NULL;
+		worker->current_wq = NULL;
+		if (wq->flags & WQ_ORDERED)
+			ordered_next(wq);
+		bool flushers = pool->flushers != 0;
+		spinlock_unlock_irq_restore(&pool->lock, &irq);
+
+		if (flushers)
+			wake_up_all(&pool->flush_wait);
+		workqueue_put(wq);
 
-	/* per-cpu workqueue */
-	id = kthread_create(SCHED_THIS_CPU, worker_thread, current_cpu(),
-			"worker%u-%u", current_cpu()->sched_processor_id, 1);
-	if (id < 0)
+		spinlock_lock_irq_save(&pool->lock, &irq);
+	}
+
+	list_remove(&worker->link);
+	pool->nr_workers--;
+	current->worker = NULL;
+	spinlock_unlock_irq_restore(&pool->lock, &irq);
+
+	kfree(worker);
+	kthread_exit(0);
+}
+
+void wq_worker_sleeping(struct thread* thread) {
+	struct worker* worker = thread->worker;
+	if (!worker->active || worker->blocked)
+		return;
+
+	/* The last running worker of a CPU's pool is blocking, so let another one run the rest */
+	worker->blocked = true;
+	struct worker_pool* pool = worker->pool;
+	if (atomic_sub_fetch(&pool->nr_running, 1) != 0 || !pool->cpu)
+		return;
+
+	spinlock_lock(&pool->lock);
+	if (!list_empty(&pool->works))
+		wake_idle_worker(pool);
+	spinlock_unlock(&pool->lock);
+}
+
+void wq_worker_running(struct thread* thread) {
+	struct worker* worker = thread->worker;
+	if (worker->blocked) {
+		worker->blocked = false;
+		atomic_add_fetch(&worker->pool->nr_running, 1);
+	}
+}
+
+struct workqueue* workqueue_create(const char* name, int flags) {
+	struct workqueue* wq = kmalloc(sizeof(*wq), MM_ZONE_NORMAL);
+	if (!wq)
+		return NULL;
+
+	strlcpy(wq->name, name, sizeof(wq->name));
+	wq->flags = flags & WQ_ORDERED ? flags | WQ_UNBOUND : flags;
+	atomic_store(&wq->nr_pending, 0);
+	wait_queue_init(&wq->flush_wait);
+	wq->active = false;
+	list_head_init(&wq->inactive);
+	return wq;
+}
+
+static bool workqueue_idle(void* arg) {
+	struct workqueue* wq = arg;
+	return atomic_load(&wq->nr_pending) == 0;
+}
+
+void workqueue_flush(struct workqueue* wq) {
+	wait_event(&wq->flush_wait, workqueue_idle, wq, 0);
+}
+
+void workqueue_destroy(struct workqueue* wq) {
+	workqueue_flush(wq);
+	kfree(wq);
+}
+
+static void pool_init(struct worker_pool* pool, struct cpu* cpu) {
+	pool->cpu = cpu;
+	list_head_init(&pool->works);
+	list_head_init(&pool->workers);
+	list_head_init(&pool->idle);
+	pool->nr_workers = 0;
+	pool->nr_idle = 0;
+	pool->next_id = 0;
+	atomic_store(&pool->nr_running, 0);
+	pool->flushers = 0;
+	wait_queue_init(&pool->flush_wait);
+	spinlock_init(&pool->lock);
+}
+
+static void pool_start(struct worker_pool* pool) {
+	irqflags_t irq;
+	spinlock_lock_irq_save(&pool->lock, &irq);
+	int err = pool_add_worker(pool, &irq);
+	spinlock_unlock_irq_restore(&pool->lock, &irq);
+	if (err)
 		panic("Failed to create worker threads");
-	kthread_detach(id);
+}
+
+void workqueue_cpu_init(void) {
+	struct cpu* cpu = current_cpu();
+	struct worker_pool* pool = kmalloc(sizeof(*pool), MM_ZONE_NORMAL);
+	if (!pool)
+		panic("Failed to allocate a worker pool");
+
+	pool_init(pool, cpu);
+	cpu->worker_pool = pool;
+	pool_start(pool);
 }
 
 void workqueue_init(void) {
-	atomic_work_cache = slab_cache_create(sizeof(struct work), _Alignof(struct work),
-			MM_ZONE_NORMAL | MM_ATOMIC, NULL, NULL);
-	if (unlikely(!atomic_work_cache))
-		panic("Failed to create atomic workqueue cache");
+	pool_init(&unbound_pool, NULL);
 	workqueue_cpu_init();
+	pool_start(&unbound_pool);
+
+	system_wq = workqueue_create("events", 0);
+	system_unbound_wq = workqueue_create("events_unbound", WQ_UNBOUND);
+	if (!system_wq || !system_unbound_wq)
+		panic("Failed to create the system workqueues");
 }